@@ -0,0 +1,107 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "concurrency_tuner.h"
+
+#include <algorithm>
+
+#include "log.h"
+
+namespace {
+
+// Changes of throughput smaller than that are considered noise.
+constexpr double kTolerance = 0.05;
+
+double Ratio(double cur, double prev) {
+  if (prev > 0) {
+    return cur / prev;
+  }
+  return cur > 0 ? 2 : 1;
+}
+
+}  // anonymous namespace
+
+HillClimber::HillClimber(size_t initial, size_t min, size_t max)
+    : min_(min), max_(max), level_(std::clamp(initial, min, max)) {}
+
+size_t HillClimber::Update(double bytes_per_sec, double files_per_sec) {
+  if (prev_) {
+    const double change = (Ratio(bytes_per_sec, prev_->first) +
+                           Ratio(files_per_sec, prev_->second)) /
+                          2;
+    if (change < 1 - kTolerance) {
+      direction_ = -direction_;
+    } else if (change <= 1 + kTolerance) {
+      // No gain from the last move - prefer fewer workers.
+      direction_ = -1;
+    }
+  }
+  prev_ = std::make_pair(bytes_per_sec, files_per_sec);
+  if ((direction_ > 0 && level_ == max_) ||
+      (direction_ < 0 && level_ == min_)) {
+    direction_ = -direction_;
+  }
+  level_ = std::clamp<size_t>(level_ + direction_, min_, max_);
+  return level_;
+}
+
+ConcurrencyTuner::ConcurrencyTuner(SyncThreadPool &pool, size_t initial,
+                                   size_t max,
+                                   std::chrono::milliseconds period)
+    : pool_(pool), period_(period), climber_(initial, 1, max) {
+  pool_.SetActiveWorkers(climber_.Level());
+  thread_ = std::thread(&ConcurrencyTuner::TuneLoop, this);
+}
+
+ConcurrencyTuner::~ConcurrencyTuner() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    cv_.notify_all();
+  }
+  thread_.join();
+}
+
+size_t ConcurrencyTuner::Level() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return climber_.Level();
+}
+
+void ConcurrencyTuner::TuneLoop() {
+  using std::chrono::duration;
+  using std::chrono::steady_clock;
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto last = steady_clock::now();
+  while (!cv_.wait_for(lock, period_, [this] { return stopping_; })) {
+    const auto now = steady_clock::now();
+    const double secs = duration<double>(now - last).count();
+    last = now;
+    const uint64_t bytes = bytes_.exchange(0);
+    const uint64_t files = files_.exchange(0);
+    if (files == 0) {
+      // Hashing is starved (e.g. by directory traversal), so there is
+      // nothing to learn.
+      continue;
+    }
+    const size_t level = climber_.Update(bytes / secs, files / secs);
+    DLOG("Concurrency: " << bytes / secs << " B/s, " << files / secs
+                         << " files/s, switching to " << level);
+    pool_.SetActiveWorkers(level);
+  }
+}
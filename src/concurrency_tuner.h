@@ -0,0 +1,90 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_CONCURRENCY_TUNER_H_
+#define SRC_CONCURRENCY_TUNER_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "synch_thread_pool.h"
+
+// Hill-climbing controller picking the concurrency level. It keeps moving the
+// level in one direction as long as throughput improves and turns back once
+// it drops, so it ends up oscillating around the best level and follows it
+// if the workload changes. Throughput is measured both in bytes and in files
+// per second, so that it works for big and small files alike.
+class HillClimber {
+ public:
+  HillClimber(size_t initial, size_t min, size_t max);
+
+  // Feed the throughput observed at the current level; returns the level to
+  // use next.
+  size_t Update(double bytes_per_sec, double files_per_sec);
+  size_t Level() const { return level_; }
+
+ private:
+  const size_t min_;
+  const size_t max_;
+  size_t level_;
+  int direction_{1};
+  std::optional<std::pair<double, double>> prev_;
+};
+
+// Periodically adjusts the number of active workers in a pool based on how
+// much data the tasks report to have processed.
+class ConcurrencyTuner {
+ public:
+  ConcurrencyTuner(SyncThreadPool &pool, size_t initial, size_t max,
+                   std::chrono::milliseconds period = std::chrono::seconds(1));
+  ~ConcurrencyTuner();
+
+  // Called by the tasks, from any thread.
+  void FileProcessed(off_t size) {
+    bytes_ += size;
+    ++files_;
+  }
+  size_t Level() const;
+
+  ConcurrencyTuner(const ConcurrencyTuner &) = delete;
+  ConcurrencyTuner &operator=(const ConcurrencyTuner &) = delete;
+
+ private:
+  void TuneLoop();
+
+  SyncThreadPool &pool_;
+  const std::chrono::milliseconds period_;
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> files_{0};
+  mutable std::mutex mutex_;  // protects everything below
+  HillClimber climber_;
+  bool stopping_{};
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+#endif  // SRC_CONCURRENCY_TUNER_H_
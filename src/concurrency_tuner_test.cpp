@@ -0,0 +1,81 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "concurrency_tuner.h"
+
+#include <atomic>
+#include <cmath>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Throughput peaking at level 12.
+double Throughput(size_t level) {
+  return 1000 - std::abs(static_cast<double>(level) - 12) * 80;
+}
+
+}  // anonymous namespace
+
+TEST(HillClimber, ConvergesToOptimum) {
+  HillClimber climber(4, 1, 64);
+  for (int i = 0; i < 50; ++i) {
+    const double t = Throughput(climber.Level());
+    climber.Update(t * 1000, t);
+  }
+  // It keeps probing around the optimum.
+  for (int i = 0; i < 10; ++i) {
+    const double t = Throughput(climber.Level());
+    climber.Update(t * 1000, t);
+    ASSERT_GE(climber.Level(), 10U);
+    ASSERT_LE(climber.Level(), 14U);
+  }
+}
+
+TEST(HillClimber, BacksOffWithoutGain) {
+  HillClimber climber(8, 1, 64);
+  for (int i = 0; i < 20; ++i) {
+    climber.Update(100, 10);
+  }
+  ASSERT_LE(climber.Level(), 2U);
+}
+
+TEST(HillClimber, RespectsBounds) {
+  HillClimber climber(3, 2, 4);
+  for (int i = 0; i < 20; ++i) {
+    climber.Update(100.0 * climber.Level(), 1.0 * climber.Level());
+    ASSERT_GE(climber.Level(), 2U);
+    ASSERT_LE(climber.Level(), 4U);
+  }
+}
+
+TEST(ConcurrencyTuner, SetsPoolLevel) {
+  SyncThreadPool pool(8);
+  {
+    ConcurrencyTuner tuner(pool, 3, 8, std::chrono::milliseconds(10));
+    ASSERT_EQ(pool.ActiveWorkers(), 3U);
+    ASSERT_EQ(tuner.Level(), 3U);
+  }
+  std::atomic<int> done{0};
+  for (int i = 0; i < 100; ++i) {
+    pool.Submit([&done] { ++done; });
+  }
+  pool.Stop();
+  ASSERT_EQ(done, 100);
+}
@@ -21,7 +21,10 @@
 
 #include <cstdlib>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include <boost/program_options.hpp>
 #include <memory>
@@ -36,12 +39,13 @@ void ParseArgv(int argc, const char *const argv[]) {
   namespace po = boost::program_options;
 
   po::variables_map vm;
+  std::string concurrency;
   po::options_description hidden_desc("Hidden options");
   hidden_desc.add_options()(
       "directory,d",
       po::value<std::vector<std::string>>(&conf->dirs_)->composing(),
       "directory to analyze");
-  po::options_description desc("usage: dupa dir1 [dir2]");
+  po::options_description desc("usage: dupa dir1 [dir2 ...]");
   desc.add_options()("help,h", "produce help message")(
       "read_cache_from,c", po::value<std::string>(&conf->read_cache_from_),
       "path to the file from which to read checksum cache")(
@@ -49,6 +53,16 @@ void ParseArgv(int argc, const char *const argv[]) {
       "path to which to dump the checksum cache")(
       "sql_out,o", po::value<std::string>(&conf->sql_out_),
       "if set, path to where SQLite3 results will be dumped")(
+      "sql_in", po::value<std::string>(&conf->sql_in_),
+      "reuse results dumped with -o by a previous analysis of the same "
+      "directory; only directories which have changed since are compared "
+      "again")(
+      "snapshot_out", po::value<std::string>(&conf->snapshot_out_),
+      "if set, path to where a snapshot of the analysis results will be "
+      "written")(
+      "snapshot_in", po::value<std::string>(&conf->snapshot_in_),
+      "report results from a snapshot written with --snapshot_out instead of "
+      "analyzing a directory")(
       "cache_only,1", po::bool_switch(&conf->cache_only_)->default_value(false),
       "only generate checksums cache")(
       "use_size,s", po::bool_switch(&conf->use_size_)->default_value(false),
@@ -61,18 +75,65 @@ void ParseArgv(int argc, const char *const argv[]) {
       "when comparing directories, don't print renames")(
       "verbose,v", po::bool_switch(&conf->verbose_)->default_value(false),
       "be verbose")("concurrency,j",
-                    po::value<int>(&conf->concurrency_)->default_value(4),
-                    "number of concurrently computed checksums")(
+                    po::value<std::string>(&concurrency)->default_value("4"),
+                    "number of concurrently computed checksums or \"auto\" "
+                    "to adjust it to the observed throughput")(
+      "list_concurrency",
+      po::value<int>(&conf->list_concurrency_)->default_value(64),
+      "number of directories listed concurrently; raise it for network "
+      "filesystems with high latency")(
       "tolerable_diff_pct,t",
       po::value<int>(&conf->tolerable_diff_pct_)->default_value(20),
       "directories different by this percent or less will be considered "
-      "duplicates");
+      "duplicates")(
+      "approximate",
+      po::bool_switch(&conf->approximate_)->default_value(false),
+      "find similar directories using MinHash sketches; much faster for huge "
+      "hierarchies, but some duplicate directories may be missed")(
+      "deterministic",
+      po::bool_switch(&conf->deterministic_)->default_value(false),
+      "classify directories and number equivalence classes independently of "
+      "the order in which files were scanned")(
+      "dedup", po::bool_switch(&conf->dedup_)->default_value(false),
+      "find duplicates within and across 2 directories instead of comparing "
+      "them; implied for more than 2")(
+      "label", po::value<std::vector<std::string>>(&conf->labels_),
+      "name under which a directory is reported when deduplicating more than "
+      "one; specified once per directory, in the same order (defaults to the "
+      "directories as given)")(
+      "exclude", po::value<std::vector<std::string>>(&conf->exclude_),
+      "skip files and directories matching this glob pattern; can be "
+      "specified multiple times")(
+      "exclude_regex",
+      po::value<std::vector<std::string>>(&conf->exclude_regex_),
+      "skip files and directories whose paths match this extended regular "
+      "expression; can be specified multiple times")(
+      "include", po::value<std::vector<std::string>>(&conf->include_),
+      "only consider files matching this glob pattern; can be specified "
+      "multiple times")("min_size",
+                        po::value<off_t>(&conf->min_size_)->default_value(0),
+                        "skip files smaller than this many bytes")(
+      "max_size", po::value<off_t>(&conf->max_size_)->default_value(0),
+      "skip files larger than this many bytes (0 means no limit)")(
+      "one_file_system,x",
+      po::bool_switch(&conf->one_file_system_)->default_value(false),
+      "don't descend into directories on other filesystems")(
+      "resume", po::bool_switch(&conf->resume_)->default_value(false),
+      "resume an interrupted scan from the checkpoint stored in the checksum "
+      "cache dumped with -C")(
+      "checkpoint_interval",
+      po::value<int>(&conf->checkpoint_interval_)->default_value(300),
+      "how often (in seconds) to store scan progress in the checksum cache "
+      "dumped with -C (0 disables checkpoints)")(
+      "watch", po::bool_switch(&conf->watch_)->default_value(false),
+      "keep watching the directory for changes and print a report on "
+      "SIGUSR1");
 
   try {
     po::options_description effective_desc;
     effective_desc.add(hidden_desc).add(desc);
     po::positional_options_description p;
-    p.add("directory", 2);
+    p.add("directory", -1);
     po::store(po::command_line_parser(argc, argv)
                   .options(effective_desc)
                   .positional(p)
@@ -93,10 +154,89 @@ void ParseArgv(int argc, const char *const argv[]) {
     std::cerr << desc << std::endl;
     exit(0);
   }
-  if (Conf().dirs_.empty()) {
+  if (!conf->snapshot_in_.empty()) {
+    if (!conf->dirs_.empty() || conf->cache_only_ || conf->watch_) {
+      std::cerr << "--snapshot_in can't be combined with directories, "
+                   "--cache_only or --watch"
+                << std::endl;
+      exit(1);
+    }
+    if (conf->snapshot_in_ == conf->snapshot_out_) {
+      std::cerr << "--snapshot_in and --snapshot_out have to differ"
+                << std::endl;
+      exit(1);
+    }
+  } else if (Conf().dirs_.empty()) {
     std::cerr << desc << std::endl;
     exit(1);
   }
+  if (conf->watch_ &&
+      (conf->dirs_.size() != 1 || conf->cache_only_ ||
+       (!conf->ignore_db_prefix_ && conf->dirs_[0].find("db:") == 0))) {
+    std::cerr << "--watch requires a single directory" << std::endl;
+    exit(1);
+  }
+  const bool compare = conf->dirs_.size() == 2 && !conf->dedup_;
+  if (!conf->sql_in_.empty() &&
+      (conf->dirs_.empty() || compare || conf->cache_only_ || conf->watch_)) {
+    std::cerr << "--sql_in requires deduplicating directories and can't be "
+                 "combined with --cache_only or --watch"
+              << std::endl;
+    exit(1);
+  }
+  if (!conf->labels_.empty()) {
+    if (compare || conf->cache_only_ || conf->watch_ ||
+        conf->labels_.size() != conf->dirs_.size()) {
+      std::cerr << "--label requires deduplicating directories and has to be "
+                   "given once for every directory"
+                << std::endl;
+      exit(1);
+    }
+    if (std::find(conf->labels_.begin(), conf->labels_.end(), "") !=
+        conf->labels_.end()) {
+      std::cerr << "--label can't be empty" << std::endl;
+      exit(1);
+    }
+  }
+  if (!compare && conf->dirs_.size() > 1 && !conf->cache_only_) {
+    std::vector<std::string> labels =
+        conf->labels_.empty() ? conf->dirs_ : conf->labels_;
+    std::sort(labels.begin(), labels.end());
+    if (std::adjacent_find(labels.begin(), labels.end()) != labels.end()) {
+      std::cerr << "directories have to be given distinct labels; use --label"
+                << std::endl;
+      exit(1);
+    }
+  }
+  if (concurrency == "auto") {
+    conf->auto_concurrency_ = true;
+    conf->concurrency_ = kMaxAutoConcurrency;
+  } else {
+    try {
+      size_t parsed = 0;
+      conf->concurrency_ = std::stoi(concurrency, &parsed);
+      if (parsed != concurrency.size()) {
+        conf->concurrency_ = 0;  // trailing junk
+      }
+    } catch (const std::exception &) {
+      conf->concurrency_ = 0;
+    }
+    if (conf->concurrency_ <= 0) {
+      std::cerr << "--concurrency has to be a positive number or \"auto\""
+                << std::endl;
+      exit(1);
+    }
+  }
+  if (conf->list_concurrency_ <= 0 ||
+      conf->list_concurrency_ > kMaxListConcurrency) {
+    std::cerr << "--list_concurrency has to be between 1 and "
+              << kMaxListConcurrency << std::endl;
+    exit(1);
+  }
+  if (conf->resume_ && conf->dump_cache_to_.empty()) {
+    std::cerr << "--resume requires --dump_cache_to" << std::endl;
+    exit(1);
+  }
 }
 
 void InitTestConf() {
@@ -20,6 +20,8 @@
 #ifndef SRC_CONF_H_
 #define SRC_CONF_H_
 
+#include <sys/types.h>
+
 #include <string>
 #include <vector>
 
@@ -27,16 +29,47 @@ struct GlobalConfig {
   std::string read_cache_from_;
   std::string dump_cache_to_;
   std::string sql_out_;
+  std::string sql_in_;
+  std::string snapshot_in_;
+  std::string snapshot_out_;
   std::vector<std::string> dirs_;
+  // Names of dirs_ in the results of deduplicating several of them; empty
+  // unless given.
+  std::vector<std::string> labels_;
+  std::vector<std::string> exclude_;
+  std::vector<std::string> exclude_regex_;
+  std::vector<std::string> include_;
+  off_t min_size_;
+  off_t max_size_;
+  // With auto_concurrency_ this is the maximum, which the number of hashing
+  // threads is tuned within.
   int concurrency_;
+  // Number of directories listed concurrently.
+  int list_concurrency_;
   int tolerable_diff_pct_;
+  int checkpoint_interval_;  // in seconds
   bool verbose_;
   bool cache_only_;
   bool use_size_;
   bool ignore_db_prefix_;
   bool skip_renames_;
+  bool one_file_system_;
+  bool resume_;
+  bool watch_;
+  bool approximate_;
+  bool deterministic_;
+  // Deduplicate even if exactly 2 directories are given, instead of comparing
+  // them.
+  bool dedup_;
+  bool auto_concurrency_{};
 };
 
+// Limits for "-j auto".
+constexpr int kInitialAutoConcurrency = 4;
+constexpr int kMaxAutoConcurrency = 64;
+// Limit for --list_concurrency; every directory listed at once takes a thread.
+constexpr int kMaxListConcurrency = 1024;
+
 void ParseArgv(int argc, const char *const argv[]);
 void InitTestConf();
 const GlobalConfig &Conf();
@@ -177,8 +177,10 @@ class DBConnection {
   explicit DBConnection(const std::string &path,
                         int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
   ~DBConnection();
-  template <typename... ARGS>
-  DBInStreamPtr<ARGS...> Query(const std::string &sql);
+  // Values of params are bound to consecutive "?" placeholders in sql.
+  template <typename... ARGS, typename... PARAMS>
+  DBInStreamPtr<ARGS...> Query(const std::string &sql,
+                               const PARAMS &... params);
   template <typename... ARGS>
   std::unique_ptr<DBOutStream<ARGS...>> Prepare(const std::string &sql);
   void Exec(const std::string &sql);
@@ -226,10 +226,13 @@ DBOutputIt<ARGS...> &DBOutputIt<ARGS...>::operator=(
 
 //======== DBConnection ========================================================
 
-template <typename... ARGS>
-DBInStreamPtr<ARGS...> DBConnection::Query(const std::string &sql) {
+template <typename... ARGS, typename... PARAMS>
+DBInStreamPtr<ARGS...> DBConnection::Query(const std::string &sql,
+                                           const PARAMS &... params) {
+  StmtPtr stmt = PrepareStmt(sql);
+  detail::Bind(*stmt, params...);
   auto in_stream = std::shared_ptr<DBInStream<ARGS...>>(
-      new DBInStream<ARGS...>(*this, PrepareStmt(sql)));
+      new DBInStream<ARGS...>(*this, std::move(stmt)));
   return DBInStreamPtr<ARGS...>(in_stream);
 }
 
@@ -138,6 +138,20 @@ TEST_F(DBTest, Querying) {
   ASSERT_EQ(diff.second, res.end());
 }
 
+TEST_F(DBTest, QueryingWithParams) {
+  CreateTable();
+  InsertValues();
+  std::vector<std::tuple<int, std::string>> res;
+  auto in_stream = db_.Query<int, std::string>(
+      "SELECT id, txt FROM Tbl WHERE id > ? AND txt != ? ORDER BY id;", 2,
+      std::string("four"));
+  std::copy(in_stream.begin(), in_stream.end(), std::back_inserter(res));
+
+  const std::vector<std::tuple<int, std::string>> expected{
+      std::make_tuple(3, "three"), std::make_tuple(5, "five")};
+  ASSERT_EQ(res, expected);
+}
+
 TEST_F(DBTest, InsertFail) {
   CreateTable();
   InsertValues();
@@ -19,14 +19,53 @@
 
 #include "db_output.h"
 
+#include <algorithm>
 #include <new>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "conf.h"
 #include "db_lib_impl.h"
+#include "log.h"
+
+namespace {
+
+std::string JoinLines(const std::vector<std::string> &strs) {
+  std::string res;
+  for (const auto &s : strs) {
+    res += s;
+    res += '\n';
+  }
+  return res;
+}
+
+// The configuration which affects which nodes are equivalent. Results computed
+// with different settings can't be reused.
+std::vector<std::pair<std::string, std::string>> AnalysisSettings() {
+  return {
+      {"tolerable_diff_pct", std::to_string(Conf().tolerable_diff_pct_)},
+      {"use_size", std::to_string(Conf().use_size_)},
+      {"approximate", std::to_string(Conf().approximate_)},
+      {"one_file_system", std::to_string(Conf().one_file_system_)},
+      {"exclude", JoinLines(Conf().exclude_)},
+      {"exclude_regex", JoinLines(Conf().exclude_regex_)},
+      {"include", JoinLines(Conf().include_)},
+      {"min_size", std::to_string(Conf().min_size_)},
+      {"max_size", std::to_string(Conf().max_size_)},
+  };
+}
+
+}  // namespace
 
 void CreateResultsDatabase(DBConnection &db) {
   db.Exec(
       "DROP TABLE IF EXISTS Node;"
       "DROP TABLE IF EXISTS EqClass;"
+      "DROP TABLE IF EXISTS Setting;"
+      "CREATE TABLE Setting("
+      "name            TEXT    PRIMARY KEY NOT NULL,"
+      "value           TEXT    NOT NULL);"
       "CREATE TABLE EqClass("
       "id INT PRIMARY  KEY     NOT NULL,"
       "nodes           INT     NOT NULL,"
@@ -45,46 +84,91 @@ void CreateResultsDatabase(DBConnection &db) {
 }
 
 void DumpInterestingEqClasses(DBConnection &db,
-                              const std::vector<EqClass *> &eq_classes) {
+                              const std::vector<FlatTree::Idx> &eq_classes) {
   DBTransaction trans(db);
-  auto out =
-      db.Prepare<uintptr_t>("UPDATE EqClass SET interesting = 1 WHERE id == ?");
+  auto out = db.Prepare<FlatTree::Idx>(
+      "UPDATE EqClass SET interesting = 1 WHERE id == ?");
   std::transform(
       eq_classes.begin(), eq_classes.end(), out->begin(),
-      [](EqClass *eq_class_ptr) {
-        return std::make_tuple(reinterpret_cast<uintptr_t>(eq_class_ptr));
-      });
+      [](FlatTree::Idx eq_class) { return std::make_tuple(eq_class); });
   trans.Commit();
 }
 
-void DumpFuzzyDedupRes(DBConnection &db, const FuzzyDedupRes &res) {
+void DumpFuzzyDedupRes(DBConnection &db, const FlatTree &tree) {
   DBTransaction trans(db);
 
-  auto class_out = db.Prepare<uintptr_t, size_t, double>(
+  auto class_out = db.Prepare<FlatTree::Idx, size_t, double>(
       "INSERT INTO EqClass(id, nodes, weight, interesting) "
       "VALUES(?, ?, ?, 0)");
+  for (FlatTree::Idx c = 0; c < tree.NumClasses(); ++c) {
+    class_out->Write(c, tree.GetClassSize(c), tree.GetClassWeight(c));
+  }
 
-  std::transform(res.second->begin(), res.second->end(), class_out->begin(),
-                 [](const std::unique_ptr<EqClass> &eq_class) {
-                   return std::make_tuple(
-                       reinterpret_cast<uintptr_t>(eq_class.get()),
-                       eq_class->GetNumNodes(), eq_class->GetWeight());
-                 });
-
-  auto node_out = db.Prepare<uintptr_t, std::string, std::string, std::string,
-                             double, uintptr_t>(
+  auto node_out = db.Prepare<FlatTree::Idx, std::string, std::string,
+                             std::string, double, FlatTree::Idx>(
       "INSERT INTO Node("
       "id, name, path, type, unique_fraction, eq_class) "
       "VALUES(?, ?, ?, ?, ?, ?)");
-  res.first->Traverse([&](const Node *n) {
-    node_out->Write(
-        reinterpret_cast<uintptr_t>(n), n->GetName(), n->BuildPath().native(),
-        (n->GetType() == Node::FILE) ? "FILE" : "DIR", n->unique_fraction_,
-        reinterpret_cast<uintptr_t>(&n->GetEqClass()));
-  });
+  PathWriter paths(tree);
+  for (FlatTree::Idx n = 0; n < tree.NumNodes(); ++n) {
+    node_out->Write(n, std::string(tree.GetName(n)), paths.Get(n),
+                    (tree.GetType(n) == Node::FILE) ? "FILE" : "DIR",
+                    tree.GetUniqueFraction(n), tree.GetEqClass(n));
+  }
   trans.Commit();
 }
 
+void DumpAnalysisSettings(DBConnection &db) {
+  DBTransaction trans(db);
+  auto out =
+      db.Prepare<std::string, std::string>("INSERT INTO Setting VALUES(?, ?)");
+  for (const auto &[name, value] : AnalysisSettings()) {
+    out->Write(name, value);
+  }
+  trans.Commit();
+}
+
+PriorResults ReadFuzzyDedupRes(DBConnection &db) {
+  PriorResults res;
+  std::vector<std::pair<std::string, std::string>> settings;
+  if (!db.Query<int>("SELECT 1 FROM sqlite_master "
+                     "WHERE type = 'table' AND name = 'Setting'")
+           .Eof()) {
+    for (const auto &[name, value] : db.Query<std::string, std::string>(
+             "SELECT name, value FROM Setting ORDER BY name")) {
+      settings.emplace_back(name, value);
+    }
+  }
+  auto expected = AnalysisSettings();
+  std::sort(expected.begin(), expected.end());
+  if (settings != expected) {
+    LOG(WARNING, "Previous results were computed with different settings, "
+                 "not reusing them");
+    return res;
+  }
+  // Parents precede their children. A node's path is its parent's path and its
+  // name, separated by a slash unless the former ends with one. Names of roots
+  // may contain slashes too, so paths can't be split on the last one.
+  for (const auto &[name, path, type, eq_class] :
+       db.Query<std::string, std::string, std::string, size_t>(
+           "SELECT name, path, type, eq_class FROM Node ORDER BY id")) {
+    std::string parent_path = path.substr(0, path.size() - name.size());
+    auto parent = res.nodes_.find(parent_path);
+    if (parent == res.nodes_.end() && !parent_path.empty() &&
+        parent_path.back() == '/') {
+      parent_path.pop_back();
+      parent = res.nodes_.find(parent_path);
+    }
+    if (parent != res.nodes_.end()) {
+      ++parent->second.num_children_;
+    }
+    res.nodes_.emplace(
+        path, PriorResults::NodeInfo{type == "FILE" ? Node::FILE : Node::DIR,
+                                     0, eq_class});
+  }
+  return res;
+}
+
 DirCompDBStream::DirCompDBStream(DBConnection &conn)
     : conn_(conn), trans_(conn) {
   conn.Exec(
@@ -26,12 +26,20 @@
 
 #include "db_lib.h"
 #include "dir_compare.h"
+#include "flat_tree.h"
 #include "fuzzy_dedup.h"
 
 void CreateResultsDatabase(DBConnection &db);
-void DumpFuzzyDedupRes(DBConnection &db, const FuzzyDedupRes &res);
+// Nodes and equivalence classes are identified by their indices in tree.
+void DumpFuzzyDedupRes(DBConnection &db, const FlatTree &tree);
 void DumpInterestingEqClasses(DBConnection &db,
-                              const std::vector<EqClass *> &eq_classes);
+                              const std::vector<FlatTree::Idx> &eq_classes);
+// Record the settings affecting the analysis, if the results dumped with
+// DumpFuzzyDedupRes() were computed using them.
+void DumpAnalysisSettings(DBConnection &db);
+// Read back results written by DumpFuzzyDedupRes(). They are only returned if
+// DumpAnalysisSettings() recorded the same settings as the current ones.
+PriorResults ReadFuzzyDedupRes(DBConnection &db);
 
 // For printing directory comparison result.
 class DirCompDBStream : public CompareOutputStream {
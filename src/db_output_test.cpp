@@ -0,0 +1,127 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "db_output.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "db_lib_impl.h"
+#include "gtest/gtest.h"
+#include "test_common.h"
+
+class DbOutputTest : public ::testing::Test {
+ protected:
+  // r/
+  //   a/
+  //     f2 (same as f1)
+  //   f1
+  DbOutputTest() : db_(tmp_.dir_ + "/res.sqlite3") {
+    auto root = std::make_shared<Node>(Node::DIR, "r");
+    Node *a = new Node(Node::DIR, "a");
+    Node *f1 = new Node(Node::FILE, "f1");
+    Node *f2 = new Node(Node::FILE, "f2");
+    root->AddChild(a);
+    root->AddChild(f1);
+    a->AddChild(f2);
+    auto eq_classes = std::make_shared<EqClasses>();
+    const std::vector<Nodes> classes{{f1, f2}, {a}, {root.get()}};
+    for (const Nodes &nodes : classes) {
+      eq_classes->push_back(std::make_unique<EqClass>());
+      for (Node *n : nodes) {
+        eq_classes->back()->AddNode(*n);
+      }
+    }
+    res_ = FuzzyDedupRes(root, eq_classes);
+  }
+
+  void Dump(bool settings) {
+    CreateResultsDatabase(db_);
+    DumpFuzzyDedupRes(db_, FlatTree(res_));
+    if (settings) {
+      DumpAnalysisSettings(db_);
+    }
+  }
+
+  TmpDir tmp_;
+  DBConnection db_;
+  FuzzyDedupRes res_;
+};
+
+TEST_F(DbOutputTest, RoundTrip) {
+  Dump(true);
+  PriorResults prior = ReadFuzzyDedupRes(db_);
+  ASSERT_EQ(4U, prior.nodes_.size());
+  const auto &r = prior.nodes_.at("r");
+  ASSERT_EQ(Node::DIR, r.type_);
+  ASSERT_EQ(2U, r.num_children_);
+  const auto &a = prior.nodes_.at("r/a");
+  ASSERT_EQ(1U, a.num_children_);
+  const auto &f1 = prior.nodes_.at("r/f1");
+  const auto &f2 = prior.nodes_.at("r/a/f2");
+  ASSERT_EQ(Node::FILE, f1.type_);
+  ASSERT_EQ(f1.eq_class_, f2.eq_class_);
+  ASSERT_NE(f1.eq_class_, a.eq_class_);
+}
+
+TEST_F(DbOutputTest, LabelsWithSlashes) {
+  // A nameless root with children named after labels, like the one created by
+  // FuzzyDedup() for many directories.
+  std::shared_ptr<Node> root = Node::NewSuperRoot();
+  Node *one = new Node(Node::DIR, "one");
+  Node *two = new Node(Node::DIR, "two/x");
+  Node *f1 = new Node(Node::FILE, "f1");
+  Node *f2 = new Node(Node::FILE, "f2");
+  root->AddChild(one);
+  root->AddChild(two);
+  one->AddChild(f1);
+  two->AddChild(f2);
+  auto eq_classes = std::make_shared<EqClasses>();
+  const std::vector<Nodes> classes{{f1, f2}, {one, two}, {root.get()}};
+  for (const Nodes &nodes : classes) {
+    eq_classes->push_back(std::make_unique<EqClass>());
+    for (Node *n : nodes) {
+      eq_classes->back()->AddNode(*n);
+    }
+  }
+  res_ = FuzzyDedupRes(root, eq_classes);
+  Dump(true);
+  PriorResults prior = ReadFuzzyDedupRes(db_);
+  ASSERT_EQ(5U, prior.nodes_.size());
+  ASSERT_EQ(2U, prior.nodes_.at("").num_children_);
+  ASSERT_EQ(1U, prior.nodes_.at("one").num_children_);
+  ASSERT_EQ(1U, prior.nodes_.at("two/x").num_children_);
+  ASSERT_EQ(Node::FILE, prior.nodes_.at("two/x/f2").type_);
+  ASSERT_EQ(prior.nodes_.at("one/f1").eq_class_,
+            prior.nodes_.at("two/x/f2").eq_class_);
+}
+
+TEST_F(DbOutputTest, NoSettingsNotReused) {
+  Dump(false);
+  ASSERT_TRUE(ReadFuzzyDedupRes(db_).nodes_.empty());
+}
+
+TEST_F(DbOutputTest, DifferentSettingsNotReused) {
+  Dump(true);
+  db_.Exec(
+      "UPDATE Setting SET value = value + 1 "
+      "WHERE name = 'tolerable_diff_pct'");
+  ASSERT_TRUE(ReadFuzzyDedupRes(db_).nodes_.empty());
+}
@@ -144,10 +144,11 @@ class PathHashesFiller : public ScanProcessor<fs::path> {
  public:
   explicit PathHashesFiller(PathHashes &hashes) : hashes_(hashes) {}
 
-  void File(const fs::path &path, const fs::path &parent,
-            const FileInfo &f_info) override {
-    const fs::path relative = parent / path.filename();
-    hashes_.insert(PathHash(relative.native(), f_info.sum_));
+  void Files(const fs::path &parent, const FileRecords &files) override {
+    for (const FileRecord &file : files) {
+      const fs::path relative = parent / file.name_;
+      hashes_.insert(PathHash(relative.native(), file.f_info_.sum_));
+    }
   }
   fs::path RootDir(const fs::path & /*path*/) override { return fs::path(); }
   fs::path Dir(const fs::path &path, const fs::path &parent) override {
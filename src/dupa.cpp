@@ -18,6 +18,7 @@
  */
 
 #include <fstream>
+#include <memory>
 #include <string>
 #include <thread>
 
@@ -28,9 +29,12 @@
 #include "db_output.h"
 #include "dir_compare.h"
 #include "file_tree.h"
+#include "flat_dedup.h"
+#include "flat_tree.h"
 #include "fuzzy_dedup.h"
 #include "hash_cache.h"
 #include "log.h"
+#include "watch.h"
 
 static_assert(sizeof(off_t) == 8);
 
@@ -41,13 +45,40 @@ static void PrintCompilationProfileWarning() {
   stderr_loglevel = ll;
 }
 
+// Snapshots don't record all settings they were computed with (e.g. filters),
+// so results loaded from them are dumped without settings and won't be reused.
+static void ReportDuplicates(const FlatTree &tree, DBConnection *db,
+                             bool settings_known = true) {
+  if (!Conf().snapshot_out_.empty()) {
+    LOG(INFO, "Writing snapshot to " << Conf().snapshot_out_);
+    tree.Save(Conf().snapshot_out_);
+  }
+  if (tree.Empty()) {
+    // no nodes at all
+    std::cout << "No files in specified location" << std::endl;
+    return;
+  }
+  auto eq_classes = GetInteresingEqClasses(tree);
+  PrintEqClassses(tree, eq_classes);
+  PrintScatteredDirectories(tree);
+  if (db) {
+    LOG(INFO, "Dumping results to " << Conf().sql_out_);
+    CreateResultsDatabase(*db);
+    DumpFuzzyDedupRes(*db, tree);
+    DumpInterestingEqClasses(*db, eq_classes);
+    if (settings_known) {
+      DumpAnalysisSettings(*db);
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   PrintCompilationProfileWarning();
   ParseArgv(argc, argv);
 
   try {
-    HashCache::Initializer hash_cache_init(Conf().read_cache_from_,
-                                           Conf().dump_cache_to_);
+    HashCache::Initializer hash_cache_init(
+        Conf().read_cache_from_, Conf().dump_cache_to_, Conf().resume_);
 
     if (Conf().cache_only_) {
       for (const auto &dir : Conf().dirs_) {
@@ -58,23 +89,30 @@ int main(int argc, char **argv) {
     // Open database first to catch configuration issues soon.
     std::unique_ptr<DBConnection> db(
         Conf().sql_out_.empty() ? nullptr : new DBConnection(Conf().sql_out_));
-    if (Conf().dirs_.size() == 1) {
-      FuzzyDedupRes res = FuzzyDedup(Conf().dirs_[0]);
-      if (!res.first) {
-        // no nodes at all
-        std::cout << "No files in specified location" << std::endl;
+    if (!Conf().snapshot_in_.empty()) {
+      ReportDuplicates(FlatTree::Load(Conf().snapshot_in_), db.get(), false);
+    } else if (Conf().watch_) {
+      WatchAndDedup(Conf().dirs_[0], [&db](FuzzyDedupRes &res) {
+        ReportDuplicates(FlatTree(res), db.get());
+        std::cout.flush();
+      });
+    } else if (Conf().dirs_.size() != 2 || Conf().dedup_) {
+      if (Conf().sql_in_.empty()) {
+        // Nodes are only needed to reuse prior results.
+        ReportDuplicates(FlatFuzzyDedup(Conf().dirs_, Conf().labels_),
+                         db.get());
       } else {
-        auto eq_classes = GetInteresingEqClasses(res);
-        PrintEqClassses(eq_classes);
-        PrintScatteredDirectories(*res.first);
-        if (!!db) {
-          LOG(INFO, "Dumping results to " << Conf().sql_out_);
-          CreateResultsDatabase(*db);
-          DumpFuzzyDedupRes(*db, res);
-          DumpInterestingEqClasses(*db, eq_classes);
-        }
+        LOG(INFO, "Reading previous results from " << Conf().sql_in_);
+        DBConnection prior_db(Conf().sql_in_, SQLITE_OPEN_READONLY);
+        auto prior =
+            std::make_unique<PriorResults>(ReadFuzzyDedupRes(prior_db));
+        // The analyzed hierarchy is freed as soon as it is flattened.
+        const FlatTree tree(
+            FuzzyDedup(Conf().dirs_, Conf().labels_, prior.get()));
+        prior.reset();
+        ReportDuplicates(tree, db.get());
       }
-    } else if (Conf().dirs_.size() == 2) {
+    } else {
       PrintingOutputStream stdout;
       std::unique_ptr<DirCompDBStream> db_stream(db ? new DirCompDBStream(*db)
                                                     : nullptr);
@@ -91,9 +129,6 @@ int main(int argc, char **argv) {
         db_stream->Commit();
       }
       return 0;
-    } else {
-      // Should have been checked already.
-      assert(false);
     }
   } catch (const std::ios_base::failure &ex) {
     std::cerr << "Failure: " << ex.what() << std::endl;
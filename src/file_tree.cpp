@@ -23,12 +23,12 @@
 
 #include <algorithm>
 #include <cassert>
-#include <iostream>
+#include <functional>
 
 #include <unordered_map>
 #include <unordered_set>
-
-#include "conf.h"
+#include <utility>
+#include <vector>
 
 void Node::AddChild(Node *child) {
   assert(!IsEvaluated());
@@ -38,10 +38,37 @@ void Node::AddChild(Node *child) {
   child->parent_ = this;
   children_.push_back(child);
   ++not_evaluated_children_;
+  child_classes_.clear();
+}
+
+void Node::DeleteChild(Node *child) {
+  assert(!IsEvaluated());
+  auto it = std::find(children_.begin(), children_.end(), child);
+  assert(it != children_.end());
+  child->Traverse([](Node *n) {
+    if (n->IsEvaluated()) {
+      n->eq_class_->RemoveNode(*n);
+    }
+  });
+  children_.erase(it);
+  // The child is not evaluated by now, so it was accounted for.
+  --not_evaluated_children_;
+  delete child;
+  if (IsReadyToEvaluate()) {
+    CollectChildClasses();
+  }
 }
 
 Node::~Node() {
-  for (Node *n : children_) {
+  // Iterative, so that deep hierarchies don't overflow the stack.
+  Nodes to_delete;
+  to_delete.swap(children_);
+  while (!to_delete.empty()) {
+    Node *n = to_delete.back();
+    to_delete.pop_back();
+    to_delete.insert(to_delete.end(), n->children_.begin(),
+                     n->children_.end());
+    n->children_.clear();
     delete n;
   }
 }
@@ -53,73 +80,121 @@ void Node::SetEqClass(EqClass *eq_class) {
   if (parent_) {
     assert(parent_->not_evaluated_children_);
     --parent_->not_evaluated_children_;
+    if (parent_->IsReadyToEvaluate()) {
+      parent_->CollectChildClasses();
+    }
+  }
+}
+
+void Node::ClearEqClass() {
+  assert(IsEvaluated());
+  eq_class_ = nullptr;
+  if (parent_) {
+    ++parent_->not_evaluated_children_;
+    parent_->child_classes_.clear();
+  }
+}
+
+void Node::CollectChildClasses() {
+  assert(IsReadyToEvaluate());
+  child_classes_.clear();
+  child_classes_.reserve(children_.size());
+  for (const Node *child : children_) {
+    child_classes_.push_back(child->eq_class_);
   }
+  std::sort(child_classes_.begin(), child_classes_.end(),
+            std::less<EqClass *>());
+  child_classes_.erase(
+      std::unique(child_classes_.begin(), child_classes_.end()),
+      child_classes_.end());
 }
 
 double Node::GetWeight() const {
   if (IsEvaluated()) {
     return eq_class_->weight_;
   }
-
-  switch (type_) {
-    case FILE:
-      if (Conf().use_size_) {
-        return size_;
-      } else {
-        return 1;
-      }
-    case DIR: {
-      std::unordered_set<EqClass *> eq_classes;
-      double weight = 0;
-      for (const Node *const n : children_) {
-        assert(n->IsEvaluated());
-        eq_classes.insert(&n->GetEqClass());
-      }
-      for (const EqClass *const eq_class : eq_classes) {
-        weight += eq_class->weight_;
-      }
-      return weight;
-    }
+  if (type_ == FILE) {
+    return weight_;
+  }
+  // Weights of the child classes change as further nodes join them, so a
+  // directory's weight can't be computed once it's ready to evaluate.
+  assert(IsReadyToEvaluate());
+  double weight = 0;
+  for (const EqClass *const eq_class : child_classes_) {
+    weight += eq_class->weight_;
   }
-  assert(false);  // We shouldn't reach it;
-  return 0;
+  return weight;
 }
 
 boost::filesystem::path Node::BuildPath() const {
-  if (parent_) {
-    return parent_->BuildPath() /= boost::filesystem::path(name_);
+  std::vector<const Node *> ancestors;
+  for (const Node *n = this; n; n = n->parent_) {
+    ancestors.push_back(n);
   }
-  return boost::filesystem::path(name_);
+  boost::filesystem::path res;
+  for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+    res /= boost::filesystem::path((*it)->name_);
+  }
+  return res;
 }
 
-Nodes Node::GetPossibleEquivalents() const {
+Nodes Node::GetPossibleEquivalents(double max_distance) const {
   assert(IsReadyToEvaluate());
-  std::unordered_set<Node *> nodes;
-  for (const Node *child : children_) {
-    assert(child->IsEvaluated());
-    for (const Node *equivalent : child->eq_class_->nodes_) {
+  // An equivalent's NodeDistance() is below max_distance only if the weight of
+  // the classes it shares with this node exceeds (1 - max_distance) of their
+  // union and hence min_shared below. Therefore the most popular classes,
+  // which would yield the most candidates, are skipped as long as their total
+  // weight doesn't reach min_shared: an equivalent has to share some other
+  // class too. Likewise, candidates whose shared weight can't exceed
+  // min_shared are dropped. Weights are summed like in NodeDistance().
+  uint64_t weight = 0;
+  for (const EqClass *eq_class : child_classes_) {
+    weight += eq_class->weight_;
+  }
+  // The slack makes up for rounding in NodeDistance().
+  const double min_shared = (1 - max_distance) * weight * (1 - 1e-9);
+  // With weight == 0 all classes have 0 weight, so everything is identical.
+  const bool prune = weight > 0 && min_shared > 0;
+
+  std::vector<const EqClass *> by_popularity(child_classes_.begin(),
+                                             child_classes_.end());
+  std::sort(by_popularity.begin(), by_popularity.end(),
+            [](const EqClass *c1, const EqClass *c2) {
+              return c1->nodes_.size() > c2->nodes_.size();
+            });
+  uint64_t skipped_weight = 0;
+  // Candidates with weight of classes shared with this node, excluding the
+  // skipped ones, and the last class they've been found through.
+  std::unordered_map<Node *, std::pair<uint64_t, const EqClass *>> candidates;
+  for (const EqClass *eq_class : by_popularity) {
+    if (prune) {
+      uint64_t new_skipped_weight = skipped_weight;
+      new_skipped_weight += eq_class->weight_;
+      if (new_skipped_weight < min_shared) {
+        skipped_weight = new_skipped_weight;
+        continue;
+      }
+    }
+    for (const Node *equivalent : eq_class->nodes_) {
       assert(equivalent->IsEvaluated());
-      if (equivalent != child && equivalent->parent_ &&
-          equivalent->parent_->IsEvaluated() && equivalent->parent_ != this) {
-        nodes.insert(equivalent->parent_);
+      Node *parent = equivalent->parent_;
+      if (parent && parent->IsReadyToEvaluate() && parent != this) {
+        auto &[shared_weight, last_class] = candidates[parent];
+        // Several children of parent may be in the same class.
+        if (last_class != eq_class) {
+          shared_weight += eq_class->weight_;
+          last_class = eq_class;
+        }
       }
     }
   }
-  return Nodes(nodes.begin(), nodes.end());
-}
-
-void Node::Traverse(const std::function<void(Node *)> &callback) {
-  for (Node *const child : children_) {
-    child->Traverse(callback);
-  }
-  callback(this);
-}
-
-void Node::Traverse(const std::function<void(const Node *)> &callback) const {
-  for (const Node *const child : children_) {
-    child->Traverse(callback);
+  Nodes res;
+  for (const auto &[candidate, shared_and_class] : candidates) {
+    if (!prune || shared_and_class.first + skipped_weight > min_shared) {
+      res.push_back(candidate);
+    }
   }
-  callback(this);
+  return res;
 }
 
 bool Node::IsAncestorOf(const Node &node) {
@@ -131,6 +206,22 @@ bool Node::IsAncestorOf(const Node &node) {
   return n != nullptr;
 }
 
+Node *Node::FindChild(const std::string &name) const {
+  for (Node *child : children_) {
+    if (child->name_ == name) {
+      return child;
+    }
+  }
+  return nullptr;
+}
+
+void Node::SortChildren() {
+  std::sort(children_.begin(), children_.end(),
+            [](const Node *n1, const Node *n2) {
+              return n1->name_ < n2->name_;
+            });
+}
+
 double NodeDistance(const Node &n1, const Node &n2) {
   assert(n1.IsReadyToEvaluate());
   assert(n2.IsReadyToEvaluate());
@@ -138,34 +229,35 @@ double NodeDistance(const Node &n1, const Node &n2) {
   // hash table for efficiency.
   assert(n1.type_ != Node::FILE || n2.type_ != Node::FILE);
 
-  std::unordered_map<EqClass *, bool> eq_classes1;
-  std::unordered_set<EqClass *> eq_classes_only_2;
-
-  for (const Node *const n : n1.children_) {
-    eq_classes1.insert(std::make_pair(n->eq_class_, false));
-  }
-  for (const Node *const n : n2.children_) {
-    auto in1_it = eq_classes1.find(n->eq_class_);
-    if (in1_it == eq_classes1.end()) {
-      eq_classes_only_2.insert(n->eq_class_);
-    } else {
-      in1_it->second = true;
-    }
-  }
-
+  // Both class lists are sorted, so they are merged rather than looked up.
+  // Weights are accumulated as integers, as they always have been.
   uint64_t sum = 0;
   uint64_t sym_diff = 0;
-
-  for (const auto &eq_class_and_intersect : eq_classes1) {
-    sum += eq_class_and_intersect.first->weight_;
-    if (!eq_class_and_intersect.second) {
-      // only in n1
-      sym_diff += eq_class_and_intersect.first->weight_;
+  const std::less<EqClass *> less;
+  auto it1 = n1.child_classes_.begin();
+  auto it2 = n2.child_classes_.begin();
+  const auto end1 = n1.child_classes_.end();
+  const auto end2 = n2.child_classes_.end();
+  while (it1 != end1 && it2 != end2) {
+    if (less(*it1, *it2)) {
+      sum += (*it1)->weight_;
+      sym_diff += (*it1++)->weight_;
+    } else if (less(*it2, *it1)) {
+      sum += (*it2)->weight_;
+      sym_diff += (*it2++)->weight_;
+    } else {
+      sum += (*it1)->weight_;
+      ++it1;
+      ++it2;
     }
   }
-  for (const EqClass *const eq_class : eq_classes_only_2) {
-    sum += eq_class->weight_;
-    sym_diff += eq_class->weight_;
+  for (; it1 != end1; ++it1) {
+    sum += (*it1)->weight_;
+    sym_diff += (*it1)->weight_;
+  }
+  for (; it2 != end2; ++it2) {
+    sum += (*it2)->weight_;
+    sym_diff += (*it2)->weight_;
   }
   if (sum == 0) {
     // both are empty directories, so they are the same
@@ -178,46 +270,17 @@ double NodeDistance(const Node &n1, const Node &n2) {
 void EqClass::AddNode(Node &node) {
   assert(find(nodes_.begin(), nodes_.end(), &node) == nodes_.end());
   nodes_.push_back(&node);
-  weight_ = (weight_ * (nodes_.size() - 1) + node.GetWeight()) / nodes_.size();
+  node.weight_ = node.GetWeight();
+  weight_ = (weight_ * (nodes_.size() - 1) + node.weight_) / nodes_.size();
   node.SetEqClass(this);
 }
 
-void PrintEqClassses(const std::vector<EqClass *> &eq_classes) {
-  std::cout << "*** Classes of similar directories or files:" << std::endl;
-  for (const EqClass *eq_class : eq_classes) {
-    Nodes to_print(eq_class->nodes_);
-    std::sort(to_print.begin(), to_print.end(),
-              [](const Node *n1, const Node *n2) {
-                return n1->BuildPath().native() < n2->BuildPath().native();
-              });
-    for (auto node_it = to_print.begin(); node_it != to_print.end();
-         ++node_it) {
-      std::cout << (*node_it)->BuildPath().native();
-      if (--to_print.end() != node_it) {
-        std::cout << " ";
-      }
-    }
-    std::cout << std::endl;
-  }
-}
-
-void PrintScatteredDirectories(const Node &root) {
-  std::cout << "*** Directories consisting of mostly duplicates of files "
-               "scattered elsewhere:"
-            << std::endl;
-  CNodes scattered_dirs;
-  root.Traverse([&scattered_dirs](const Node *n) {
-    if (n->GetType() == Node::DIR &&
-        n->unique_fraction_ * 100 < Conf().tolerable_diff_pct_ &&
-        n->GetEqClass().IsSingle()) {
-      scattered_dirs.push_back(n);
-    }
-  });
-  std::sort(scattered_dirs.begin(), scattered_dirs.end(),
-            [](const Node *n1, const Node *n2) {
-              return n1->unique_fraction_ > n2->unique_fraction_;
-            });
-  for (const Node *dir : scattered_dirs) {
-    std::cout << dir->BuildPath().native() << std::endl;
-  }
+void EqClass::RemoveNode(Node &node) {
+  auto it = find(nodes_.begin(), nodes_.end(), &node);
+  assert(it != nodes_.end());
+  nodes_.erase(it);
+  weight_ = nodes_.empty() ? 0
+                           : (weight_ * (nodes_.size() + 1) - node.weight_) /
+                                 nodes_.size();
+  node.ClearEqClass();
 }
@@ -21,8 +21,9 @@
 #define SRC_FILE_TREE_H_
 
 #include <cassert>
-#include <functional>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
@@ -35,6 +36,15 @@ class EqClass;
 using Nodes = std::vector<Node *>;
 using CNodes = std::vector<const Node *>;
 
+// Policies defining how much a regular file of a given size weighs, i.e. what
+// sizes of directories are measured in.
+struct FileCountWeight {
+  static double Of(off_t /* size */) { return 1; }
+};
+struct FileSizeWeight {
+  static double Of(off_t size) { return size; }
+};
+
 // FIXME: the tree structure should be separated from the things computed on it.
 // The only reason why it is not is my laziness.
 class Node {
@@ -44,22 +54,25 @@ class Node {
     FILE,
   };
 
-  // Size is only meaningful for regular files.
-  Node(Type type, std::string name, off_t size = 0)
-      : name_(std::move(name)),
-        type_(type),
-        size_(size),
-        parent_(nullptr),
-        eq_class_(nullptr),
-        not_evaluated_children_() {
+  // Weight is only meaningful for regular files; directories' weights are
+  // computed once they're ready to evaluate.
+  Node(Type type, std::string name, double weight = 1)
+      : Node(type, std::move(name), weight, Nameless()) {
     assert(!name_.empty());
-    DLOG("Created file: '" << BuildPath().native() << "' with size " << size_
-                           << " and type " << type_);
+  }
+  // A directory joining several scanned hierarchies. It has no name, so that
+  // it is not part of the paths.
+  static std::unique_ptr<Node> NewSuperRoot() {
+    return std::unique_ptr<Node>(new Node(DIR, std::string(), 0, Nameless()));
   }
   Node(const Node &n) = delete;
   Node &operator=(const Node &n) = delete;
 
   void AddChild(Node *child);  // takes ownership
+  // Removes child's subtree from their equivalence classes and deletes it.
+  // This node must not be evaluated.
+  void DeleteChild(Node *child);
+  void ReserveChildren(size_t n) { children_.reserve(children_.size() + n); }
   bool IsReadyToEvaluate() const { return not_evaluated_children_ == 0; }
   bool IsEvaluated() const { return eq_class_ != nullptr; }
   EqClass &GetEqClass() const {
@@ -72,26 +85,76 @@ class Node {
   double GetWeight() const;
   const std::string &GetName() const { return name_; }
   Node *GetParent() { return parent_; }
-  // Return all nodes which are evaluated and share a child with this one.
-  Nodes GetPossibleEquivalents() const;
-  // Traverse the whole subtree (including this node) in a an unspecified
-  // order and call callback on every node
-  void Traverse(const std::function<void(Node *)> &callback);
-  void Traverse(const std::function<void(const Node *)> &callback) const;
+  // Return nodes ready to evaluate (which includes evaluated ones) which share
+  // a child with this one and whose NodeDistance() to this one may be below
+  // max_distance.
+  Nodes GetPossibleEquivalents(double max_distance) const;
+  struct AlwaysDescend {
+    bool operator()(const Node * /* node */) const { return true; }
+  };
+  // Traverse the whole subtree (including this node) in post-order, i.e.
+  // children before their parents, and call callback on every node. Nodes for
+  // which descend returns false are skipped along with their subtrees. The
+  // traversal is iterative, so arbitrarily deep hierarchies are fine.
+  template <typename F, typename D = AlwaysDescend>
+  void Traverse(F &&callback, D &&descend = D()) {
+    TraversePostOrder<Node>(this, callback, descend);
+  }
+  template <typename F, typename D = AlwaysDescend>
+  void Traverse(F &&callback, D &&descend = D()) const {
+    TraversePostOrder<const Node>(this, callback, descend);
+  }
+  // Same as Traverse() but parents are visited before their children.
+  template <typename F>
+  void TraversePreOrder(F &&callback);
   const Nodes &GetChildren() const { return children_; }
+  // Distinct equivalence classes of children; only valid while
+  // IsReadyToEvaluate().
+  const std::vector<EqClass *> &GetChildClasses() const {
+    assert(IsReadyToEvaluate());
+    return child_classes_;
+  }
   bool IsAncestorOf(const Node &node);
+  // Child named name, if any.
+  Node *FindChild(const std::string &name) const;
+  // Order children by name rather than by the order of adding them.
+  void SortChildren();
 
   ~Node();
 
  private:
+  struct Nameless {};
+  Node(Type type, std::string name, double weight, Nameless /* unused */)
+      : name_(std::move(name)),
+        parent_(nullptr),
+        eq_class_(nullptr),
+        weight_(type == FILE ? weight : 0),
+        type_(type),
+        not_evaluated_children_() {
+    DLOG("Created file: '" << BuildPath().native() << "' with weight "
+                           << weight_ << " and type " << type_);
+  }
+
+  template <typename NodeT, typename F, typename D>
+  static void TraversePostOrder(NodeT *root, F &callback, D &descend);
+
   void SetEqClass(EqClass *eq_class);
+  void ClearEqClass();
+  // Fill child_classes_; all children have to be evaluated.
+  void CollectChildClasses();
 
   std::string name_;
-  Type type_;
-  off_t size_;
   Node *parent_;
   Nodes children_;
   EqClass *eq_class_;
+  // Distinct equivalence classes of children, sorted by address. Only up to
+  // date while IsReadyToEvaluate().
+  std::vector<EqClass *> child_classes_;
+  // Weight of this node itself, as opposed to its class. For directories it's
+  // only stored when they're added to eq_class_, so it's what they contributed
+  // to its weight.
+  double weight_;
+  Type type_;
   int not_evaluated_children_;
 
  public:
@@ -102,6 +165,40 @@ class Node {
   friend class EqClass;
 };
 
+template <typename NodeT, typename F, typename D>
+void Node::TraversePostOrder(NodeT *root, F &callback, D &descend) {
+  if (!descend(root)) {
+    return;
+  }
+  // Nodes on the path from root along with the index of their next child to
+  // visit.
+  std::vector<std::pair<NodeT *, size_t>> stack{{root, 0}};
+  while (!stack.empty()) {
+    NodeT *node = stack.back().first;
+    const size_t next_child = stack.back().second++;
+    if (next_child < node->children_.size()) {
+      NodeT *child = node->children_[next_child];
+      if (descend(child)) {
+        stack.emplace_back(child, 0);
+      }
+    } else {
+      stack.pop_back();
+      callback(node);
+    }
+  }
+}
+
+template <typename F>
+void Node::TraversePreOrder(F &&callback) {
+  Nodes stack{this};
+  while (!stack.empty()) {
+    Node *node = stack.back();
+    stack.pop_back();
+    callback(node);
+    stack.insert(stack.end(), node->children_.rbegin(), node->children_.rend());
+  }
+}
+
 // 0 for identical, 1 for no overlap; (symmetrical diffrence) / (union)
 double NodeDistance(const Node &n1, const Node &n2);
 
@@ -117,16 +214,11 @@ class EqClass {
   size_t GetNumNodes() const { return nodes_.size(); }
 
   void AddNode(Node &node);  // does not take ownership
+  // The node becomes not evaluated and so do its ancestors as far as
+  // IsReadyToEvaluate() is concerned.
+  void RemoveNode(Node &node);
   Nodes nodes_;
   double weight_{};
 };
 
-// Filter out only equivalence classes which have duplicates and are not already
-// described by their parents being duplicates of something else.
-void PrintEqClassses(const std::vector<EqClass *> &eq_classes);
-
-// Print directories which have no duplicates but whose contents are mostly
-// duplicated to file outside of it.
-void PrintScatteredDirectories(const Node &root);
-
 #endif  // SRC_FILE_TREE_H_
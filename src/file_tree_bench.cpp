@@ -0,0 +1,169 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+// Compares Node::Traverse and NodeDistance with the implementations they
+// replaced on synthetic data. Usage: file_tree_bench [num_nodes]
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "conf.h"
+#include "file_tree.h"
+
+namespace {
+
+constexpr size_t kFilesPerDir = 8;
+constexpr size_t kDirsPerDir = 2;
+
+std::unique_ptr<Node> CreateTree(size_t num_nodes) {
+  auto root = std::make_unique<Node>(Node::DIR, "root");
+  size_t created = 1;
+  Nodes dirs{root.get()};
+  for (size_t next_dir = 0; created < num_nodes; ++next_dir) {
+    Node *dir = dirs[next_dir];
+    for (size_t i = 0; i < kFilesPerDir && created < num_nodes; ++i) {
+      dir->AddChild(new Node(Node::FILE, "f" + std::to_string(i)));
+      ++created;
+    }
+    for (size_t i = 0; i < kDirsPerDir && created < num_nodes; ++i) {
+      Node *child = new Node(Node::DIR, "d" + std::to_string(i));
+      dir->AddChild(child);
+      dirs.push_back(child);
+      ++created;
+    }
+  }
+  return root;
+}
+
+void RecursiveTraverse(const Node &node,
+                       const std::function<void(const Node *)> &callback) {
+  for (const Node *child : node.GetChildren()) {
+    RecursiveTraverse(*child, callback);
+  }
+  callback(&node);
+}
+
+// NodeDistance as it used to be: with a hash table for each directory.
+double HashNodeDistance(const Node &n1, const Node &n2) {
+  std::unordered_map<const EqClass *, bool> eq_classes1;
+  std::unordered_set<const EqClass *> eq_classes_only_2;
+  for (const Node *n : n1.GetChildren()) {
+    eq_classes1.insert(std::make_pair(&n->GetEqClass(), false));
+  }
+  for (const Node *n : n2.GetChildren()) {
+    auto in1_it = eq_classes1.find(&n->GetEqClass());
+    if (in1_it == eq_classes1.end()) {
+      eq_classes_only_2.insert(&n->GetEqClass());
+    } else {
+      in1_it->second = true;
+    }
+  }
+  uint64_t sum = 0;
+  uint64_t sym_diff = 0;
+  for (const auto &eq_class_and_intersect : eq_classes1) {
+    sum += eq_class_and_intersect.first->GetWeight();
+    if (!eq_class_and_intersect.second) {
+      sym_diff += eq_class_and_intersect.first->GetWeight();
+    }
+  }
+  for (const EqClass *eq_class : eq_classes_only_2) {
+    sum += eq_class->GetWeight();
+    sym_diff += eq_class->GetWeight();
+  }
+  return sum == 0 ? 0 : static_cast<double>(sym_diff) / sum;
+}
+
+template <typename F>
+void Measure(const char *name, F &&f) {
+  const auto start = std::chrono::steady_clock::now();
+  const size_t res = f();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << name << ": " << elapsed.count() << "s (result " << res << ")"
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  InitTestConf();
+  const size_t num_nodes = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                    : 1000000;
+  std::unique_ptr<Node> root = CreateTree(num_nodes);
+  const Node &croot = *root;
+  for (int i = 0; i < 3; ++i) {
+    Measure("recursive std::function", [&croot] {
+      size_t files = 0;
+      RecursiveTraverse(croot, [&files](const Node *n) {
+        files += n->GetType() == Node::FILE;
+      });
+      return files;
+    });
+    Measure("Node::Traverse", [&croot] {
+      size_t files = 0;
+      croot.Traverse([&files](const Node *n) {
+        files += n->GetType() == Node::FILE;
+      });
+      return files;
+    });
+  }
+
+  // Two directories of kDirSize files each, sharing kShared of them.
+  constexpr size_t kDirSize = 64;
+  constexpr size_t kShared = 48;
+  constexpr size_t kDistanceCalls = 1000000;
+  Node dir1(Node::DIR, "dir1");
+  Node dir2(Node::DIR, "dir2");
+  std::vector<std::unique_ptr<EqClass>> eq_classes;
+  for (size_t i = 0; i < kDirSize; ++i) {
+    Node *f1 = new Node(Node::FILE, "f" + std::to_string(i));
+    Node *f2 = new Node(Node::FILE, "f" + std::to_string(i));
+    dir1.AddChild(f1);
+    dir2.AddChild(f2);
+    eq_classes.push_back(std::make_unique<EqClass>());
+    eq_classes.back()->AddNode(*f1);
+    if (i >= kShared) {
+      eq_classes.push_back(std::make_unique<EqClass>());
+    }
+    eq_classes.back()->AddNode(*f2);
+  }
+  for (int i = 0; i < 3; ++i) {
+    Measure("hash table NodeDistance", [&dir1, &dir2] {
+      double total = 0;
+      for (size_t i = 0; i < kDistanceCalls; ++i) {
+        total += HashNodeDistance(dir1, dir2);
+      }
+      return static_cast<size_t>(total);
+    });
+    Measure("NodeDistance", [&dir1, &dir2] {
+      double total = 0;
+      for (size_t i = 0; i < kDistanceCalls; ++i) {
+        total += NodeDistance(dir1, dir2);
+      }
+      return static_cast<size_t>(total);
+    });
+  }
+  return 0;
+}
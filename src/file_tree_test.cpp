@@ -19,6 +19,7 @@
 
 #include "file_tree.h"
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <utility>
@@ -99,10 +100,56 @@ TEST(NodeTest, PathBuilding) {
   ASSERT_EQ(child->BuildPath(), fs::path("aaa") / fs::path("bbb"));
 }
 
+TEST(NodeTest, Weights) {
+  ASSERT_EQ(FileCountWeight::Of(100), 1);
+  Node n(Node::DIR, "n");
+  ASSERT_EQ(n.GetWeight(), 0);  // empty
+  Node *f1 = new Node(Node::FILE, "f1", FileSizeWeight::Of(3));
+  n.AddChild(f1);
+  Node *f2 = new Node(Node::FILE, "f2", FileSizeWeight::Of(5));
+  n.AddChild(f2);
+  ASSERT_EQ(f1->GetWeight(), 3);
+
+  EqClass c1;
+  c1.AddNode(*f1);
+  EqClass c2;
+  c2.AddNode(*f2);
+  ASSERT_EQ(n.GetWeight(), 8);
+  EqClass upper;
+  upper.AddNode(n);
+  ASSERT_EQ(upper.GetWeight(), 8);
+  upper.RemoveNode(n);
+  ASSERT_EQ(upper.GetWeight(), 0);
+}
+
+TEST(NodeTest, WeightFollowsChildClasses) {
+  Node root(Node::DIR, "root");
+  Node *pa = new Node(Node::DIR, "pa");
+  root.AddChild(pa);
+  Node *a = new Node(Node::FILE, "a", FileSizeWeight::Of(10));
+  pa->AddChild(a);
+  Node *b = new Node(Node::FILE, "b", FileSizeWeight::Of(9));
+  root.AddChild(b);
+
+  EqClass files;
+  files.AddNode(*a);
+  ASSERT_EQ(pa->GetWeight(), 10);
+  // pa is ready to evaluate already, but its only child's class changes.
+  files.AddNode(*b);
+  ASSERT_EQ(files.GetWeight(), 9.5);
+  ASSERT_EQ(pa->GetWeight(), 9.5);
+  EqClass dirs;
+  dirs.AddNode(*pa);
+  ASSERT_EQ(dirs.GetWeight(), 9.5);
+  dirs.RemoveNode(*pa);
+  ASSERT_EQ(dirs.GetWeight(), 0);
+}
+
 TEST(NodeTest, GetPossibleEquivalents) {
-  //       n1         n2    n3 (not evaluated)
-  //    /  |  \        |     |
-  //  nc--nc0  nc1 -- nc2-- nc3 -- nc4
+  //       n1         n2    n3 (not ready)  n4 (ready, not evaluated)
+  //    /  |  \        |     |  \             |
+  //  nc--nc0  nc1 -- nc2-- nc3 -- nc4 ------ nc6
+  //                             nc5 (not evaluated)
 
   Node n1(Node::DIR, "n1");
   Node n2(Node::DIR, "n2");
@@ -117,7 +164,11 @@ TEST(NodeTest, GetPossibleEquivalents) {
   n2.AddChild(nc2);
   Node *nc3 = new Node(Node::FILE, "nc3");
   n3.AddChild(nc3);
+  n3.AddChild(new Node(Node::FILE, "nc5"));
   Node nc4(Node::FILE, "nc4");
+  Node n4(Node::DIR, "n4");
+  Node *nc6 = new Node(Node::FILE, "nc6");
+  n4.AddChild(nc6);
 
   EqClass lower_0;
   lower_0.AddNode(*nc);
@@ -128,13 +179,20 @@ TEST(NodeTest, GetPossibleEquivalents) {
   lower_1.AddNode(*nc2);
   lower_1.AddNode(*nc3);
   lower_1.AddNode(nc4);
+  lower_1.AddNode(*nc6);
 
   EqClass upper_n2;
   upper_n2.AddNode(n2);
 
-  Nodes expected;
-  expected.push_back(&n2);
-  ASSERT_EQ(n1.GetPossibleEquivalents(), expected);
+  auto sorted = [](Nodes nodes) {
+    std::sort(nodes.begin(), nodes.end());
+    return nodes;
+  };
+  const Nodes expected = sorted({&n2, &n4});
+  ASSERT_EQ(sorted(n1.GetPossibleEquivalents(1)), expected);
+  // n2 and n4 share half of n1's weight, so they're at a distance of 0.5.
+  ASSERT_EQ(sorted(n1.GetPossibleEquivalents(0.6)), expected);
+  ASSERT_EQ(n1.GetPossibleEquivalents(0.2), Nodes());
 }
 
 TEST(NodeTest, Traverse) {
@@ -159,6 +217,48 @@ TEST(NodeTest, Traverse) {
   ASSERT_EQ(nodes, expected);
 }
 
+TEST(NodeTest, TraversalOrder) {
+  Node n1(Node::DIR, "n1");
+  Node *n2 = new Node(Node::DIR, "n2");
+  n1.AddChild(n2);
+  Node *n3 = new Node(Node::DIR, "n3");
+  n2->AddChild(n3);
+  Node *n4 = new Node(Node::DIR, "n4");
+  n2->AddChild(n4);
+  Node *n5 = new Node(Node::DIR, "n5");
+  n1.AddChild(n5);
+
+  Nodes nodes;
+  n1.Traverse([&nodes](Node *node) { nodes.push_back(node); });
+  ASSERT_EQ(Nodes({n3, n4, n2, n5, &n1}), nodes);
+
+  nodes.clear();
+  n1.TraversePreOrder([&nodes](Node *node) { nodes.push_back(node); });
+  ASSERT_EQ(Nodes({&n1, n2, n3, n4, n5}), nodes);
+
+  CNodes cnodes;
+  static_cast<const Node &>(n1).Traverse(
+      [&cnodes](const Node *node) { cnodes.push_back(node); },
+      [n2](const Node *node) { return node != n2; });
+  ASSERT_EQ(CNodes({n5, &n1}), cnodes);
+}
+
+TEST(NodeTest, DeepHierarchy) {
+  constexpr int kDepth = 1000000;
+  auto root = std::make_unique<Node>(Node::DIR, "root");
+  Node *last = root.get();
+  for (int i = 0; i < kDepth; ++i) {
+    Node *child = new Node(Node::DIR, "d");
+    last->AddChild(child);
+    last = child;
+  }
+  int visited = 0;
+  root->Traverse([&visited](Node * /* node */) { ++visited; });
+  ASSERT_EQ(kDepth + 1, visited);
+  // Destruction mustn't overflow the stack either.
+  root.reset();
+}
+
 TEST(NodeTest, AncestorTestIndependentFiles) {
   Node n1(Node::FILE, "n1");
   EqClass eq_class1;
@@ -349,6 +449,26 @@ TEST(NodeDistance, DifferentOneElemDirs) {
   ASSERT_DOUBLE_EQ(NodeDistance(n2, n), 1);
 }
 
+TEST(NodeDistance, ChildReclassified) {
+  Node n(Node::DIR, "aaa");
+  Node *n_child = new Node(Node::FILE, "xyz");
+  Node n2(Node::DIR, "bbb");
+  Node *n2_child = new Node(Node::FILE, "abc");
+  n.AddChild(n_child);
+  n2.AddChild(n2_child);
+
+  EqClass eq_class;
+  EqClass eq_class2;
+  eq_class.AddNode(*n_child);
+  eq_class.AddNode(*n2_child);
+  ASSERT_DOUBLE_EQ(NodeDistance(n, n2), 0);
+  eq_class.RemoveNode(*n2_child);
+  ASSERT_FALSE(n2.IsReadyToEvaluate());
+  eq_class2.AddNode(*n2_child);
+  ASSERT_DOUBLE_EQ(NodeDistance(n, n2), 1);
+  ASSERT_DOUBLE_EQ(NodeDistance(n2, n), 1);
+}
+
 TEST(NodeDistance, StrictlyLarger) {
   Node n1(Node::DIR, "dsa");
   NodeAndClasses n_child1 = CreateNodeWithWeight(9);
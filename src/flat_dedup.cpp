@@ -0,0 +1,870 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "flat_dedup.h"
+
+#include <cassert>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "conf.h"
+#include "fuzzy_dedup.h"
+#include "min_hash.h"
+#include "scanner_int.h"
+
+namespace {
+
+using Idx = FlatTree::Idx;
+constexpr Idx kNone = FlatTree::kNone;
+
+//======== FlatFuzzyDedup ======================================================
+
+// Scans a directory into a FlatTreeBuilder shared with the processors of other
+// directories, which may run concurrently.
+template <typename WeightPolicy>
+class FlatTreeCtorProcessor : public ScanProcessor<Idx> {
+ public:
+  // If top is set, it is the scanned directory's node. Otherwise the scanned
+  // directory becomes the root, named root_name if set or after itself.
+  FlatTreeCtorProcessor(FlatTreeBuilder &builder, std::mutex &mutex, Idx top,
+                        std::optional<std::string> root_name)
+      : top_(top),
+        builder_(builder),
+        mutex_(mutex),
+        root_name_(std::move(root_name)) {}
+
+  void Files(const Idx &parent, const FileRecords &files) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const FileRecord &file : files) {
+      builder_.AddFile(parent, file.name_, file.f_info_.sum_,
+                       WeightPolicy::Of(file.f_info_.size_));
+    }
+  }
+
+  Idx RootDir(const boost::filesystem::path &path) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    scanned_ = true;
+    if (top_ == kNone) {
+      top_ = builder_.AddDir(kNone, root_name_.value_or(path.native()));
+    }
+    return top_;
+  }
+
+  Idx Dir(const boost::filesystem::path &path, const Idx &parent) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return builder_.AddDir(parent, path.filename().native());
+  }
+
+  bool scanned_{};
+  Idx top_;  // the scanned directory
+
+ private:
+  FlatTreeBuilder &builder_;
+  std::mutex &mutex_;
+  const std::optional<std::string> root_name_;
+};
+
+}  // anonymous namespace
+
+FlatTree FlatFuzzyDedup(const std::vector<std::string> &dirs,
+                        const std::vector<std::string> &labels) {
+  assert(labels.empty() || labels.size() == dirs.size());
+  FlatTreeBuilder builder;
+  detail::WithFileWeight([&dirs, &labels, &builder](auto policy) {
+    using Processor = FlatTreeCtorProcessor<decltype(policy)>;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Processor>> processors;
+    std::vector<ScanProcessor<Idx> *> processor_ptrs;
+    // Like ScanDirectories(), but the children of the nameless root are
+    // created in advance, so that they are in the order of dirs.
+    const Idx super_root =
+        dirs.size() > 1 ? builder.AddDir(kNone, std::string()) : kNone;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      std::optional<std::string> name;
+      if (!labels.empty()) {
+        name = labels[i];
+      } else if (dirs.size() > 1) {
+        name = dirs[i];
+      }
+      const Idx top =
+          super_root == kNone ? kNone : builder.AddDir(super_root, *name);
+      processors.push_back(
+          std::make_unique<Processor>(builder, mutex, top, name));
+      processor_ptrs.push_back(processors.back().get());
+    }
+
+    ScanDirectoriesOrDbs(dirs, processor_ptrs);
+
+    if (super_root == kNone) {
+      return;
+    }
+    bool any_scanned = false;
+    for (const auto &processor : processors) {
+      if (processor->scanned_) {
+        any_scanned = true;
+      } else {
+        builder.Remove(processor->top_);  // could not be scanned
+      }
+    }
+    if (!any_scanned) {
+      builder.Remove(super_root);
+    }
+  });
+  return builder.Build(detail::EvalConcurrency(), Conf().approximate_,
+                       Conf().deterministic_);
+}
+
+//======== FlatTreeBuilder =====================================================
+
+FlatTree::Idx FlatTreeBuilder::AddDir(Idx parent, std::string_view name) {
+  return AddNode(parent, Node::DIR, name);
+}
+
+void FlatTreeBuilder::AddFile(Idx parent, std::string_view name, Cksum sum,
+                              double weight) {
+  files_.emplace_back(sum, File{weight, AddNode(parent, Node::FILE, name)});
+}
+
+FlatTree::Idx FlatTreeBuilder::AddNode(Idx parent, Node::Type type,
+                                       std::string_view name) {
+  assert((parent == kNone) == parent_.empty());
+  assert(parent == kNone || type_[parent] == Node::DIR);
+  assert(parent_.size() < kNone - 1);
+  parent_.push_back(parent);
+  type_.push_back(type);
+  names_.insert(names_.end(), name.begin(), name.end());
+  name_begin_.push_back(names_.size());
+  return parent_.size() - 1;
+}
+
+void FlatTreeBuilder::Remove(Idx node) {
+  if (node == 0) {
+    parent_.clear();
+    type_.clear();
+    name_begin_.assign(1, 0);
+    names_.clear();
+    files_.clear();
+    return;
+  }
+  // Its subtree becomes unreachable, so LayOut() skips it.
+  parent_[node] = kNone;
+}
+
+std::vector<FlatTree::Idx> FlatTreeBuilder::ClassifyFiles(
+    SyncThreadPool *pool, std::vector<double> &class_weight,
+    std::vector<Idx> &class_size) {
+  // Parents are added before their children, so whether they are reachable
+  // from the root is known by the time their children are looked at.
+  std::vector<bool> reachable(parent_.size());
+  for (Idx n = 0; n < parent_.size(); ++n) {
+    reachable[n] = n == 0 || (parent_[n] != kNone && reachable[parent_[n]]);
+  }
+  files_.erase(std::remove_if(files_.begin(), files_.end(),
+                              [&reachable](const std::pair<Cksum, File> &f) {
+                                return !reachable[f.second.node_];
+                              }),
+               files_.end());
+  detail::SortByCksum(files_, pool);
+  // Files with the same checksum are adjacent now.
+  std::vector<Idx> res(parent_.size(), kNone);
+  for (size_t i = 0; i < files_.size(); ++i) {
+    if (i == 0 || files_[i].first != files_[i - 1].first) {
+      class_weight.push_back(0);
+      class_size.push_back(0);
+    }
+    // Same as EqClass::AddNode().
+    double &weight = class_weight.back();
+    Idx &size = class_size.back();
+    ++size;
+    weight = (weight * (size - 1) + files_[i].second.weight_) / size;
+    res[files_[i].second.node_] = class_weight.size() - 1;
+  }
+  std::vector<std::pair<Cksum, File>>().swap(files_);
+  return res;
+}
+
+void FlatTreeBuilder::LayOut(FlatTree &tree, const std::vector<Idx> &classes,
+                             bool deterministic) {
+  const Idx num_added = parent_.size();
+  // Children of node n, in the order of adding them, are
+  // children[child_begin[n], child_begin[n + 1]).
+  std::vector<Idx> child_begin(num_added + 1);
+  for (Idx n = 0; n < num_added; ++n) {
+    if (parent_[n] != kNone) {
+      ++child_begin[parent_[n]];
+    }
+  }
+  std::partial_sum(child_begin.begin(), child_begin.end(),
+                   child_begin.begin());
+  std::vector<Idx> children(child_begin[num_added]);
+  for (Idx n = num_added; n > 0; --n) {
+    if (parent_[n - 1] != kNone) {
+      children[--child_begin[parent_[n - 1]]] = n - 1;
+    }
+  }
+  std::deque<Idx>().swap(parent_);
+  auto name_begin = [this](Idx n) { return names_.begin() + name_begin_[n]; };
+  if (deterministic) {
+    // Same as SortChildren().
+    for (Idx n = 0; n < num_added; ++n) {
+      std::sort(children.begin() + child_begin[n],
+                children.begin() + child_begin[n + 1],
+                [&name_begin](Idx c1, Idx c2) {
+                  return std::lexicographical_compare(
+                      name_begin(c1), name_begin(c1 + 1), name_begin(c2),
+                      name_begin(c2 + 1), std::char_traits<char>::lt);
+                });
+    }
+  }
+
+  std::vector<Idx> to_visit{0};
+  while (!to_visit.empty()) {
+    const Idx n = to_visit.back();
+    to_visit.pop_back();
+    ++tree.sizes_.num_nodes_;
+    tree.sizes_.names_size_ += name_begin_[n + 1] - name_begin_[n];
+    to_visit.insert(to_visit.end(), children.begin() + child_begin[n],
+                    children.begin() + child_begin[n + 1]);
+  }
+  tree.AllocateNodes();
+
+  // The same layout as FlatTree(const FuzzyDedupRes &) produces.
+  Idx num_appended = 0;
+  auto append = [&](Idx n, Idx parent) {
+    tree.parent_[num_appended] = parent;
+    tree.num_children_[num_appended] = child_begin[n + 1] - child_begin[n];
+    tree.eq_class_[num_appended] = classes[n];
+    tree.type_[num_appended] = type_[n];
+    std::copy(name_begin(n), name_begin(n + 1),
+              tree.names_ + tree.name_begin_[num_appended]);
+    tree.name_begin_[num_appended + 1] =
+        tree.name_begin_[num_appended] + name_begin_[n + 1] - name_begin_[n];
+    ++num_appended;
+  };
+  append(0, kNone);
+  std::vector<std::pair<Idx, Idx>> to_append{{0, 0}};
+  while (!to_append.empty()) {
+    const auto [idx, n] = to_append.back();
+    to_append.pop_back();
+    tree.first_child_[idx] = num_appended;
+    for (Idx c = child_begin[n]; c < child_begin[n + 1]; ++c) {
+      append(children[c], idx);
+    }
+    for (Idx c = child_begin[n + 1]; c > child_begin[n]; --c) {
+      to_append.emplace_back(tree.first_child_[idx] + c - 1 - child_begin[n],
+                             children[c - 1]);
+    }
+  }
+  assert(num_appended == tree.NumNodes());
+  std::deque<uint8_t>().swap(type_);
+  std::deque<uint64_t>().swap(name_begin_);
+  std::deque<char>().swap(names_);
+}
+
+void FlatTreeBuilder::StoreClasses(FlatTree &tree,
+                                   const std::vector<double> &class_weight,
+                                   const std::vector<Idx> &order) {
+  tree.sizes_.num_classes_ = order.size();
+  tree.AllocateClasses();
+  std::vector<Idx> new_class(order.size());
+  for (Idx c = 0; c < order.size(); ++c) {
+    new_class[order[c]] = c;
+    tree.class_weight_[c] = class_weight[order[c]];
+  }
+  for (Idx n = 0; n < tree.NumNodes(); ++n) {
+    tree.eq_class_[n] = new_class[tree.eq_class_[n]];
+  }
+  tree.FillClassNodes();
+}
+
+namespace {
+
+//======== Propagation =========================================================
+
+// Traverse the subtree of root in post-order, like Node::Traverse().
+template <typename F, typename D>
+void TraversePostOrder(const FlatTree &tree, Idx root, F &&callback,
+                       D &&descend) {
+  if (!descend(root)) {
+    return;
+  }
+  // Nodes on the path from root along with their next child to visit.
+  std::vector<std::pair<Idx, Idx>> stack{{root, tree.GetFirstChild(root)}};
+  while (!stack.empty()) {
+    const Idx node = stack.back().first;
+    const Idx next_child = stack.back().second++;
+    if (next_child < tree.GetEndChild(node)) {
+      if (descend(next_child)) {
+        stack.emplace_back(next_child, tree.GetFirstChild(next_child));
+      }
+    } else {
+      stack.pop_back();
+      callback(node);
+    }
+  }
+}
+
+// Evaluates the directories of a FlatTree which is being built the same way
+// detail::PropagateEquivalence() and detail::ApproxPropagateEquivalence()
+// evaluate Nodes. Classes are numbered in the order of creating them.
+class Propagation {
+ public:
+  // Nodes whose eq_class isn't kNone are in the classes described by
+  // class_weight and class_size; the others, but empty directories, which are
+  // put in a class of their own, aren't evaluated.
+  Propagation(const FlatTree &tree, Idx *eq_class,
+              std::vector<double> class_weight, std::vector<Idx> class_size);
+  Propagation(const Propagation &) = delete;
+  Propagation &operator=(const Propagation &) = delete;
+
+  // Evaluate everything.
+  void Run(int concurrency, bool approximate, bool deterministic);
+  // Classes in the order detail::SortEqClasses() sorts them in.
+  std::vector<Idx> SortClasses(bool deterministic) const;
+  const std::vector<double> &GetClassWeights() const { return class_weight_; }
+
+ private:
+  // The closest equivalent found for a node.
+  struct Equivalent {
+    Idx node_{kNone};
+    double distance_{};
+    // 0 for nodes evaluated before the current wave, 1 + index in the wave
+    // otherwise.
+    size_t order_{};
+  };
+
+  bool IsEvaluated(Idx n) const { return eq_class_[n] != kNone; }
+  bool IsReadyToEvaluate(Idx n) const {
+    return not_evaluated_children_[n] == 0;
+  }
+  // Distinct classes of n's children, sorted; n has to be ready to evaluate.
+  const Idx *ChildClassesBegin(Idx n) const {
+    return child_classes_.data() + tree_.GetFirstChild(n);
+  }
+  const Idx *ChildClassesEnd(Idx n) const {
+    return ChildClassesBegin(n) + num_child_classes_[n];
+  }
+  Idx NewClass();
+  // Same as EqClass::AddNode().
+  void AddNode(Idx c, Idx n);
+  // Put n in class c, without updating c's size and weight.
+  void Join(Idx c, Idx n);
+  void CollectChildClasses(Idx n);
+  // Same as Node::GetWeight() for directories ready to evaluate.
+  double GetWeight(Idx n) const;
+  // Same as NodeDistance().
+  double Distance(Idx n1, Idx n2) const;
+  // Same as Node::GetPossibleEquivalents().
+  std::vector<Idx> GetPossibleEquivalents(Idx n, double max_distance) const;
+  // Same as the IsBetter() used for Nodes.
+  bool IsBetter(const Equivalent &c1, const Equivalent &c2) const;
+  // Same as detail::PropagateEquivalence().
+  template <typename P, typename C>
+  void Run(int concurrency, P &&prepare, C &&get_candidates);
+
+  const FlatTree &tree_;
+  Idx *const eq_class_;
+  std::vector<double> class_weight_;
+  std::vector<Idx> class_size_;
+  // Nodes of class c are class_head_[c], next_in_class_[class_head_[c]] and
+  // so on, until kNone.
+  std::vector<Idx> class_head_;
+  std::vector<Idx> next_in_class_;
+  std::vector<Idx> not_evaluated_children_;
+  // Distinct classes of children of node n, once it is ready to evaluate, are
+  // child_classes_[GetFirstChild(n), GetFirstChild(n) + num_child_classes_[n]),
+  // which is where its children are.
+  std::vector<Idx> child_classes_;
+  std::vector<Idx> num_child_classes_;
+};
+
+Propagation::Propagation(const FlatTree &tree, Idx *eq_class,
+                         std::vector<double> class_weight,
+                         std::vector<Idx> class_size)
+    : tree_(tree),
+      eq_class_(eq_class),
+      class_weight_(std::move(class_weight)),
+      class_size_(std::move(class_size)),
+      class_head_(class_weight_.size(), kNone),
+      next_in_class_(tree.NumNodes(), kNone),
+      not_evaluated_children_(tree.NumNodes()),
+      child_classes_(tree.NumNodes()),
+      num_child_classes_(tree.NumNodes()) {
+  for (Idx n = 0; n < tree_.NumNodes(); ++n) {
+    not_evaluated_children_[n] = tree_.GetNumChildren(n);
+  }
+  Idx empty_dirs = kNone;
+  for (Idx n = 0; n < tree_.NumNodes(); ++n) {
+    if (IsEvaluated(n)) {
+      Join(eq_class_[n], n);
+    } else if (tree_.GetType(n) == Node::DIR && tree_.GetNumChildren(n) == 0) {
+      if (empty_dirs == kNone) {
+        empty_dirs = NewClass();
+      }
+      AddNode(empty_dirs, n);
+    }
+  }
+}
+
+Idx Propagation::NewClass() {
+  class_weight_.push_back(0);
+  class_size_.push_back(0);
+  class_head_.push_back(kNone);
+  return class_weight_.size() - 1;
+}
+
+void Propagation::AddNode(Idx c, Idx n) {
+  const double weight = GetWeight(n);
+  ++class_size_[c];
+  class_weight_[c] =
+      (class_weight_[c] * (class_size_[c] - 1) + weight) / class_size_[c];
+  Join(c, n);
+}
+
+void Propagation::Join(Idx c, Idx n) {
+  assert(IsReadyToEvaluate(n));
+  eq_class_[n] = c;
+  next_in_class_[n] = class_head_[c];
+  class_head_[c] = n;
+  const Idx parent = tree_.GetParent(n);
+  if (parent != kNone) {
+    assert(not_evaluated_children_[parent]);
+    if (--not_evaluated_children_[parent] == 0) {
+      CollectChildClasses(parent);
+    }
+  }
+}
+
+void Propagation::CollectChildClasses(Idx n) {
+  Idx *const begin = child_classes_.data() + tree_.GetFirstChild(n);
+  Idx *end = begin;
+  for (Idx child = tree_.GetFirstChild(n); child < tree_.GetEndChild(n);
+       ++child) {
+    *end++ = eq_class_[child];
+  }
+  std::sort(begin, end);
+  num_child_classes_[n] = std::unique(begin, end) - begin;
+}
+
+double Propagation::GetWeight(Idx n) const {
+  assert(IsReadyToEvaluate(n));
+  double weight = 0;
+  for (const Idx *c = ChildClassesBegin(n); c != ChildClassesEnd(n); ++c) {
+    weight += class_weight_[*c];
+  }
+  return weight;
+}
+
+double Propagation::Distance(Idx n1, Idx n2) const {
+  uint64_t sum = 0;
+  uint64_t sym_diff = 0;
+  const Idx *it1 = ChildClassesBegin(n1);
+  const Idx *it2 = ChildClassesBegin(n2);
+  const Idx *const end1 = ChildClassesEnd(n1);
+  const Idx *const end2 = ChildClassesEnd(n2);
+  while (it1 != end1 && it2 != end2) {
+    if (*it1 < *it2) {
+      sum += class_weight_[*it1];
+      sym_diff += class_weight_[*it1++];
+    } else if (*it2 < *it1) {
+      sum += class_weight_[*it2];
+      sym_diff += class_weight_[*it2++];
+    } else {
+      sum += class_weight_[*it1];
+      ++it1;
+      ++it2;
+    }
+  }
+  for (; it1 != end1; ++it1) {
+    sum += class_weight_[*it1];
+    sym_diff += class_weight_[*it1];
+  }
+  for (; it2 != end2; ++it2) {
+    sum += class_weight_[*it2];
+    sym_diff += class_weight_[*it2];
+  }
+  if (sum == 0) {
+    return 0;
+  }
+  assert(sum >= sym_diff);
+  return static_cast<double>(sym_diff) / sum;
+}
+
+std::vector<Idx> Propagation::GetPossibleEquivalents(
+    Idx n, double max_distance) const {
+  uint64_t weight = 0;
+  for (const Idx *c = ChildClassesBegin(n); c != ChildClassesEnd(n); ++c) {
+    weight += class_weight_[*c];
+  }
+  const double min_shared = (1 - max_distance) * weight * (1 - 1e-9);
+  const bool prune = weight > 0 && min_shared > 0;
+
+  std::vector<Idx> by_popularity(ChildClassesBegin(n), ChildClassesEnd(n));
+  std::sort(by_popularity.begin(), by_popularity.end(),
+            [this](Idx c1, Idx c2) {
+              return class_size_[c1] > class_size_[c2];
+            });
+  uint64_t skipped_weight = 0;
+  std::unordered_map<Idx, std::pair<uint64_t, Idx>> candidates;
+  for (const Idx c : by_popularity) {
+    if (prune) {
+      uint64_t new_skipped_weight = skipped_weight;
+      new_skipped_weight += class_weight_[c];
+      if (new_skipped_weight < min_shared) {
+        skipped_weight = new_skipped_weight;
+        continue;
+      }
+    }
+    for (Idx equivalent = class_head_[c]; equivalent != kNone;
+         equivalent = next_in_class_[equivalent]) {
+      const Idx parent = tree_.GetParent(equivalent);
+      if (parent != kNone && IsReadyToEvaluate(parent) && parent != n) {
+        auto &[shared_weight, last_class] =
+            candidates.try_emplace(parent, 0, kNone).first->second;
+        if (last_class != c) {
+          shared_weight += class_weight_[c];
+          last_class = c;
+        }
+      }
+    }
+  }
+  std::vector<Idx> res;
+  for (const auto &[candidate, shared_and_class] : candidates) {
+    if (!prune || shared_and_class.first + skipped_weight > min_shared) {
+      res.push_back(candidate);
+    }
+  }
+  return res;
+}
+
+bool Propagation::IsBetter(const Equivalent &c1, const Equivalent &c2) const {
+  if (c1.distance_ != c2.distance_) {
+    return c1.distance_ < c2.distance_;
+  }
+  if (c1.order_ != c2.order_) {
+    return c1.order_ < c2.order_;
+  }
+  if (c1.order_ != 0 || eq_class_[c1.node_] == eq_class_[c2.node_]) {
+    return false;  // same node or same outcome
+  }
+  // Compared as paths, like Nodes' paths are.
+  return boost::filesystem::path(tree_.BuildPath(c1.node_)) <
+         boost::filesystem::path(tree_.BuildPath(c2.node_));
+}
+
+template <typename P, typename C>
+void Propagation::Run(int concurrency, P &&prepare, C &&get_candidates) {
+  const double max_distance = Conf().tolerable_diff_pct_ / 100.;
+  std::unique_ptr<SyncThreadPool> pool;
+  if (concurrency > 1) {
+    pool = std::make_unique<SyncThreadPool>(concurrency);
+  }
+
+  std::vector<Idx> wave;
+  TraversePostOrder(
+      tree_, 0,
+      [this, &wave](Idx n) {
+        if (IsReadyToEvaluate(n)) {
+          wave.push_back(n);
+        }
+      },
+      [this](Idx n) { return !IsEvaluated(n); });
+  while (!wave.empty()) {
+    std::unordered_map<Idx, size_t> wave_idx;
+    wave_idx.reserve(wave.size());
+    for (size_t i = 0; i < wave.size(); ++i) {
+      wave_idx.emplace(wave[i], i);
+    }
+    prepare(wave, pool.get());
+
+    std::vector<Equivalent> closest(wave.size());
+    ParallelFor(
+        pool.get(), wave.size(),
+        [&](size_t i) {
+          const Idx node = wave[i];
+          for (const Idx candidate : get_candidates(i, node)) {
+            Equivalent equivalent{candidate, 0, 0};
+            if (!IsEvaluated(candidate)) {
+              const size_t idx = wave_idx.at(candidate);
+              if (idx >= i) {
+                continue;
+              }
+              equivalent.order_ = idx + 1;
+            }
+            equivalent.distance_ = Distance(node, candidate);
+            if (equivalent.distance_ < max_distance &&
+                (closest[i].node_ == kNone ||
+                 IsBetter(equivalent, closest[i]))) {
+              closest[i] = equivalent;
+            }
+          }
+        },
+        detail::kNodesPerTask);
+
+    std::vector<Idx> next_wave;
+    for (size_t i = 0; i < wave.size(); ++i) {
+      const Idx node = wave[i];
+      AddNode(closest[i].node_ != kNone ? eq_class_[closest[i].node_]
+                                        : NewClass(),
+              node);
+      const Idx parent = tree_.GetParent(node);
+      if (parent != kNone && IsReadyToEvaluate(parent)) {
+        next_wave.push_back(parent);
+      }
+    }
+    wave.swap(next_wave);
+  }
+  if (pool) {
+    pool->Stop();
+  }
+  assert(IsEvaluated(0));
+}
+
+void Propagation::Run(int concurrency, bool approximate, bool deterministic) {
+  const double max_distance = Conf().tolerable_diff_pct_ / 100.;
+  if (!approximate) {
+    Run(
+        concurrency, [](const std::vector<Idx> &, SyncThreadPool *) {},
+        [this, max_distance](size_t /* i */, Idx node) {
+          return GetPossibleEquivalents(node, max_distance);
+        });
+    return;
+  }
+  // Same as MinHashIndex, with classes told apart by their numbers unless
+  // deterministic is set. No directories are evaluated before.
+  const MinHasher hasher(max_distance);
+  std::unordered_map<Idx, uint64_t> class_ids;
+  std::unordered_multimap<uint64_t, Idx> buckets;
+  std::vector<MinHasher::Signature> signatures;
+  auto identify = [this, &class_ids](Idx node) {
+    for (const Idx *c = ChildClassesBegin(node); c != ChildClassesEnd(node);
+         ++c) {
+      if (class_ids.count(*c)) {
+        continue;
+      }
+      std::string smallest;
+      for (Idx n = class_head_[*c]; n != kNone; n = next_in_class_[n]) {
+        std::string path = tree_.BuildPath(n);
+        if (n == class_head_[*c] || path < smallest) {
+          smallest.swap(path);
+        }
+      }
+      class_ids.emplace(*c, MinHasher::PathId(smallest));
+    }
+  };
+  auto sign = [&](Idx node) {
+    MinHasher::Classes classes;
+    classes.reserve(ChildClassesEnd(node) - ChildClassesBegin(node));
+    for (const Idx *c = ChildClassesBegin(node); c != ChildClassesEnd(node);
+         ++c) {
+      classes.emplace_back(deterministic ? class_ids.at(*c) : *c,
+                           static_cast<uint64_t>(class_weight_[*c]));
+    }
+    return hasher.Sign(classes);
+  };
+  Run(
+      concurrency,
+      [&](const std::vector<Idx> &wave, SyncThreadPool *pool) {
+        signatures.assign(wave.size(), MinHasher::Signature());
+        if (deterministic) {
+          for (const Idx node : wave) {
+            identify(node);
+          }
+        }
+        ParallelFor(
+            pool, wave.size(), [&](size_t i) { signatures[i] = sign(wave[i]); },
+            detail::kNodesPerTask);
+        for (size_t i = 0; i < wave.size(); ++i) {
+          if (signatures[i].empty()) {
+            continue;
+          }
+          for (size_t band = 0; band < hasher.GetNumBands(); ++band) {
+            buckets.emplace(hasher.BandKey(signatures[i], band), wave[i]);
+          }
+        }
+      },
+      [&](size_t i, Idx node) {
+        if (signatures[i].empty()) {
+          // Only weightless children, which MinHash can't tell apart.
+          return GetPossibleEquivalents(node, max_distance);
+        }
+        std::vector<Idx> res;
+        for (size_t band = 0; band < hasher.GetNumBands(); ++band) {
+          const auto range =
+              buckets.equal_range(hasher.BandKey(signatures[i], band));
+          for (auto it = range.first; it != range.second; ++it) {
+            res.push_back(it->second);
+          }
+        }
+        std::sort(res.begin(), res.end());
+        res.erase(std::unique(res.begin(), res.end()), res.end());
+        res.erase(std::remove(res.begin(), res.end(), node), res.end());
+        return res;
+      });
+}
+
+std::vector<Idx> Propagation::SortClasses(bool deterministic) const {
+  std::vector<Idx> res(class_weight_.size());
+  std::iota(res.begin(), res.end(), 0);
+  if (!deterministic) {
+    std::sort(res.begin(), res.end(), [this](Idx c1, Idx c2) {
+      return class_weight_[c1] > class_weight_[c2];
+    });
+    return res;
+  }
+  // Position of the first node of every class in pre-order.
+  std::vector<Idx> first_node(class_weight_.size(), kNone);
+  Idx num_visited = 0;
+  std::vector<Idx> stack{0};
+  while (!stack.empty()) {
+    const Idx n = stack.back();
+    stack.pop_back();
+    if (first_node[eq_class_[n]] == kNone) {
+      first_node[eq_class_[n]] = num_visited;
+    }
+    ++num_visited;
+    for (Idx child = tree_.GetEndChild(n); child > tree_.GetFirstChild(n);
+         --child) {
+      stack.push_back(child - 1);
+    }
+  }
+  std::sort(res.begin(), res.end(), [this, &first_node](Idx c1, Idx c2) {
+    if (class_weight_[c1] != class_weight_[c2]) {
+      return class_weight_[c1] > class_weight_[c2];
+    }
+    return first_node[c1] < first_node[c2];
+  });
+  return res;
+}
+
+//======== CalculateUniqueness =================================================
+
+// Files in a subtree, like the SubtreeFiles used for Nodes.
+struct SubtreeFiles {
+  std::unordered_map<Idx, size_t> shared_;
+  double total_weight_{};
+  double unique_weight_{};
+
+  void AddFiles(const FlatTree &tree, Idx c, size_t count) {
+    const size_t in_subtree = (shared_[c] += count);
+    if (in_subtree == tree.GetClassSize(c)) {
+      unique_weight_ += in_subtree * tree.GetClassWeight(c);
+      shared_.erase(c);
+    }
+  }
+};
+
+// Same as detail::CalculateUniqueness().
+void CalculateUniqueness(const FlatTree &tree, double *unique_fraction) {
+  std::vector<SubtreeFiles> stack;
+  TraversePostOrder(
+      tree, 0,
+      [&tree, unique_fraction, &stack](Idx n) {
+        const Idx c = tree.GetEqClass(n);
+        switch (tree.GetType(n)) {
+          case Node::FILE: {
+            unique_fraction[n] = tree.GetClassSize(c) == 1 ? 1 : 0;
+            stack.emplace_back();
+            stack.back().total_weight_ = tree.GetClassWeight(c);
+            stack.back().AddFiles(tree, c, 1);
+            break;
+          }
+          case Node::DIR: {
+            auto first = stack.end() - tree.GetNumChildren(n);
+            auto largest = std::max_element(
+                first, stack.end(), [](const SubtreeFiles &f1,
+                                       const SubtreeFiles &f2) {
+                  return f1.shared_.size() < f2.shared_.size();
+                });
+            SubtreeFiles res;
+            if (largest != stack.end()) {
+              res = std::move(*largest);
+            }
+            for (auto it = first; it != stack.end(); ++it) {
+              if (it == largest) {
+                continue;
+              }
+              res.total_weight_ += it->total_weight_;
+              res.unique_weight_ += it->unique_weight_;
+              for (const auto &class_and_count : it->shared_) {
+                res.AddFiles(tree, class_and_count.first,
+                             class_and_count.second);
+              }
+            }
+            stack.erase(first, stack.end());
+            unique_fraction[n] = (res.total_weight_ == 0)
+                                     ? 0
+                                     : (res.unique_weight_ / res.total_weight_);
+            stack.push_back(std::move(res));
+            break;
+          }
+        }
+      },
+      [](Idx /* n */) { return true; });
+  assert(stack.size() == 1);
+}
+
+}  // anonymous namespace
+
+FlatTree FlatTreeBuilder::Build(int concurrency, bool approximate,
+                                bool deterministic) {
+  FlatTree tree;
+  tree.settings_ = FlatTree::CurrentSettings();
+  if (parent_.empty()) {
+    tree.AllocateNodes();
+    tree.AllocateClasses();
+    return tree;
+  }
+  std::vector<double> class_weight;
+  std::vector<Idx> class_size;
+  std::vector<Idx> classes;
+  {
+    std::unique_ptr<SyncThreadPool> pool;
+    if (concurrency > 1) {
+      pool = std::make_unique<SyncThreadPool>(concurrency);
+    }
+    classes = ClassifyFiles(pool.get(), class_weight, class_size);
+    if (pool) {
+      pool->Stop();
+    }
+  }
+  LayOut(tree, classes, deterministic);
+  std::vector<Idx>().swap(classes);
+
+  {
+    Propagation propagation(tree, tree.eq_class_, std::move(class_weight),
+                            std::move(class_size));
+    propagation.Run(concurrency, approximate, deterministic);
+    StoreClasses(tree, propagation.GetClassWeights(),
+                 propagation.SortClasses(deterministic));
+  }
+  CalculateUniqueness(tree, tree.unique_fraction_);
+  tree.ComputePathRanks();
+  return tree;
+}
@@ -0,0 +1,101 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_FLAT_DEDUP_H_
+#define SRC_FLAT_DEDUP_H_
+
+#include <cstdint>
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_tree.h"
+#include "flat_tree.h"
+#include "hash_cache.h"  // for Cksum
+#include "synch_thread_pool.h"
+
+// Same as FlatTree(FuzzyDedup(dirs, labels)), but no Nodes are created: the
+// hierarchy is scanned into a FlatTreeBuilder and analyzed there. Nodes take
+// several times more memory than FlatTree's arrays, so this is what one-shot
+// runs use; IncrementalFuzzyDedup is only needed to update the results.
+FlatTree FlatFuzzyDedup(const std::vector<std::string> &dirs,
+                        const std::vector<std::string> &labels);
+
+// Builds an analyzed FlatTree out of a hierarchy added node by node. Until
+// Build() the hierarchy is kept in arrays indexed by the order of adding
+// nodes; then it is laid out like FlatTree(const FuzzyDedupRes &) would lay it
+// out and equivalence classes are found the same way FuzzyDedup() finds them,
+// only on indices rather than on Nodes.
+class FlatTreeBuilder {
+ public:
+  using Idx = FlatTree::Idx;
+
+  FlatTreeBuilder() = default;
+  FlatTreeBuilder(const FlatTreeBuilder &) = delete;
+  FlatTreeBuilder &operator=(const FlatTreeBuilder &) = delete;
+
+  // The first node added has to be a directory, which becomes the root; its
+  // parent is kNone. Parents of the others have to be directories added
+  // before. Nodes are numbered in the order of adding them.
+  Idx AddDir(Idx parent, std::string_view name);
+  void AddFile(Idx parent, std::string_view name, Cksum sum, double weight);
+  // Drop node along with its subtree. Dropping the root leaves no nodes.
+  void Remove(Idx node);
+  size_t NumNodes() const { return parent_.size(); }
+
+  // Analyze the hierarchy and free the builder's copy of it. Directories are
+  // compared using up to concurrency threads. approximate and deterministic
+  // have the same meaning as --approximate and --deterministic.
+  FlatTree Build(int concurrency, bool approximate, bool deterministic);
+
+ private:
+  struct File {
+    double weight_;
+    Idx node_;
+  };
+
+  Idx AddNode(Idx parent, Node::Type type, std::string_view name);
+  // Put files with the same checksums in the same classes, setting their
+  // sizes and weights. Files in removed subtrees are dropped. Returns the
+  // class of every node, kNone for directories and dropped files.
+  std::vector<Idx> ClassifyFiles(SyncThreadPool *pool,
+                                 std::vector<double> &class_weight,
+                                 std::vector<Idx> &class_size);
+  // Copy the nodes reachable from the root to tree along with their classes.
+  void LayOut(FlatTree &tree, const std::vector<Idx> &classes,
+              bool deterministic);
+  // Number classes according to order.
+  static void StoreClasses(FlatTree &tree,
+                           const std::vector<double> &class_weight,
+                           const std::vector<Idx> &order);
+
+  // Deques don't copy their contents as they grow.
+  std::deque<Idx> parent_;
+  std::deque<uint8_t> type_;
+  // Name of node n is names_[name_begin_[n], name_begin_[n + 1]).
+  std::deque<uint64_t> name_begin_{0};
+  std::deque<char> names_;
+  // Checksums of regular files.
+  std::vector<std::pair<Cksum, File>> files_;
+};
+
+#endif  // SRC_FLAT_DEDUP_H_
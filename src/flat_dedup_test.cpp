@@ -0,0 +1,246 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "flat_dedup.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "fuzzy_dedup.h"
+#include "gtest/gtest.h"
+#include "hash_cache.h"
+#include "test_common.h"
+
+// Build a pseudo-random hierarchy full of similar directories, some of them
+// empty. Files with the same checksum weigh the same.
+static std::shared_ptr<Node> MakeRandomTree(detail::Sum2Node *sum_2_node) {
+  constexpr int kNumGroups = 20;
+  constexpr int kNumDirs = 15;
+  constexpr int kNumFiles = 8;
+  std::mt19937 rng(7);
+  auto root = std::make_shared<Node>(Node::DIR, "r");
+  for (int i = 0; i < kNumGroups; ++i) {
+    auto *group = new Node(Node::DIR, "g" + std::to_string(i));
+    root->AddChild(group);
+    for (int j = 0; j < kNumDirs; ++j) {
+      auto *dir = new Node(Node::DIR, "d" + std::to_string(j));
+      group->AddChild(dir);
+      if (rng() % 10 == 0) {
+        continue;
+      }
+      const Cksum dir_template = rng() % 12;
+      for (int k = 0; k < kNumFiles; ++k) {
+        const Cksum sum =
+            rng() % 6 == 0 ? 1000 + rng() % 30 : dir_template * 10 + k;
+        auto *file =
+            new Node(Node::FILE, "f" + std::to_string(k), 1 + sum % 3);
+        dir->AddChild(file);
+        sum_2_node->emplace_back(sum, file);
+      }
+    }
+  }
+  return root;
+}
+
+// Analyze the hierarchy built by MakeRandomTree() using Nodes.
+static FlatTree DedupNodes(int concurrency, bool approximate,
+                           bool deterministic) {
+  detail::Sum2Node sum_2_node;
+  std::shared_ptr<Node> root = MakeRandomTree(&sum_2_node);
+  if (deterministic) {
+    detail::SortChildren(*root);
+  }
+  EqClassesPtr eq_classes = detail::ClassifyDuplicateFiles(*root, sum_2_node);
+  std::unique_ptr<EqClass> empty_dirs = detail::ClassifyEmptyDirs(*root);
+  if (!empty_dirs->IsEmpty()) {
+    eq_classes->push_back(std::move(empty_dirs));
+  }
+  if (approximate) {
+    detail::ApproxPropagateEquivalence(*root, eq_classes, concurrency,
+                                       deterministic);
+  } else {
+    detail::PropagateEquivalence(*root, eq_classes, concurrency);
+  }
+  detail::SortEqClasses(eq_classes, deterministic ? root.get() : nullptr);
+  detail::CalculateUniqueness(*root);
+  return FlatTree(FuzzyDedupRes(root, eq_classes));
+}
+
+// Analyze the hierarchy built by MakeRandomTree() using a FlatTreeBuilder.
+static FlatTree DedupFlat(int concurrency, bool approximate,
+                          bool deterministic) {
+  detail::Sum2Node sum_2_node;
+  std::shared_ptr<Node> root = MakeRandomTree(&sum_2_node);
+  std::unordered_map<const Node *, Cksum> sums;
+  for (const auto &[sum, node] : sum_2_node) {
+    sums.emplace(node, sum);
+  }
+  FlatTreeBuilder builder;
+  std::unordered_map<const Node *, FlatTree::Idx> dirs;
+  root->TraversePreOrder([&](Node *n) {
+    const FlatTree::Idx parent =
+        n->GetParent() ? dirs.at(n->GetParent()) : FlatTree::kNone;
+    if (n->GetType() == Node::FILE) {
+      builder.AddFile(parent, n->GetName(), sums.at(n), n->GetWeight());
+    } else {
+      dirs.emplace(n, builder.AddDir(parent, n->GetName()));
+    }
+  });
+  return builder.Build(concurrency, approximate, deterministic);
+}
+
+// Expect both trees to have the same nodes, laid out the same way, in the same
+// classes. Unless same_class_ids, classes may be numbered differently.
+static void ExpectSame(const FlatTree &expected, const FlatTree &actual,
+                       bool same_class_ids) {
+  ASSERT_EQ(expected.NumNodes(), actual.NumNodes());
+  ASSERT_EQ(expected.NumClasses(), actual.NumClasses());
+  for (FlatTree::Idx n = 0; n < expected.NumNodes(); ++n) {
+    ASSERT_EQ(expected.GetParent(n), actual.GetParent(n));
+    ASSERT_EQ(expected.GetFirstChild(n), actual.GetFirstChild(n));
+    ASSERT_EQ(expected.GetNumChildren(n), actual.GetNumChildren(n));
+    ASSERT_EQ(expected.GetName(n), actual.GetName(n));
+    ASSERT_EQ(expected.GetType(n), actual.GetType(n));
+    ASSERT_EQ(expected.GetPathRank(n), actual.GetPathRank(n));
+    ASSERT_DOUBLE_EQ(expected.GetUniqueFraction(n),
+                     actual.GetUniqueFraction(n));
+    const FlatTree::Idx expected_class = expected.GetEqClass(n);
+    const FlatTree::Idx actual_class = actual.GetEqClass(n);
+    if (same_class_ids) {
+      ASSERT_EQ(expected_class, actual_class);
+    }
+    // Nodes of classes are sorted, so the first one tells the class apart.
+    ASSERT_EQ(*expected.GetClassNodes(expected_class).begin(),
+              *actual.GetClassNodes(actual_class).begin());
+    ASSERT_EQ(expected.GetClassSize(expected_class),
+              actual.GetClassSize(actual_class));
+    ASSERT_DOUBLE_EQ(expected.GetClassWeight(expected_class),
+                     actual.GetClassWeight(actual_class));
+  }
+}
+
+TEST(FlatTreeBuilderTest, SameAsNodes) {
+  const FlatTree expected = DedupNodes(1, false, false);
+  ASSERT_LT(expected.NumClasses() + 500, expected.NumNodes());
+  ExpectSame(expected, DedupFlat(1, false, false), false);
+  ExpectSame(expected, DedupFlat(4, false, false), false);
+}
+
+TEST(FlatTreeBuilderTest, DeterministicSameAsNodes) {
+  ExpectSame(DedupNodes(1, false, true), DedupFlat(1, false, true), true);
+  ExpectSame(DedupNodes(1, false, true), DedupFlat(3, false, true), true);
+}
+
+TEST(FlatTreeBuilderTest, ApproximateSameAsNodes) {
+  ExpectSame(DedupNodes(1, true, true), DedupFlat(1, true, true), true);
+  ExpectSame(DedupNodes(1, true, true), DedupFlat(4, true, true), true);
+}
+
+TEST(FlatTreeBuilderTest, RemovedSubtree) {
+  FlatTreeBuilder builder;
+  const FlatTree::Idx root = builder.AddDir(FlatTree::kNone, "r");
+  const FlatTree::Idx a = builder.AddDir(root, "a");
+  builder.AddFile(a, "f", 1, 1);
+  const FlatTree::Idx b = builder.AddDir(root, "b");
+  builder.AddFile(b, "f", 1, 1);
+  builder.AddFile(builder.AddDir(a, "c"), "g", 2, 1);
+  builder.Remove(a);
+  const FlatTree tree = builder.Build(1, false, false);
+  ASSERT_EQ(3U, tree.NumNodes());
+  ASSERT_EQ("r/b/f", tree.BuildPath(2));
+  // The removed copy of the file doesn't count.
+  ASSERT_EQ(1U, tree.GetClassSize(tree.GetEqClass(2)));
+  ASSERT_EQ(1, tree.GetUniqueFraction(0));
+}
+
+// Scan dirs into a FlatTree with and without Nodes. Return what they say about
+// every path: its type, the lowest path in its class and its uniqueness.
+using PathInfo = std::map<std::string, std::tuple<int, std::string, double>>;
+
+static PathInfo Describe(const FlatTree &tree) {
+  PathInfo res;
+  for (FlatTree::Idx n = 0; n < tree.NumNodes(); ++n) {
+    // Scans may list directories in different orders, so the nodes may be
+    // numbered differently.
+    std::string lowest = tree.BuildPath(n);
+    for (const FlatTree::Idx other : tree.GetClassNodes(tree.GetEqClass(n))) {
+      lowest = std::min(lowest, tree.BuildPath(other));
+    }
+    res.emplace(tree.BuildPath(n), std::make_tuple(tree.GetType(n), lowest,
+                                                   tree.GetUniqueFraction(n)));
+  }
+  return res;
+}
+
+static std::pair<PathInfo, PathInfo> DedupBothWays(
+    const std::vector<std::string> &dirs,
+    const std::vector<std::string> &labels) {
+  HashCache::Initializer hash_cache_init("", "");
+  return std::make_pair(Describe(FlatTree(FuzzyDedup(dirs, labels))),
+                        Describe(FlatFuzzyDedup(dirs, labels)));
+}
+
+TEST(FlatFuzzyDedupTest, SameAsNodes) {
+  TmpDir tmp;
+  tmp.CreateFile("a/f1", "x");
+  tmp.CreateFile("a/f2", "y");
+  tmp.CreateFile("a/f3", "z");
+  tmp.CreateFile("b/f1", "x");
+  tmp.CreateFile("b/f2", "y");
+  tmp.CreateFile("c/d/f3", "z");
+  tmp.CreateSubdir("e");
+  tmp.CreateSubdir("f");
+  const auto [expected, actual] = DedupBothWays({tmp.dir_}, {});
+  ASSERT_EQ(expected, actual);
+  ASSERT_EQ(std::get<1>(actual.at(tmp.dir_ + "/a/f3")),
+            std::get<1>(actual.at(tmp.dir_ + "/c/d/f3")));
+}
+
+TEST(FlatFuzzyDedupTest, ManyRoots) {
+  TmpDir t1;
+  TmpDir t2;
+  t1.CreateFile("shared/f1", "a");
+  t1.CreateFile("shared/f2", "b");
+  t1.CreateFile("f3", "c");
+  t2.CreateFile("copy/f1", "a");
+  t2.CreateFile("copy/f2", "b");
+  t2.CreateFile("f4", "d");
+  const std::string missing = t1.dir_ + "/missing";
+  const auto [expected, actual] = DedupBothWays(
+      {t1.dir_, missing, t2.dir_}, {"one", "gone", "two/x"});
+  ASSERT_EQ(expected, actual);
+  ASSERT_EQ(1U, actual.count(""));
+  ASSERT_EQ(0U, actual.count("gone"));
+  ASSERT_EQ(std::get<1>(actual.at("one/shared")),
+            std::get<1>(actual.at("two/x/copy")));
+}
+
+TEST(FlatFuzzyDedupTest, NothingScanned) {
+  TmpDir tmp;
+  HashCache::Initializer hash_cache_init("", "");
+  ASSERT_TRUE(FlatFuzzyDedup({tmp.dir_ + "/missing"}, {}).Empty());
+  ASSERT_TRUE(
+      FlatFuzzyDedup({tmp.dir_ + "/missing", tmp.dir_ + "/gone"}, {}).Empty());
+}
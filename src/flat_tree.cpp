@@ -0,0 +1,450 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "flat_tree.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
+
+#include "conf.h"
+#include "exceptions.h"
+#include "log.h"
+
+namespace {
+
+// Compares a + (a_slash ? "/" : "") with b + (b_slash ? "/" : "") as
+// std::string would.
+bool KeyLess(std::string_view a, bool a_slash, std::string_view b,
+             bool b_slash) {
+  const size_t common = std::min(a.size(), b.size());
+  const int cmp = a.substr(0, common).compare(b.substr(0, common));
+  if (cmp != 0) {
+    return cmp < 0;
+  }
+  if (a.size() == b.size()) {
+    return !a_slash && b_slash;
+  }
+  if (a.size() > b.size()) {
+    return !KeyLess(b, b_slash, a, a_slash);
+  }
+  return !a_slash || std::char_traits<char>::lt('/', b[common]);
+}
+
+}  // namespace
+
+FlatTree::Settings FlatTree::CurrentSettings() {
+  return {Conf().tolerable_diff_pct_, Conf().use_size_, Conf().approximate_};
+}
+
+FlatTree::FlatTree(const FuzzyDedupRes &res) : settings_(CurrentSettings()) {
+  std::unordered_map<const EqClass *, Idx> class_ids;
+  if (res.second) {
+    sizes_.num_classes_ = res.second->size();
+  }
+  if (res.first) {
+    res.first->Traverse([this](const Node *n) {
+      ++sizes_.num_nodes_;
+      sizes_.names_size_ += n->GetName().size();
+    });
+  }
+  assert(sizes_.num_nodes_ < kNone);
+  AllocateNodes();
+  AllocateClasses();
+
+  if (res.second) {
+    class_ids.reserve(res.second->size());
+    for (const auto &eq_class : *res.second) {
+      class_weight_[class_ids.size()] = eq_class->GetWeight();
+      class_ids.emplace(eq_class.get(), class_ids.size());
+    }
+  }
+  if (!res.first) {
+    return;
+  }
+
+  Idx num_appended = 0;
+  auto append = [&](const Node &n, Idx parent) {
+    parent_[num_appended] = parent;
+    num_children_[num_appended] = n.GetChildren().size();
+    eq_class_[num_appended] = class_ids.at(&n.GetEqClass());
+    type_[num_appended] = n.GetType();
+    unique_fraction_[num_appended] = n.unique_fraction_;
+    std::copy(n.GetName().begin(), n.GetName().end(),
+              names_ + name_begin_[num_appended]);
+    name_begin_[num_appended + 1] =
+        name_begin_[num_appended] + n.GetName().size();
+    ++num_appended;
+  };
+
+  // Children blocks are appended in DFS order of their parents.
+  append(*res.first, kNone);
+  std::vector<std::pair<Idx, const Node *>> to_visit{{0, res.first.get()}};
+  while (!to_visit.empty()) {
+    const auto [idx, node] = to_visit.back();
+    to_visit.pop_back();
+    first_child_[idx] = num_appended;
+    const Nodes &children = node->GetChildren();
+    for (const Node *child : children) {
+      append(*child, idx);
+    }
+    for (size_t i = children.size(); i > 0; --i) {
+      to_visit.emplace_back(first_child_[idx] + i - 1, children[i - 1]);
+    }
+  }
+
+  ComputePathRanks();
+  FillClassNodes();
+}
+
+void FlatTree::FillClassNodes() {
+  for (Idx n = 0; n < NumNodes(); ++n) {
+    ++class_nodes_begin_[eq_class_[n] + 1];
+  }
+  for (size_t c = 0; c < NumClasses(); ++c) {
+    class_nodes_begin_[c + 1] += class_nodes_begin_[c];
+  }
+  std::vector<Idx> class_fill(class_nodes_begin_,
+                              class_nodes_begin_ + NumClasses());
+  for (Idx n = 0; n < NumNodes(); ++n) {
+    class_nodes_[class_fill[eq_class_[n]]++] = n;
+  }
+}
+
+namespace {
+
+// Lays out arrays one after another in a buffer starting at data, unless it's
+// nullptr, aligning each of them to 8 bytes.
+class ArrayPlacer {
+ public:
+  explicit ArrayPlacer(char *data) : data_(data) {}
+
+  template <typename T>
+  void Place(T *&array, size_t size) {
+    offset_ = Align(offset_);
+    if (data_) {
+      array = reinterpret_cast<T *>(data_ + offset_);
+    }
+    offset_ += size * sizeof(T);
+  }
+  // Size of the buffer, rounded up so that another one can follow it.
+  size_t Size() const { return Align(offset_); }
+
+ private:
+  static size_t Align(size_t offset) {
+    return (offset + alignof(uint64_t) - 1) / alignof(uint64_t) *
+           alignof(uint64_t);
+  }
+
+  char *const data_;
+  size_t offset_{};
+};
+
+}  // namespace
+
+size_t FlatTree::LayoutNodes(char *data) {
+  const size_t num_nodes = sizes_.num_nodes_;
+  ArrayPlacer placer(data);
+  placer.Place(unique_fraction_, num_nodes);
+  placer.Place(name_begin_, num_nodes + 1);
+  placer.Place(parent_, num_nodes);
+  placer.Place(first_child_, num_nodes);
+  placer.Place(num_children_, num_nodes);
+  placer.Place(eq_class_, num_nodes);
+  placer.Place(path_rank_, num_nodes);
+  placer.Place(type_, num_nodes);
+  placer.Place(names_, sizes_.names_size_);
+  return placer.Size();
+}
+
+size_t FlatTree::LayoutClasses(char *data) {
+  const size_t num_classes = sizes_.num_classes_;
+  ArrayPlacer placer(data);
+  placer.Place(class_weight_, num_classes);
+  placer.Place(class_nodes_begin_, num_classes + 1);
+  placer.Place(class_nodes_, sizes_.num_nodes_);
+  return placer.Size();
+}
+
+void FlatTree::AllocateNodes() {
+  nodes_size_ = LayoutNodes(nullptr);
+  nodes_storage_.reset(new char[nodes_size_](), std::default_delete<char[]>());
+  LayoutNodes(nodes_storage_.get());
+}
+
+void FlatTree::AllocateClasses() {
+  classes_size_ = LayoutClasses(nullptr);
+  classes_storage_.reset(new char[classes_size_](),
+                         std::default_delete<char[]>());
+  LayoutClasses(classes_storage_.get());
+}
+
+namespace {
+
+constexpr char kSnapshotMagic[8] = {'D', 'U', 'P', 'A', 'S', 'N', 'A', 'P'};
+constexpr uint64_t kSnapshotVersion = 3;
+
+struct SnapshotHeader {
+  char magic_[sizeof(kSnapshotMagic)];
+  uint64_t version_;
+  uint64_t num_nodes_;
+  uint64_t num_classes_;
+  uint64_t names_size_;
+  int64_t tolerable_diff_pct_;
+  uint64_t use_size_;
+  uint64_t approximate_;
+};
+
+}  // namespace
+
+void FlatTree::Save(const std::string &path) const {
+  SnapshotHeader header{};
+  std::copy(std::begin(kSnapshotMagic), std::end(kSnapshotMagic),
+            header.magic_);
+  header.version_ = kSnapshotVersion;
+  header.num_nodes_ = sizes_.num_nodes_;
+  header.num_classes_ = sizes_.num_classes_;
+  header.names_size_ = sizes_.names_size_;
+  header.tolerable_diff_pct_ = settings_.tolerable_diff_pct_;
+  header.use_size_ = settings_.use_size_;
+  header.approximate_ = settings_.approximate_;
+  std::ofstream out;
+  out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+  out.open(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(nodes_storage_.get(), nodes_size_);
+  out.write(classes_storage_.get(), classes_size_);
+  out.close();
+}
+
+FlatTree FlatTree::Load(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw FsException(errno, "open '" + path + "'");
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    const int err = errno;
+    close(fd);
+    throw FsException(err, "stat on '" + path + "'");
+  }
+  const size_t file_size = st.st_size;
+  if (file_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    throw FsException(EINVAL, "reading snapshot '" + path + "'");
+  }
+  void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  const int err = errno;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw FsException(err, "mmap on '" + path + "'");
+  }
+
+  FlatTree res;
+  std::shared_ptr<char> mapping(static_cast<char *>(mapped),
+                                [file_size](char *p) { munmap(p, file_size); });
+  const auto &header = *reinterpret_cast<const SnapshotHeader *>(mapped);
+  res.sizes_.num_nodes_ = header.num_nodes_;
+  res.sizes_.num_classes_ = header.num_classes_;
+  res.sizes_.names_size_ = header.names_size_;
+  res.settings_.tolerable_diff_pct_ = header.tolerable_diff_pct_;
+  res.settings_.use_size_ = header.use_size_;
+  res.settings_.approximate_ = header.approximate_;
+  if (!std::equal(std::begin(kSnapshotMagic), std::end(kSnapshotMagic),
+                  header.magic_) ||
+      header.version_ != kSnapshotVersion ||
+      header.num_nodes_ >= kNone || header.num_classes_ >= kNone ||
+      res.LayoutNodes(nullptr) + res.LayoutClasses(nullptr) !=
+          file_size - sizeof(SnapshotHeader)) {
+    throw FsException(EINVAL, "reading snapshot '" + path + "'");
+  }
+  // The arrays are only read, so mapping the file read-only is fine. Both
+  // parts of the storage share the mapping.
+  res.nodes_size_ = res.LayoutNodes(nullptr);
+  res.classes_size_ = res.LayoutClasses(nullptr);
+  res.nodes_storage_ =
+      std::shared_ptr<char>(mapping, mapping.get() + sizeof(SnapshotHeader));
+  res.classes_storage_ = std::shared_ptr<char>(
+      mapping, res.nodes_storage_.get() + res.nodes_size_);
+  res.LayoutNodes(res.nodes_storage_.get());
+  res.LayoutClasses(res.classes_storage_.get());
+  const Settings &s = res.settings_;
+  if (s.tolerable_diff_pct_ != Conf().tolerable_diff_pct_ ||
+      s.use_size_ != Conf().use_size_ ||
+      s.approximate_ != Conf().approximate_) {
+    LOG(WARNING, "Snapshot '"
+                     << path << "' was analyzed with -t "
+                     << s.tolerable_diff_pct_ << (s.use_size_ ? ", -s" : "")
+                     << (s.approximate_ ? ", --approximate" : "")
+                     << "; its duplicates are reported as analyzed back then");
+  }
+  return res;
+}
+
+void FlatTree::ComputePathRanks() {
+  // All paths in a subtree share a prefix, so they are contiguous when sorted.
+  // A directory's path precedes its descendants' ("name" < "name/..."), but
+  // its siblings' paths may go in between (e.g. "name-2" < "name/"). Hence,
+  // for every directory, its children's names and their descendants' blocks
+  // (named after the child with a slash appended) are sorted together.
+  struct Item {
+    Idx node_;
+    bool descendants_;
+  };
+  Idx next_rank = 0;
+  std::vector<Item> to_visit{{0, true}, {0, false}};
+  std::vector<Item> children;
+  while (!to_visit.empty()) {
+    const Item item = to_visit.back();
+    to_visit.pop_back();
+    if (!item.descendants_) {
+      path_rank_[item.node_] = next_rank++;
+      continue;
+    }
+    children.clear();
+    for (Idx c = GetFirstChild(item.node_); c < GetEndChild(item.node_); ++c) {
+      children.push_back({c, false});
+      if (GetNumChildren(c) > 0) {
+        children.push_back({c, true});
+      }
+    }
+    std::sort(children.begin(), children.end(),
+              [this](const Item &i1, const Item &i2) {
+                return KeyLess(GetName(i1.node_), i1.descendants_,
+                               GetName(i2.node_), i2.descendants_);
+              });
+    to_visit.insert(to_visit.end(), children.rbegin(), children.rend());
+  }
+}
+
+std::string FlatTree::BuildPath(Idx n) const {
+  std::vector<Idx> ancestors;
+  for (Idx i = n; i != kNone; i = parent_[i]) {
+    ancestors.push_back(i);
+  }
+  std::string res;
+  for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+    if (!res.empty() && res.back() != '/') {
+      res += '/';
+    }
+    res += GetName(*it);
+  }
+  return res;
+}
+
+const std::string &PathWriter::Get(FlatTree::Idx n) {
+  ancestors_.clear();
+  for (FlatTree::Idx i = n; i != FlatTree::kNone; i = tree_.GetParent(i)) {
+    ancestors_.push_back(i);
+  }
+  size_t depth = 0;
+  while (depth < prefixes_.size() && depth < ancestors_.size() &&
+         prefixes_[depth].first == ancestors_[ancestors_.size() - depth - 1]) {
+    ++depth;
+  }
+  prefixes_.resize(depth);
+  path_.resize(depth == 0 ? 0 : prefixes_.back().second);
+  for (auto it = ancestors_.rbegin() + depth; it != ancestors_.rend(); ++it) {
+    if (!path_.empty() && path_.back() != '/') {
+      path_ += '/';
+    }
+    path_ += tree_.GetName(*it);
+    prefixes_.emplace_back(*it, path_.size());
+  }
+  return path_;
+}
+
+std::vector<FlatTree::Idx> GetInteresingEqClasses(const FlatTree &tree) {
+  std::vector<FlatTree::Idx> res;
+  for (FlatTree::Idx c = 0; c < tree.NumClasses(); ++c) {
+    const FlatTree::IdxRange nodes = tree.GetClassNodes(c);
+    assert(nodes.size() != 0);
+    if (nodes.size() == 1) {
+      continue;
+    }
+    bool all_parents_are_dups = true;
+    for (const FlatTree::Idx n : nodes) {
+      const FlatTree::Idx parent = tree.GetParent(n);
+      if (parent == FlatTree::kNone ||
+          tree.GetClassSize(tree.GetEqClass(parent)) == 1) {
+        all_parents_are_dups = false;
+      }
+    }
+    if (all_parents_are_dups) {
+      continue;
+    }
+    res.push_back(c);
+  }
+  return res;
+}
+
+void PrintEqClassses(const FlatTree &tree,
+                     const std::vector<FlatTree::Idx> &eq_classes) {
+  std::cout << "*** Classes of similar directories or files:" << std::endl;
+  PathWriter paths(tree);
+  for (const FlatTree::Idx c : eq_classes) {
+    const FlatTree::IdxRange nodes = tree.GetClassNodes(c);
+    std::vector<FlatTree::Idx> to_print(nodes.begin(), nodes.end());
+    std::sort(to_print.begin(), to_print.end(),
+              [&tree](FlatTree::Idx n1, FlatTree::Idx n2) {
+                return tree.GetPathRank(n1) < tree.GetPathRank(n2);
+              });
+    for (auto node_it = to_print.begin(); node_it != to_print.end();
+         ++node_it) {
+      std::cout << paths.Get(*node_it);
+      if (--to_print.end() != node_it) {
+        std::cout << " ";
+      }
+    }
+    std::cout << std::endl;
+  }
+}
+
+void PrintScatteredDirectories(const FlatTree &tree) {
+  std::cout << "*** Directories consisting of mostly duplicates of files "
+               "scattered elsewhere:"
+            << std::endl;
+  std::vector<FlatTree::Idx> scattered_dirs;
+  for (FlatTree::Idx n = 0; n < tree.NumNodes(); ++n) {
+    if (tree.GetType(n) == Node::DIR &&
+        tree.GetUniqueFraction(n) * 100 < Conf().tolerable_diff_pct_ &&
+        tree.GetClassSize(tree.GetEqClass(n)) == 1) {
+      scattered_dirs.push_back(n);
+    }
+  }
+  std::sort(scattered_dirs.begin(), scattered_dirs.end(),
+            [&tree](FlatTree::Idx n1, FlatTree::Idx n2) {
+              return tree.GetUniqueFraction(n1) > tree.GetUniqueFraction(n2);
+            });
+  PathWriter paths(tree);
+  for (const FlatTree::Idx dir : scattered_dirs) {
+    std::cout << paths.Get(dir) << std::endl;
+  }
+}
@@ -0,0 +1,196 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_FLAT_TREE_H_
+#define SRC_FLAT_TREE_H_
+
+#include <cstdint>
+
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_tree.h"
+#include "fuzzy_dedup.h"
+
+// An immutable, compact copy of an analyzed hierarchy and its equivalence
+// classes, used for reporting.
+//
+// Nodes are stored in arrays indexed by 32-bit numbers. The root is node 0 and
+// every directory's children occupy a contiguous range of indices; these
+// ranges are laid out in DFS order, so traversals are linear scans. Names are
+// kept in a single string pool. Unlike Node, this cannot be modified. It is
+// either copied from a Node hierarchy or built by FlatTreeBuilder without
+// one. The arrays describing nodes live in one buffer and those describing
+// equivalence classes in another; together they can be saved to a snapshot
+// file and later mapped back into memory.
+class FlatTree {
+ public:
+  using Idx = uint32_t;
+  static constexpr Idx kNone = std::numeric_limits<Idx>::max();
+
+  // A contiguous range of indices.
+  class IdxRange {
+   public:
+    IdxRange(const Idx *begin, const Idx *end) : begin_(begin), end_(end) {}
+    const Idx *begin() const { return begin_; }
+    const Idx *end() const { return end_; }
+    size_t size() const { return end_ - begin_; }
+
+   private:
+    const Idx *begin_;
+    const Idx *end_;
+  };
+
+  // Settings which shape the equivalence classes.
+  struct Settings {
+    int tolerable_diff_pct_;
+    bool use_size_;
+    bool approximate_;
+  };
+
+  // Equivalence classes are numbered in the order in which they appear in
+  // res.second. res is assumed to be analyzed with the current settings.
+  explicit FlatTree(const FuzzyDedupRes &res);
+  FlatTree(const FlatTree &) = delete;
+  FlatTree &operator=(const FlatTree &) = delete;
+  FlatTree(FlatTree &&) = default;
+  FlatTree &operator=(FlatTree &&) = default;
+
+  // Snapshots are only meant to be read on the machine which wrote them.
+  void Save(const std::string &path) const;
+  // The file is mapped rather than read, so this takes constant time. Warns if
+  // the snapshot was analyzed with settings different from the current ones.
+  static FlatTree Load(const std::string &path);
+
+  bool Empty() const { return sizes_.num_nodes_ == 0; }
+  size_t NumNodes() const { return sizes_.num_nodes_; }
+  size_t NumClasses() const { return sizes_.num_classes_; }
+  const Settings &GetSettings() const { return settings_; }
+
+  // kNone for the root.
+  Idx GetParent(Idx n) const { return parent_[n]; }
+  // Children of n are the nodes [GetFirstChild(n), GetEndChild(n)).
+  Idx GetFirstChild(Idx n) const { return first_child_[n]; }
+  Idx GetEndChild(Idx n) const { return first_child_[n] + num_children_[n]; }
+  Idx GetNumChildren(Idx n) const { return num_children_[n]; }
+  std::string_view GetName(Idx n) const {
+    return std::string_view(names_ + name_begin_[n],
+                            name_begin_[n + 1] - name_begin_[n]);
+  }
+  Node::Type GetType(Idx n) const { return static_cast<Node::Type>(type_[n]); }
+  double GetUniqueFraction(Idx n) const { return unique_fraction_[n]; }
+  Idx GetEqClass(Idx n) const { return eq_class_[n]; }
+  // Same as Node::BuildPath().native(). Use PathWriter to build many paths.
+  std::string BuildPath(Idx n) const;
+  // Position of BuildPath(n) among all paths in the tree sorted
+  // lexicographically; sorting nodes by it doesn't require building paths.
+  Idx GetPathRank(Idx n) const { return path_rank_[n]; }
+
+  double GetClassWeight(Idx c) const { return class_weight_[c]; }
+  // Nodes in class c in increasing order.
+  IdxRange GetClassNodes(Idx c) const {
+    return IdxRange(class_nodes_ + class_nodes_begin_[c],
+                    class_nodes_ + class_nodes_begin_[c + 1]);
+  }
+  size_t GetClassSize(Idx c) const { return GetClassNodes(c).size(); }
+
+ private:
+  struct Sizes {
+    uint64_t num_nodes_;
+    uint64_t num_classes_;
+    uint64_t names_size_;
+  };
+
+  friend class FlatTreeBuilder;
+
+  FlatTree() = default;
+  static Settings CurrentSettings();
+  // Return the size of a buffer holding all arrays describing nodes (classes)
+  // for sizes_. Unless data is nullptr, it is such a buffer, and the arrays
+  // are pointed into it.
+  size_t LayoutNodes(char *data);
+  size_t LayoutClasses(char *data);
+  // Allocate zeroed buffers for the arrays describing nodes (classes).
+  void AllocateNodes();
+  void AllocateClasses();
+  void ComputePathRanks();
+  // Fill the nodes of every class from eq_class_.
+  void FillClassNodes();
+
+  Sizes sizes_{};
+  Settings settings_{};
+  // Either allocated buffers or parts of a mapped snapshot.
+  std::shared_ptr<char> nodes_storage_;
+  size_t nodes_size_{};
+  std::shared_ptr<char> classes_storage_;
+  size_t classes_size_{};
+
+  Idx *parent_{};
+  Idx *first_child_{};
+  Idx *num_children_{};
+  Idx *eq_class_{};
+  uint8_t *type_{};
+  double *unique_fraction_{};
+  Idx *path_rank_{};
+  // Name of node n is names_[name_begin_[n], name_begin_[n + 1]).
+  uint64_t *name_begin_{};
+  char *names_{};
+
+  double *class_weight_{};
+  // Nodes of class c are class_nodes_[class_nodes_begin_[c],
+  // class_nodes_begin_[c + 1]).
+  Idx *class_nodes_begin_{};
+  Idx *class_nodes_{};
+};
+
+// Builds paths of FlatTree's nodes reusing the common prefix with the
+// previously built path, so that walking over siblings or nodes sorted by
+// GetPathRank() only appends their names.
+class PathWriter {
+ public:
+  explicit PathWriter(const FlatTree &tree) : tree_(tree) {}
+  // Same as tree.BuildPath(n); valid until the next call.
+  const std::string &Get(FlatTree::Idx n);
+
+ private:
+  const FlatTree &tree_;
+  std::string path_;
+  // Nodes whose paths are prefixes of path_, starting from the root, together
+  // with the lengths of these prefixes.
+  std::vector<std::pair<FlatTree::Idx, size_t>> prefixes_;
+  // Scratch space for n's ancestors.
+  std::vector<FlatTree::Idx> ancestors_;
+};
+
+// Filter out only equivalence classes which have duplicates and are not already
+// described by their parents being duplicates of something else.
+std::vector<FlatTree::Idx> GetInteresingEqClasses(const FlatTree &tree);
+
+void PrintEqClassses(const FlatTree &tree,
+                     const std::vector<FlatTree::Idx> &eq_classes);
+
+// Print directories which have no duplicates but whose contents are mostly
+// duplicated to file outside of it.
+void PrintScatteredDirectories(const FlatTree &tree);
+
+#endif  // SRC_FLAT_TREE_H_
@@ -0,0 +1,196 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "flat_tree.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "conf.h"
+#include "exceptions.h"
+#include "gtest/gtest.h"
+#include "test_common.h"
+
+class FlatTreeTest : public ::testing::Test {
+ protected:
+  // r/
+  //   a/
+  //     f2 (same as f1)
+  //     f3
+  //   f1
+  void SetUp() override {
+    auto root = std::make_shared<Node>(Node::DIR, "r");
+    Node *a = new Node(Node::DIR, "a");
+    Node *f1 = new Node(Node::FILE, "f1");
+    Node *f2 = new Node(Node::FILE, "f2");
+    Node *f3 = new Node(Node::FILE, "f3");
+    root->AddChild(a);
+    root->AddChild(f1);
+    a->AddChild(f2);
+    a->AddChild(f3);
+    auto eq_classes = std::make_shared<EqClasses>();
+    const std::vector<Nodes> classes{{f1, f2}, {f3}, {a}, {root.get()}};
+    for (const Nodes &nodes : classes) {
+      eq_classes->push_back(std::make_unique<EqClass>());
+      for (Node *n : nodes) {
+        eq_classes->back()->AddNode(*n);
+      }
+    }
+    root->Traverse([](Node *n) { n->unique_fraction_ = 0.5; });
+    res_ = FuzzyDedupRes(root, eq_classes);
+  }
+
+  FuzzyDedupRes res_;
+};
+
+TEST_F(FlatTreeTest, Empty) {
+  FlatTree tree((FuzzyDedupRes()));
+  ASSERT_TRUE(tree.Empty());
+  ASSERT_EQ(0U, tree.NumNodes());
+  ASSERT_EQ(0U, tree.NumClasses());
+  ASSERT_TRUE(GetInteresingEqClasses(tree).empty());
+}
+
+TEST_F(FlatTreeTest, Layout) {
+  FlatTree tree(res_);
+  ASSERT_EQ(5U, tree.NumNodes());
+  ASSERT_EQ(FlatTree::kNone, tree.GetParent(0));
+  ASSERT_EQ("r", tree.GetName(0));
+  ASSERT_EQ(1U, tree.GetFirstChild(0));
+  ASSERT_EQ(3U, tree.GetEndChild(0));
+  ASSERT_EQ("a", tree.GetName(1));
+  ASSERT_EQ(Node::DIR, tree.GetType(1));
+  ASSERT_EQ("f1", tree.GetName(2));
+  ASSERT_EQ(Node::FILE, tree.GetType(2));
+  ASSERT_EQ(0U, tree.GetNumChildren(2));
+  ASSERT_EQ(3U, tree.GetFirstChild(1));
+  ASSERT_EQ(2U, tree.GetNumChildren(1));
+  ASSERT_EQ("f2", tree.GetName(3));
+  ASSERT_EQ("f3", tree.GetName(4));
+  for (FlatTree::Idx n = 1; n < tree.NumNodes(); ++n) {
+    const FlatTree::Idx parent = tree.GetParent(n);
+    ASSERT_LE(tree.GetFirstChild(parent), n);
+    ASSERT_LT(n, tree.GetEndChild(parent));
+    ASSERT_EQ(0.5, tree.GetUniqueFraction(n));
+  }
+  ASSERT_EQ("r/a/f2", tree.BuildPath(3));
+  ASSERT_EQ("r/f1", tree.BuildPath(2));
+}
+
+TEST_F(FlatTreeTest, Classes) {
+  FlatTree tree(res_);
+  ASSERT_EQ(4U, tree.NumClasses());
+  const FlatTree::IdxRange dups = tree.GetClassNodes(0);
+  ASSERT_EQ((std::vector<FlatTree::Idx>{2, 3}),
+            std::vector<FlatTree::Idx>(dups.begin(), dups.end()));
+  ASSERT_EQ(1U, tree.GetClassSize(1));
+  ASSERT_EQ(0U, tree.GetEqClass(2));
+  ASSERT_EQ(0U, tree.GetEqClass(3));
+  ASSERT_EQ(1U, tree.GetEqClass(4));
+  ASSERT_EQ(2U, tree.GetEqClass(1));
+  ASSERT_EQ(3U, tree.GetEqClass(0));
+  ASSERT_EQ(res_.second->at(2)->GetWeight(), tree.GetClassWeight(2));
+  ASSERT_EQ(std::vector<FlatTree::Idx>{0}, GetInteresingEqClasses(tree));
+}
+
+TEST_F(FlatTreeTest, SnapshotRoundTrip) {
+  TmpDir dir;
+  const std::string snapshot = dir.dir_ + "/snapshot";
+  const FlatTree tree(res_);
+  tree.Save(snapshot);
+  res_ = FuzzyDedupRes();
+
+  const FlatTree loaded = FlatTree::Load(snapshot);
+  ASSERT_EQ(tree.NumNodes(), loaded.NumNodes());
+  ASSERT_EQ(tree.NumClasses(), loaded.NumClasses());
+  ASSERT_EQ(Conf().tolerable_diff_pct_,
+            loaded.GetSettings().tolerable_diff_pct_);
+  ASSERT_EQ(Conf().use_size_, loaded.GetSettings().use_size_);
+  ASSERT_EQ(Conf().approximate_, loaded.GetSettings().approximate_);
+  for (FlatTree::Idx n = 0; n < tree.NumNodes(); ++n) {
+    ASSERT_EQ(tree.GetParent(n), loaded.GetParent(n));
+    ASSERT_EQ(tree.GetFirstChild(n), loaded.GetFirstChild(n));
+    ASSERT_EQ(tree.GetNumChildren(n), loaded.GetNumChildren(n));
+    ASSERT_EQ(tree.GetName(n), loaded.GetName(n));
+    ASSERT_EQ(tree.GetType(n), loaded.GetType(n));
+    ASSERT_EQ(tree.GetUniqueFraction(n), loaded.GetUniqueFraction(n));
+    ASSERT_EQ(tree.GetEqClass(n), loaded.GetEqClass(n));
+    ASSERT_EQ(tree.GetPathRank(n), loaded.GetPathRank(n));
+  }
+  for (FlatTree::Idx c = 0; c < tree.NumClasses(); ++c) {
+    ASSERT_EQ(tree.GetClassWeight(c), loaded.GetClassWeight(c));
+    const FlatTree::IdxRange nodes = tree.GetClassNodes(c);
+    const FlatTree::IdxRange loaded_nodes = loaded.GetClassNodes(c);
+    ASSERT_TRUE(std::equal(nodes.begin(), nodes.end(), loaded_nodes.begin(),
+                           loaded_nodes.end()));
+  }
+  ASSERT_EQ(std::vector<FlatTree::Idx>{0}, GetInteresingEqClasses(loaded));
+}
+
+TEST(FlatTreeSnapshotTest, Invalid) {
+  TmpDir dir;
+  dir.CreateFile("not_a_snapshot", std::string(100, 'x'));
+  ASSERT_THROW(FlatTree::Load(dir.dir_ + "/not_a_snapshot"), FsException);
+  ASSERT_THROW(FlatTree::Load(dir.dir_ + "/missing"), FsException);
+}
+
+TEST(FlatTreePathTest, RanksAndWriter) {
+  // Siblings whose names extend "a" with characters smaller than '/' sort
+  // between "a" and "a/...".
+  auto root = std::make_shared<Node>(Node::DIR, "/");
+  Node *a = new Node(Node::DIR, "a");
+  root->AddChild(a);
+  for (const char *name : {"a.c", "a-b", "b", "a0"}) {
+    root->AddChild(new Node(Node::FILE, name));
+  }
+  Node *a_x = new Node(Node::DIR, "x");
+  a->AddChild(a_x);
+  a->AddChild(new Node(Node::FILE, "y"));
+  a_x->AddChild(new Node(Node::FILE, "z"));
+  auto eq_classes = std::make_shared<EqClasses>();
+  root->Traverse([&eq_classes](Node *n) {
+    eq_classes->push_back(std::make_unique<EqClass>());
+    eq_classes->back()->AddNode(*n);
+    n->unique_fraction_ = 1;
+  });
+  FlatTree tree(FuzzyDedupRes(root, eq_classes));
+
+  std::vector<FlatTree::Idx> nodes;
+  for (FlatTree::Idx n = 0; n < tree.NumNodes(); ++n) {
+    nodes.push_back(n);
+  }
+  std::sort(nodes.begin(), nodes.end(),
+            [&tree](FlatTree::Idx n1, FlatTree::Idx n2) {
+              return tree.GetPathRank(n1) < tree.GetPathRank(n2);
+            });
+  std::vector<std::string> paths;
+  PathWriter writer(tree);
+  for (const FlatTree::Idx n : nodes) {
+    paths.push_back(writer.Get(n));
+    ASSERT_EQ(tree.BuildPath(n), paths.back());
+  }
+  ASSERT_EQ((std::vector<std::string>{"/", "/a", "/a-b", "/a.c", "/a/x",
+                                      "/a/x/z", "/a/y", "/a0", "/b"}),
+            paths);
+  for (FlatTree::Idx n = tree.NumNodes(); n > 0; --n) {
+    ASSERT_EQ(tree.BuildPath(n - 1), writer.Get(n - 1));
+  }
+}
@@ -19,97 +19,82 @@
 
 #include "fuzzy_dedup.h"
 
+#include <algorithm>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <optional>
 #include <stack>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <boost/filesystem/convenience.hpp>
 #include <boost/filesystem/path.hpp>
 
 #include "hash_cache.h"
 #include "log.h"
+#include "min_hash.h"
 #include "scanner_int.h"
 #include "synch_thread_pool.h"
 
-FuzzyDedupRes FuzzyDedup(const std::string &dir) {
-  // Scan the directory and compute checksums for regular files
-  const std::pair<Node *, detail::Sum2Node> root_and_sum_2_node =
-      detail::ScanDirectory(dir);
-  std::shared_ptr<Node> root_node(root_and_sum_2_node.first);
-  if (!root_node) {
-    // No files at all.
-    return FuzzyDedupRes();
-  }
-  const detail::Sum2Node &sum_2_node = root_and_sum_2_node.second;
-
-  // Create equivalence classes for all regular files
-  EqClassesPtr eq_classes =
-      detail::ClassifyDuplicateFiles(*root_node, sum_2_node);
-
-  // Create equivalence classes for all empty directories
-  {
-    std::unique_ptr<EqClass> empty_dirs_class =
-        detail::ClassifyEmptyDirs(*root_node);
-    if (!empty_dirs_class->IsEmpty()) {
-      eq_classes->push_back(std::move(empty_dirs_class));
-    }
-  }
-
-  // Now we have all leaves covered, let's propagate that all the way up to
-  // the root.
-  detail::PropagateEquivalence(*root_node, eq_classes);
-
-  // Let's sort the equivalence classes such that the most important ones are
-  // in the front.
-  detail::SortEqClasses(eq_classes);
-
-  // Calculate how unique directories are.
-  detail::CalculateUniqueness(*root_node);
-
-  return std::make_pair(root_node, eq_classes);
+FuzzyDedupRes FuzzyDedup(const std::string &dir, const PriorResults *prior) {
+  return FuzzyDedup(std::vector<std::string>{dir}, {}, prior);
 }
 
-std::vector<EqClass *> GetInteresingEqClasses(FuzzyDedupRes &all) {
-  std::vector<EqClass *> res;
-  for (auto &eq_class : *all.second) {
-    assert(!eq_class->nodes_.empty());
-    if (eq_class->nodes_.size() == 1) {
-      continue;
-    }
-    bool all_parents_are_dups = true;
-    for (Node *node : eq_class->nodes_) {
-      if (node->GetParent() == nullptr ||
-          node->GetParent()->GetEqClass().IsSingle()) {
-        all_parents_are_dups = false;
-      }
-    }
-    if (all_parents_are_dups) {
-      continue;
-    }
-    res.push_back(eq_class.get());
+FuzzyDedupRes FuzzyDedup(const std::vector<std::string> &dirs,
+                         const std::vector<std::string> &labels,
+                         const PriorResults *prior) {
+  // Scanning the directory computes checksums for regular files and creates
+  // equivalence classes for them and for all empty directories. Update()
+  // propagates that all the way up to the root, sorts the equivalence classes
+  // such that the most important ones are in the front and calculates how
+  // unique directories are.
+  IncrementalFuzzyDedup dedup(dirs, labels);
+  if (prior) {
+    dedup.Reuse(*prior);
   }
-  return res;
+  return dedup.Update();
 }
 
 namespace detail {
 
 //======== ScanDirectory =======================================================
 
+template <typename WeightPolicy>
 class TreeCtorProcessor : public ScanProcessor<Node *> {
  public:
-  void File(const boost::filesystem::path &path, Node *const &parent,
-            const FileInfo &f_info) override {
-    Node *node = new Node(Node::FILE, path.filename().native(), f_info.size_);
-    parent->AddChild(node);
-    sum2node_.insert(std::make_pair(f_info.sum_, node));
+  // If parent is set, the scanned directory is added to it rather than
+  // becoming a new root. Otherwise, if root_name is set, the root is named so
+  // rather than after the scanned directory.
+  explicit TreeCtorProcessor(Node *parent = nullptr,
+                             std::optional<std::string> root_name = {})
+      : parent_(parent), root_name_(std::move(root_name)) {}
+
+  void Files(Node *const &parent, const FileRecords &files) override {
+    parent->ReserveChildren(files.size());
+    sum2node_.reserve(sum2node_.size() + files.size());
+    for (const FileRecord &file : files) {
+      Node *node = new Node(Node::FILE, file.name_,
+                            WeightPolicy::Of(file.f_info_.size_));
+      parent->AddChild(node);
+      sum2node_.emplace_back(file.f_info_.sum_, node);
+    }
   }
 
   Node *RootDir(const boost::filesystem::path &path) override {
-    root_ = std::make_unique<Node>(Node::DIR, path.native());
-    return root_.get();
+    if (parent_) {
+      top_ = Dir(path, parent_);
+    } else {
+      root_ = std::make_unique<Node>(Node::DIR,
+                                     root_name_.value_or(path.native()));
+      top_ = root_.get();
+    }
+    return top_;
   }
 
   Node *Dir(const boost::filesystem::path &path, Node *const &parent) override {
@@ -120,18 +105,64 @@ class TreeCtorProcessor : public ScanProcessor<Node *> {
 
   Sum2Node sum2node_;
   std::unique_ptr<Node> root_;
+  Node *top_{};  // the scanned directory
+
+ private:
+  Node *const parent_;
+  const std::optional<std::string> root_name_;
 };
 
 std::pair<Node *, Sum2Node> ScanDirectory(const std::string &dir) {
-  std::pair<Node *, Sum2Node> res;
+  return ScanDirectories({dir}, {});
+}
 
-  TreeCtorProcessor processor;
+std::pair<Node *, Sum2Node> ScanDirectories(
+    const std::vector<std::string> &dirs,
+    const std::vector<std::string> &labels) {
+  assert(labels.empty() || labels.size() == dirs.size());
+  return WithFileWeight([&dirs, &labels](auto policy) {
+    using Processor = TreeCtorProcessor<decltype(policy)>;
+    std::vector<std::unique_ptr<Processor>> processors;
+    std::vector<ScanProcessor<Node *> *> processor_ptrs;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      std::optional<std::string> name;
+      if (!labels.empty()) {
+        name = labels[i];
+      } else if (dirs.size() > 1) {
+        name = dirs[i];
+      }
+      processors.push_back(std::make_unique<Processor>(nullptr, name));
+      processor_ptrs.push_back(processors.back().get());
+    }
 
-  ScanDirectoryOrDb(dir, processor);
+    ScanDirectoriesOrDbs(dirs, processor_ptrs);
 
-  res.second.swap(processor.sum2node_);
-  res.first = processor.root_.release();
-  return res;
+    std::pair<Node *, Sum2Node> res;
+    if (dirs.size() == 1) {
+      res.second.swap(processors[0]->sum2node_);
+      res.first = processors[0]->root_.release();
+      return res;
+    }
+    size_t num_files = 0;
+    for (const auto &processor : processors) {
+      num_files += processor->sum2node_.size();
+    }
+    res.second.reserve(num_files);
+    auto root = Node::NewSuperRoot();
+    for (const auto &processor : processors) {
+      if (!processor->root_) {
+        continue;  // could not be scanned
+      }
+      root->AddChild(processor->root_.release());
+      res.second.insert(res.second.end(), processor->sum2node_.begin(),
+                        processor->sum2node_.end());
+      Sum2Node().swap(processor->sum2node_);
+    }
+    if (!root->GetChildren().empty()) {
+      res.first = root.release();
+    }
+    return res;
+  });
 }
 
 //======== ClassifyEmptyDirs ===================================================
@@ -148,157 +179,605 @@ std::unique_ptr<EqClass> ClassifyEmptyDirs(Node &node) {
 
 //======== ClassifyDuplicateFiles ==============================================
 
-EqClassesPtr ClassifyDuplicateFiles(Node & /*node*/,
-                                    const Sum2Node &sum_2_node) {
+EqClassesPtr ClassifyDuplicateFiles(Node & /*node*/, Sum2Node &sum_2_node,
+                                    int concurrency) {
+  std::unique_ptr<SyncThreadPool> pool;
+  if (concurrency > 1) {
+    pool = std::make_unique<SyncThreadPool>(concurrency);
+  }
+  SortByCksum(sum_2_node, pool.get());
+  if (pool) {
+    pool->Stop();
+  }
+  // Files with the same checksum are adjacent now.
   EqClassesPtr res(new EqClasses);
-  for (auto range_start = sum_2_node.begin();
-       range_start != sum_2_node.end();) {
-    const Sum2Node::const_iterator range_end =
-        sum_2_node.equal_range(range_start->first).second;
-    // I am traversing the map twice, but it's so much more readable...
-
-    if (range_start != range_end) {
+  for (size_t i = 0; i < sum_2_node.size(); ++i) {
+    if (i == 0 || sum_2_node[i].first != sum_2_node[i - 1].first) {
       res->push_back(std::make_unique<EqClass>());
-      for (; range_start != range_end; ++range_start) {
-        res->back()->AddNode(*range_start->second);
-      }
     }
+    res->back()->AddNode(*sum_2_node[i].second);
   }
   return res;
 }
 
 //======== GetNodesReadyToEval =================================================
 
-std::queue<Node *> GetNodesReadyToEval(Node &node) {
-  std::queue<Node *> res;
-  node.Traverse([&res](Node *node) {
-    if (node->IsReadyToEvaluate() && !node->IsEvaluated()) {
-      res.push(node);
-    }
-  });
+Nodes GetNodesReadyToEval(Node &node) {
+  Nodes res;
+  // Descendants of evaluated nodes are evaluated, so there is no need to visit
+  // them. Thanks to that only the invalidated part of the hierarchy is visited
+  // by IncrementalFuzzyDedup::Update().
+  node.Traverse(
+      [&res](Node *n) {
+        if (n->IsReadyToEvaluate()) {
+          res.push_back(n);
+        }
+      },
+      [](const Node *n) { return !n->IsEvaluated(); });
   return res;
 }
 
-//======== GetClosestNode ======================================================
+//======== PropagateEquivalence ================================================
 
-std::pair<Node *, double> GetClosestNode(const Node &ref,
-                                         const Nodes &candidates) {
-  auto it = candidates.begin();
-  auto min_it = it++;
-  double min_dist = NodeDistance(ref, **min_it);
+namespace {
 
-  for (; it != candidates.end(); ++it) {
-    assert(*it != &ref);
-    assert((*it)->IsEvaluated());
-    const double distance = NodeDistance(ref, **it);
-    assert(distance < 1.1);  // actually <= 1, but it's double
+// The closest equivalent found for a node.
+struct Equivalent {
+  Node *node_{};
+  double distance_{};
+  // 0 for nodes evaluated before the current wave, 1 + index in the wave
+  // otherwise.
+  size_t order_{};
+};
 
-    if (distance < min_dist) {
-      min_it = it;
-      min_dist = distance;
-    }
+// Whether c1 should be preferred over c2. Ties are broken deterministically,
+// so that the result doesn't depend on how candidates were found.
+bool IsBetter(const Equivalent &c1, const Equivalent &c2) {
+  if (c1.distance_ != c2.distance_) {
+    return c1.distance_ < c2.distance_;
+  }
+  if (c1.order_ != c2.order_) {
+    return c1.order_ < c2.order_;
+  }
+  if (c1.order_ != 0 || &c1.node_->GetEqClass() == &c2.node_->GetEqClass()) {
+    return false;  // same node or same outcome
   }
-  return std::make_pair(*min_it, min_dist);
+  return c1.node_->BuildPath() < c2.node_->BuildPath();
 }
 
-//======== PropagateEquivalence ================================================
+// Evaluate everything ready to evaluate under root_node, bottom up.
+//
+// Nodes are evaluated in waves: the first one consists of the nodes ready to
+// evaluate at the start and each next one of the nodes made ready by the
+// previous one. The closest equivalents of a wave's nodes are searched for in
+// parallel; every node is compared with the nodes evaluated before the wave
+// and the nodes preceding it in the wave. Only then are the nodes assigned to
+// classes, in order. Because of that class weights don't change while a wave
+// is searched and the result doesn't depend on concurrency.
+//
+// prepare(wave, pool) is called before a wave is searched and
+// get_candidates(i, node) has to return the candidate equivalents of the i-th
+// node of the wave.
+template <typename P, typename C>
+void PropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes,
+                          int concurrency, P &&prepare, C &&get_candidates) {
+  const double max_distance = Conf().tolerable_diff_pct_ / 100.;
+  std::unique_ptr<SyncThreadPool> pool;
+  if (concurrency > 1) {
+    pool = std::make_unique<SyncThreadPool>(concurrency);
+  }
 
-void PropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes) {
-  std::queue<Node *> ready_to_eval = detail::GetNodesReadyToEval(root_node);
-
-  while (!ready_to_eval.empty()) {
-    Node *node = ready_to_eval.front();
-    ready_to_eval.pop();
-
-    assert(node->IsReadyToEvaluate());
-    assert(!node->IsEvaluated());
-    assert(node->GetParent() == nullptr ||
-           !node->GetParent()->IsReadyToEvaluate());
-
-    Nodes possible_equivalents = node->GetPossibleEquivalents();
-    if (!possible_equivalents.empty()) {
-      std::pair<Node *, double> min_elem_and_dist =
-          detail::GetClosestNode(*node, possible_equivalents);
-      assert(min_elem_and_dist.first);
-      if (min_elem_and_dist.second < Conf().tolerable_diff_pct_ / 100.) {
-        min_elem_and_dist.first->GetEqClass().AddNode(*node);
+  Nodes wave = detail::GetNodesReadyToEval(root_node);
+  while (!wave.empty()) {
+    std::unordered_map<const Node *, size_t> wave_idx;
+    wave_idx.reserve(wave.size());
+    for (size_t i = 0; i < wave.size(); ++i) {
+      wave_idx.emplace(wave[i], i);
+    }
+    prepare(wave, pool.get());
+
+    std::vector<Equivalent> closest(wave.size());
+    ParallelFor(
+        pool.get(), wave.size(),
+        [&](size_t i) {
+          Node *node = wave[i];
+          assert(node->IsReadyToEvaluate());
+          assert(!node->IsEvaluated());
+          assert(node->GetParent() == nullptr ||
+                 !node->GetParent()->IsReadyToEvaluate());
+
+          for (Node *candidate : get_candidates(i, node)) {
+            Equivalent equivalent{candidate, 0, 0};
+            if (!candidate->IsEvaluated()) {
+              // Nodes following this one will be compared with it instead.
+              const size_t idx = wave_idx.at(candidate);
+              if (idx >= i) {
+                continue;
+              }
+              equivalent.order_ = idx + 1;
+            }
+            equivalent.distance_ = NodeDistance(*node, *candidate);
+            // actually <= 1, but it's double
+            assert(equivalent.distance_ < 1.1);
+            if (equivalent.distance_ < max_distance &&
+                (!closest[i].node_ || IsBetter(equivalent, closest[i]))) {
+              closest[i] = equivalent;
+            }
+          }
+        },
+        kNodesPerTask);
+
+    Nodes next_wave;
+    for (size_t i = 0; i < wave.size(); ++i) {
+      Node *node = wave[i];
+      if (closest[i].node_) {
+        closest[i].node_->GetEqClass().AddNode(*node);
       } else {
         eq_classes->push_back(std::make_unique<EqClass>());
         eq_classes->back()->AddNode(*node);
       }
-    } else {
-      eq_classes->push_back(std::make_unique<EqClass>());
-      eq_classes->back()->AddNode(*node);
-    }
-
-    // By modifying this node we could have made the parent ready to
-    // evaluate. It is clear it couldn't have been ready at the beginning of
-    // this function because this element was not evaluated, so there is no
-    // risk we're adding it to the queue twice.
-    if (node->GetParent() != nullptr &&
-        node->GetParent()->IsReadyToEvaluate()) {
-      ready_to_eval.push(node->GetParent());
+      // By modifying this node we could have made the parent ready to
+      // evaluate. It is clear it couldn't have been ready before because this
+      // node was not evaluated, so it's not added twice.
+      if (node->GetParent() != nullptr &&
+          node->GetParent()->IsReadyToEvaluate()) {
+        next_wave.push_back(node->GetParent());
+      }
     }
+    wave.swap(next_wave);
+  }
+  if (pool) {
+    pool->Stop();
   }
   assert(root_node.IsEvaluated());
 }
 
-//======== SortEqClasses =======================================================
+}  // anonymous namespace
 
-void SortEqClasses(const EqClassesPtr &eq_classes) {
-  std::sort(
-      eq_classes->begin(), eq_classes->end(),
-      [](const std::unique_ptr<EqClass> &a, const std::unique_ptr<EqClass> &b) {
-        return a->weight_ > b->weight_;
+void PropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes,
+                          int concurrency) {
+  const double max_distance = Conf().tolerable_diff_pct_ / 100.;
+  PropagateEquivalence(
+      root_node, eq_classes, concurrency,
+      [](const Nodes & /* wave */, SyncThreadPool * /* pool */) {},
+      [max_distance](size_t /* i */, const Node *node) {
+        return node->GetPossibleEquivalents(max_distance);
       });
 }
 
+void ApproxPropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes,
+                                int concurrency, bool deterministic) {
+  const double max_distance = Conf().tolerable_diff_pct_ / 100.;
+  MinHashIndex index(max_distance, deterministic);
+  // Directories evaluated before, e.g. by previous
+  // IncrementalFuzzyDedup::Update() calls, are candidates too.
+  root_node.Traverse([&index](Node *node) {
+    if (node->IsEvaluated() && !node->IsEmptyDir() &&
+        node->GetType() == Node::DIR) {
+      index.Identify(*node);
+      index.Add(*node, index.Sign(*node));
+    }
+  });
+  std::vector<MinHashIndex::Signature> signatures;
+  PropagateEquivalence(
+      root_node, eq_classes, concurrency,
+      [&index, &signatures](const Nodes &wave, SyncThreadPool *pool) {
+        signatures.assign(wave.size(), MinHashIndex::Signature());
+        for (const Node *node : wave) {
+          index.Identify(*node);
+        }
+        ParallelFor(
+            pool, wave.size(),
+            [&](size_t i) { signatures[i] = index.Sign(*wave[i]); },
+            kNodesPerTask);
+        for (size_t i = 0; i < wave.size(); ++i) {
+          index.Add(*wave[i], signatures[i]);
+        }
+      },
+      [&index, &signatures, max_distance](size_t i, const Node *node) {
+        if (signatures[i].empty()) {
+          // Only weightless children, which MinHash can't tell apart.
+          return node->GetPossibleEquivalents(max_distance);
+        }
+        Nodes res = index.GetCandidates(signatures[i]);
+        res.erase(std::remove(res.begin(), res.end(), node), res.end());
+        return res;
+      });
+}
+
+//======== SortEqClasses =======================================================
+
+void SortChildren(Node &node) {
+  node.Traverse([](Node *n) { n->SortChildren(); },
+                [](const Node *n) { return !n->IsEvaluated(); });
+}
+
+void SortEqClasses(const EqClassesPtr &eq_classes, Node *root) {
+  if (!root) {
+    std::sort(eq_classes->begin(), eq_classes->end(),
+              [](const std::unique_ptr<EqClass> &a,
+                 const std::unique_ptr<EqClass> &b) {
+                return a->weight_ > b->weight_;
+              });
+    return;
+  }
+  std::unordered_map<const EqClass *, size_t> first_node;
+  first_node.reserve(eq_classes->size());
+  size_t num_visited = 0;
+  root->TraversePreOrder([&first_node, &num_visited](Node *n) {
+    first_node.emplace(&n->GetEqClass(), num_visited++);
+  });
+  std::sort(eq_classes->begin(), eq_classes->end(),
+            [&first_node](const std::unique_ptr<EqClass> &a,
+                          const std::unique_ptr<EqClass> &b) {
+              if (a->weight_ != b->weight_) {
+                return a->weight_ > b->weight_;
+              }
+              return first_node.at(a.get()) < first_node.at(b.get());
+            });
+}
+
 //======== CalculateUniqueness =================================================
 
 namespace {
 
-bool HasDuplicateElsewhere(const Node &n,
-                           const std::unordered_set<const Node *> &not_here) {
-  // FIXME: perhaps it's worth sorting nodes in EqClasses and doing a binary
-  // search here. I'll not do premature optimizations, though.
-  for (Node *sibling : n.GetEqClass().nodes_) {
-    if (not_here.find(sibling) == not_here.end()) {
-      return true;
+// Files in a subtree.
+struct SubtreeFiles {
+  // Number of files in the subtree for each class which also has files
+  // outside of it.
+  std::unordered_map<const EqClass *, size_t> shared_;
+  double total_weight_{};
+  // Weight of files whose all duplicates are in the subtree.
+  double unique_weight_{};
+
+  void AddFiles(const EqClass &eq_class, size_t count) {
+    const size_t in_subtree = (shared_[&eq_class] += count);
+    if (in_subtree == eq_class.GetNumNodes()) {
+      // Since subtrees are disjoint, no other subtree has any of them.
+      unique_weight_ += in_subtree * eq_class.GetWeight();
+      shared_.erase(&eq_class);
     }
   }
-  return false;
-}
+};
 
 }  // anonymous namespace
 
-CNodes CalculateUniqueness(Node &node) {
+void CalculateUniqueness(Node &node) {
   assert(node.IsEvaluated());
-  switch (node.GetType()) {
-    case Node::FILE:
-      node.unique_fraction_ = node.GetEqClass().IsSingle() ? 1 : 0;
-      return CNodes(1, &node);
-    case Node::DIR:
-      std::unordered_set<const Node *> descendant_nodes;
-      for (Node *child : node.GetChildren()) {
-        const CNodes &child_nodes = CalculateUniqueness(*child);
-        std::copy(child_nodes.begin(), child_nodes.end(),
-                  std::inserter(descendant_nodes, descendant_nodes.end()));
+  // Files of the subtrees of visited nodes whose parents haven't been visited
+  // yet. The traversal is post-order, so those of a directory's children are
+  // on top when it's visited.
+  std::vector<SubtreeFiles> stack;
+  node.Traverse([&stack](Node *n) {
+    switch (n->GetType()) {
+      case Node::FILE: {
+        n->unique_fraction_ = n->GetEqClass().IsSingle() ? 1 : 0;
+        stack.emplace_back();
+        stack.back().total_weight_ = n->GetWeight();
+        stack.back().AddFiles(n->GetEqClass(), 1);
+        break;
       }
-      double total_weight = 0;
-      double unique_weight = 0;
-      for (const Node *desc : descendant_nodes) {
-        total_weight += desc->GetWeight();
-        if (!HasDuplicateElsewhere(*desc, descendant_nodes)) {
-          unique_weight += desc->GetWeight();
+      case Node::DIR: {
+        const size_t num_children = n->GetChildren().size();
+        auto first = stack.end() - num_children;
+        // Merge smaller sets into the largest one, so that every file is moved
+        // O(log(n)) times at most.
+        auto largest = std::max_element(
+            first, stack.end(), [](const SubtreeFiles &f1,
+                                   const SubtreeFiles &f2) {
+              return f1.shared_.size() < f2.shared_.size();
+            });
+        SubtreeFiles res;
+        if (largest != stack.end()) {
+          res = std::move(*largest);
         }
-      }
-      node.unique_fraction_ = (total_weight == 0)
+        for (auto it = first; it != stack.end(); ++it) {
+          if (it == largest) {
+            continue;
+          }
+          res.total_weight_ += it->total_weight_;
+          res.unique_weight_ += it->unique_weight_;
+          for (const auto &class_and_count : it->shared_) {
+            res.AddFiles(*class_and_count.first, class_and_count.second);
+          }
+        }
+        stack.erase(first, stack.end());
+        n->unique_fraction_ = (res.total_weight_ == 0)
                                   ? 0  // empty directory is not unique
-                                  : (unique_weight / total_weight);
-      return CNodes(descendant_nodes.begin(), descendant_nodes.end());
-  }
-  assert(false);  // We really shouldn't be here.
-  return CNodes();
+                                  : (res.unique_weight_ / res.total_weight_);
+        stack.push_back(std::move(res));
+        break;
+      }
+    }
+  });
+  assert(stack.size() == 1);
+}
+
+int EvalConcurrency() {
+  return Conf().auto_concurrency_
+             ? std::max(1U, std::thread::hardware_concurrency())
+             : Conf().concurrency_;
 }
 
 } /* namespace detail */
+
+//======== IncrementalFuzzyDedup ===============================================
+
+IncrementalFuzzyDedup::IncrementalFuzzyDedup(const std::string &dir,
+                                             bool updatable)
+    : IncrementalFuzzyDedup(std::vector<std::string>{dir}, {}, updatable) {}
+
+IncrementalFuzzyDedup::IncrementalFuzzyDedup(
+    const std::vector<std::string> &dirs,
+    const std::vector<std::string> &labels, bool updatable)
+    : updatable_(updatable) {
+  std::pair<Node *, detail::Sum2Node> root_and_sum_2_node =
+      detail::ScanDirectories(dirs, labels);
+  if (root_and_sum_2_node.first) {
+    *this = IncrementalFuzzyDedup(
+        std::shared_ptr<Node>(root_and_sum_2_node.first),
+        std::move(root_and_sum_2_node.second), updatable);
+  }
+}
+
+IncrementalFuzzyDedup::IncrementalFuzzyDedup(std::shared_ptr<Node> root,
+                                             detail::Sum2Node sum_2_node,
+                                             bool updatable)
+    : root_(std::move(root)),
+      eq_classes_(detail::ClassifyDuplicateFiles(*root_, sum_2_node,
+                                                 detail::EvalConcurrency())),
+      updatable_(updatable) {
+  if (updatable_) {
+    // sum_2_node is sorted now, so every class is described by its first
+    // file.
+    file_classes_.reserve(eq_classes_->size());
+    class_cksums_.reserve(eq_classes_->size());
+    for (size_t i = 0; i < sum_2_node.size(); ++i) {
+      if (i == 0 || sum_2_node[i].first != sum_2_node[i - 1].first) {
+        EqClass *eq_class = &sum_2_node[i].second->GetEqClass();
+        file_classes_[sum_2_node[i].first] = eq_class;
+        class_cksums_[eq_class] = sum_2_node[i].first;
+      }
+    }
+  }
+  std::unique_ptr<EqClass> empty_dirs_class =
+      detail::ClassifyEmptyDirs(*root_);
+  if (!empty_dirs_class->IsEmpty()) {
+    empty_dirs_ = empty_dirs_class.get();
+    eq_classes_->push_back(std::move(empty_dirs_class));
+  }
+}
+
+Node *IncrementalFuzzyDedup::UpdateFile(Node &parent, const std::string &name,
+                                        const FileInfo &f_info) {
+  assert(updatable_);
+  Node *existing = parent.FindChild(name);
+  if (existing && existing->GetType() == Node::FILE &&
+      existing->IsEvaluated()) {
+    auto it = file_classes_.find(f_info.sum_);
+    if (it != file_classes_.end() && it->second == &existing->GetEqClass()) {
+      return existing;  // nothing has changed
+    }
+  }
+  Invalidate(parent);
+  if (existing) {
+    parent.DeleteChild(existing);
+  }
+  auto *node =
+      new Node(Node::FILE, name, detail::WithFileWeight([&f_info](auto policy) {
+                 return decltype(policy)::Of(f_info.size_);
+               }));
+  parent.AddChild(node);
+  ClassifyFile(*node, f_info.sum_);
+  return node;
+}
+
+Node *IncrementalFuzzyDedup::AddDir(Node &parent,
+                                    const boost::filesystem::path &dir) {
+  assert(updatable_);
+  Invalidate(parent);
+  auto [top, sum_2_node] = detail::WithFileWeight([&](auto policy) {
+    detail::TreeCtorProcessor<decltype(policy)> processor(&parent);
+    ScanDirectory(dir, processor, ScanFilter::FromConf(), nullptr);
+    return std::make_pair(processor.top_, std::move(processor.sum2node_));
+  });
+  if (!top) {
+    if (parent.IsEmptyDir()) {
+      ClassifyEmptyDir(parent);
+    }
+    return nullptr;
+  }
+  for (const auto &sum_and_node : sum_2_node) {
+    ClassifyFile(*sum_and_node.second, sum_and_node.first);
+  }
+  top->Traverse([this](Node *node) {
+    if (node->IsEmptyDir()) {
+      ClassifyEmptyDir(*node);
+    }
+  });
+  return top;
+}
+
+void IncrementalFuzzyDedup::Remove(Node &node) {
+  Node *parent = node.GetParent();
+  assert(parent);
+  Invalidate(*parent);
+  parent->DeleteChild(&node);
+  if (parent->IsEmptyDir()) {
+    ClassifyEmptyDir(*parent);
+  }
+}
+
+void IncrementalFuzzyDedup::Reuse(const PriorResults &prior) {
+  if (!root_) {
+    return;
+  }
+  if (Conf().deterministic_) {
+    // Reused directories won't be sorted by Update().
+    detail::SortChildren(*root_);
+  }
+  auto find_prior =
+      [&prior](const Node &node) -> const PriorResults::NodeInfo * {
+    auto it = prior.nodes_.find(node.BuildPath().native());
+    if (it == prior.nodes_.end() || it->second.type_ != node.GetType()) {
+      return nullptr;
+    }
+    return &it->second;
+  };
+
+  // Numbers of files from every prior class in each current class. Files are
+  // already classified by their checksums.
+  std::vector<std::pair<Node *, size_t>> files;
+  std::unordered_map<size_t, std::unordered_map<const EqClass *, size_t>>
+      votes;
+  root_->Traverse([&](Node *n) {
+    if (n->GetType() != Node::FILE) {
+      return;
+    }
+    if (const PriorResults::NodeInfo *info = find_prior(*n)) {
+      files.emplace_back(n, info->eq_class_);
+      ++votes[info->eq_class_][&n->GetEqClass()];
+    }
+  });
+  // The current class which most files from a prior class are in is
+  // considered to be the same class; its files which ended up elsewhere have
+  // changed. Different prior classes can't become the same one, so the one
+  // with more files wins. Nobody wins ties, so that the result doesn't depend
+  // on the order of looking at classes.
+  struct Claim {
+    size_t prior_class_;
+    size_t num_files_;
+    bool contested_;
+  };
+  std::unordered_map<const EqClass *, Claim> claims;
+  for (const auto &[prior_class, counts] : votes) {
+    const EqClass *best = nullptr;
+    size_t best_count = 0;
+    bool tie = false;
+    for (const auto &[eq_class, count] : counts) {
+      if (count > best_count) {
+        best = eq_class;
+        best_count = count;
+        tie = false;
+      } else if (count == best_count) {
+        tie = true;
+      }
+    }
+    if (tie) {
+      continue;
+    }
+    auto [it, inserted] =
+        claims.emplace(best, Claim{prior_class, best_count, false});
+    if (inserted || it->second.num_files_ > best_count) {
+      continue;
+    }
+    if (it->second.num_files_ == best_count) {
+      it->second.contested_ = true;
+    } else {
+      it->second = Claim{prior_class, best_count, false};
+    }
+  }
+  std::unordered_set<const Node *> unchanged;
+  for (const auto &[file, prior_class] : files) {
+    auto it = claims.find(&file->GetEqClass());
+    if (it != claims.end() && !it->second.contested_ &&
+        it->second.prior_class_ == prior_class) {
+      unchanged.insert(file);
+    }
+  }
+
+  // Directories, bottom up.
+  std::unordered_map<size_t, EqClass *> dir_classes;
+  size_t num_dirs = 0;
+  size_t num_reused = 0;
+  root_->Traverse([&](Node *n) {
+    if (n->GetType() != Node::DIR) {
+      return;
+    }
+    ++num_dirs;
+    const PriorResults::NodeInfo *info = find_prior(*n);
+    if (!info || info->num_children_ != n->GetChildren().size() ||
+        !std::all_of(n->GetChildren().begin(), n->GetChildren().end(),
+                     [&unchanged](const Node *child) {
+                       return unchanged.count(child) != 0;
+                     })) {
+      return;
+    }
+    unchanged.insert(n);
+    ++num_reused;
+    if (n->IsEmptyDir()) {
+      return;  // already classified
+    }
+    EqClass *&eq_class = dir_classes[info->eq_class_];
+    if (!eq_class) {
+      eq_classes_->push_back(std::make_unique<EqClass>());
+      eq_class = eq_classes_->back().get();
+    }
+    eq_class->AddNode(*n);
+  });
+  LOG(INFO, "Reusing results for " << num_reused << " out of " << num_dirs
+                                   << " directories");
+}
+
+FuzzyDedupRes IncrementalFuzzyDedup::Update() {
+  if (!root_) {
+    return FuzzyDedupRes();
+  }
+  // Get rid of classes which lost all their nodes.
+  eq_classes_->erase(
+      std::remove_if(eq_classes_->begin(), eq_classes_->end(),
+                     [this](const std::unique_ptr<EqClass> &eq_class) {
+                       if (!eq_class->IsEmpty()) {
+                         return false;
+                       }
+                       auto it = class_cksums_.find(eq_class.get());
+                       if (it != class_cksums_.end()) {
+                         file_classes_.erase(it->second);
+                         class_cksums_.erase(it);
+                       }
+                       if (eq_class.get() == empty_dirs_) {
+                         empty_dirs_ = nullptr;
+                       }
+                       return true;
+                     }),
+      eq_classes_->end());
+  const int concurrency = detail::EvalConcurrency();
+  if (Conf().deterministic_) {
+    detail::SortChildren(*root_);
+  }
+  if (Conf().approximate_) {
+    detail::ApproxPropagateEquivalence(*root_, eq_classes_, concurrency,
+                                       Conf().deterministic_);
+  } else {
+    detail::PropagateEquivalence(*root_, eq_classes_, concurrency);
+  }
+  detail::SortEqClasses(eq_classes_,
+                        Conf().deterministic_ ? root_.get() : nullptr);
+  detail::CalculateUniqueness(*root_);
+  return std::make_pair(root_, eq_classes_);
+}
+
+void IncrementalFuzzyDedup::Invalidate(Node &node) {
+  // Ancestors of nodes which are not evaluated are not evaluated either.
+  for (Node *n = &node; n && n->IsEvaluated(); n = n->GetParent()) {
+    n->GetEqClass().RemoveNode(*n);
+  }
+}
+
+void IncrementalFuzzyDedup::ClassifyFile(Node &file, Cksum sum) {
+  EqClass *&eq_class = file_classes_[sum];
+  if (!eq_class) {
+    eq_classes_->push_back(std::make_unique<EqClass>());
+    eq_class = eq_classes_->back().get();
+    class_cksums_[eq_class] = sum;
+  }
+  eq_class->AddNode(file);
+}
+
+void IncrementalFuzzyDedup::ClassifyEmptyDir(Node &dir) {
+  if (!empty_dirs_) {
+    eq_classes_->push_back(std::make_unique<EqClass>());
+    empty_dirs_ = eq_classes_->back().get();
+  }
+  empty_dirs_->AddNode(dir);
+}
@@ -20,59 +20,235 @@
 #ifndef SRC_FUZZY_DEDUP_H_
 #define SRC_FUZZY_DEDUP_H_
 
+#include <algorithm>
+#include <limits>
 #include <memory>
-#include <queue>
+#include <numeric>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <unordered_map>
 
+#include <boost/filesystem/path.hpp>
+
+#include "conf.h"
 #include "file_tree.h"
 #include "hash_cache.h"  // for Cksum
+#include "synch_thread_pool.h"
 
 using EqClasses = std::vector<std::unique_ptr<EqClass>>;
 using EqClassesPtr = std::shared_ptr<EqClasses>;
 using FuzzyDedupRes = std::pair<std::shared_ptr<Node>, EqClassesPtr>;
 
-FuzzyDedupRes FuzzyDedup(const std::string &dir);
-std::vector<EqClass *> GetInteresingEqClasses(FuzzyDedupRes &all);
+// How a previous run classified a hierarchy, e.g. read back from its --sql_out
+// database.
+struct PriorResults {
+  struct NodeInfo {
+    Node::Type type_;
+    size_t num_children_;
+    // Only has to be the same for nodes in the same equivalence class.
+    size_t eq_class_;
+  };
+  // Keyed by Node::BuildPath().
+  std::unordered_map<std::string, NodeInfo> nodes_;
+};
+
+// If prior is set, directories whose contents haven't changed since are not
+// compared again; see IncrementalFuzzyDedup::Reuse().
+FuzzyDedupRes FuzzyDedup(const std::string &dir,
+                         const PriorResults *prior = nullptr);
+
+// Same as above, but finds duplicates within and across all of dirs, which
+// are scanned together. Unless there is only one, they are analyzed as
+// children of a nameless root, named after the respective labels, or after
+// dirs themselves if labels are empty; labels have to be distinct.
+FuzzyDedupRes FuzzyDedup(const std::vector<std::string> &dirs,
+                         const std::vector<std::string> &labels,
+                         const PriorResults *prior = nullptr);
 
 // This shouldn't be public but is for testing.
 namespace detail {
 
-using Sum2Node = std::unordered_multimap<Cksum, Node *>;
-
-// Recursively scan directory dir. Return the directory's hierarchy and a
-// multimap from checksums to Nodes in the hierarchy for all regular files.
+// Checksums of regular files along with their nodes.
+using Sum2Node = std::vector<std::pair<Cksum, Node *>>;
+
+// Directories are evaluated by as many threads as compute checksums.
+int EvalConcurrency();
+
+// Number of nodes handled by a single task submitted to the thread pool.
+constexpr size_t kNodesPerTask = 256;
+
+// Return f(policy), where policy is the file weight policy chosen by Conf().
+template <typename F>
+auto WithFileWeight(F &&f) {
+  if (Conf().use_size_) {
+    return f(FileSizeWeight());
+  }
+  return f(FileCountWeight());
+}
+
+// Buckets are split until they are about this small.
+constexpr size_t kCksumsPerBucket = 1024;
+constexpr int kMaxBucketBits = 16;
+// Number of buckets sorted by a single task submitted to the thread pool.
+constexpr size_t kBucketsPerTask = 16;
+
+// Sort entries, e.g. Sum2Node, by checksums. Checksums are uniformly
+// distributed, so entries are first distributed into buckets of similar sizes
+// by the top bits of their checksums and then the buckets are sorted
+// independently, in parallel if pool is set.
+template <typename T>
+void SortByCksum(std::vector<std::pair<Cksum, T>> &entries,
+                 SyncThreadPool *pool) {
+  using Entry = std::pair<Cksum, T>;
+  auto by_cksum = [](const Entry &e1, const Entry &e2) {
+    return e1.first < e2.first;
+  };
+  int bits = 0;
+  while (bits < kMaxBucketBits &&
+         (entries.size() >> (bits + 1)) >= kCksumsPerBucket) {
+    ++bits;
+  }
+  if (bits == 0) {
+    std::sort(entries.begin(), entries.end(), by_cksum);
+    return;
+  }
+  const int shift = std::numeric_limits<Cksum>::digits - bits;
+  const size_t num_buckets = size_t(1) << bits;
+  std::vector<size_t> bucket_begin(num_buckets + 1);
+  for (const Entry &entry : entries) {
+    ++bucket_begin[(entry.first >> shift) + 1];
+  }
+  std::partial_sum(bucket_begin.begin(), bucket_begin.end(),
+                   bucket_begin.begin());
+  std::vector<size_t> bucket_end(bucket_begin.begin(), bucket_begin.end() - 1);
+  std::vector<Entry> bucketed(entries.size());
+  for (const Entry &entry : entries) {
+    bucketed[bucket_end[entry.first >> shift]++] = entry;
+  }
+  // Free the input before sorting.
+  std::vector<Entry>().swap(entries);
+  ParallelFor(
+      pool, num_buckets,
+      [&bucketed, &bucket_begin, &by_cksum](size_t bucket) {
+        std::sort(bucketed.begin() + bucket_begin[bucket],
+                  bucketed.begin() + bucket_begin[bucket + 1], by_cksum);
+      },
+      kBucketsPerTask);
+  entries.swap(bucketed);
+}
+
+// Recursively scan directory dir. Return the directory's hierarchy and the
+// checksums of all regular files in it.
 std::pair<Node *, Sum2Node> ScanDirectory(const std::string &dir);
 
+// Same as above for many directories at once. The returned hierarchy is
+// described at FuzzyDedup().
+std::pair<Node *, Sum2Node> ScanDirectories(
+    const std::vector<std::string> &dirs,
+    const std::vector<std::string> &labels);
+
 // Create an equivalence class and assign all empty directories to it.
 std::unique_ptr<EqClass> ClassifyEmptyDirs(Node &node);
 
 // Create equivalence class for every hash and assign FILE nodes to them
-// accordingly.
-EqClassesPtr ClassifyDuplicateFiles(Node &node, const Sum2Node &sum_2_node);
+// accordingly. sum_2_node gets sorted by checksums by up to concurrency
+// threads.
+EqClassesPtr ClassifyDuplicateFiles(Node &node, Sum2Node &sum_2_node,
+                                    int concurrency = 1);
 
 // Get all child nodes (possibly includeing the argument) for which
 // IsReadyToEvaluate() && !IsEvaluated()
-std::queue<Node *> GetNodesReadyToEval(Node &node);
-
-// Out of the list of "candidates" return the closest node to "ref" and the
-// distance between it and "ref". Iff "candidates" is empty, (NULL, 2) is
-// returned.
-std::pair<Node *, double> GetClosestNode(const Node &ref,
-                                         const Nodes &candidates);
+Nodes GetNodesReadyToEval(Node &node);
 
 // Assuming that all regular files and empty directories in the hierarchy
 // described by root_node are evaluated and nothing else, evaluate everything
 // else. Newly created equivalence clesses will be appended to eq_classes.
-void PropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes);
-
-// Sort equivalence classes according to weight. Largest first.
-void SortEqClasses(const EqClassesPtr &eq_classes);
-
-// Determine how unique directories are.
-CNodes CalculateUniqueness(Node &node);
+// Directories are compared using up to concurrency threads; the result
+// doesn't depend on their number.
+void PropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes,
+                          int concurrency = 1);
+
+// Same as PropagateEquivalence(), but candidate equivalents are proposed by a
+// MinHashIndex rather than gathered from all directories sharing a child. It
+// scales to huge hierarchies with popular files, but may miss some
+// duplicates.
+// If deterministic is set, the candidates don't depend on where equivalence
+// classes reside in memory either.
+void ApproxPropagateEquivalence(Node &root_node, const EqClassesPtr &eq_classes,
+                                int concurrency = 1,
+                                bool deterministic = false);
+
+// Sort children of all directories under node which are not evaluated by name,
+// so that the order of evaluating them doesn't depend on the order of scanning.
+void SortChildren(Node &node);
+
+// Sort equivalence classes according to weight. Largest first. If root is set,
+// classes of equal weight are ordered by their first node in root's pre-order
+// traversal, so with sorted children the order depends only on the contents.
+void SortEqClasses(const EqClassesPtr &eq_classes, Node *root = nullptr);
+
+// Determine how unique directories are, i.e. what fraction of the weight of
+// their files have no duplicates outside of them.
+void CalculateUniqueness(Node &node);
 
 } /* namespace detail */
 
+// Results of FuzzyDedup() which can be kept up to date as the analyzed
+// directory changes. Changes only mark the affected directories and their
+// ancestors as not evaluated and only those are re-evaluated by Update().
+// Files are only indexed by their checksums, which UpdateFile() and AddDir()
+// need, if the object is constructed as updatable.
+class IncrementalFuzzyDedup {
+ public:
+  // Scan dir.
+  explicit IncrementalFuzzyDedup(const std::string &dir,
+                                 bool updatable = false);
+  // Scan dirs; see FuzzyDedup().
+  IncrementalFuzzyDedup(const std::vector<std::string> &dirs,
+                        const std::vector<std::string> &labels,
+                        bool updatable = false);
+  // Take over an already built hierarchy; sum_2_node has to describe all of
+  // its regular files.
+  IncrementalFuzzyDedup(std::shared_ptr<Node> root,
+                        detail::Sum2Node sum_2_node, bool updatable = false);
+
+  // nullptr if there are no nodes at all.
+  Node *GetRoot() const { return root_.get(); }
+  // Add a regular file named "name" to directory "parent" or update it if it
+  // already exists. Returns the file's node. Requires updatable.
+  Node *UpdateFile(Node &parent, const std::string &name,
+                   const FileInfo &f_info);
+  // Scan dir and add it to "parent". Returns its node or nullptr if it could
+  // not be scanned. Requires updatable.
+  Node *AddDir(Node &parent, const boost::filesystem::path &dir);
+  // Remove node, which is not the root, along with its subtree.
+  void Remove(Node &node);
+  // Put nodes which haven't changed since prior was computed in the same
+  // equivalence classes as prior says, so that Update() only evaluates the
+  // changed ones and their ancestors. A file hasn't changed if it is in the
+  // class which most files from its prior class are in; a directory if it has
+  // the same children as before and none of them has changed. Has to be called
+  // before the first Update().
+  void Reuse(const PriorResults &prior);
+  // Evaluate whatever has changed and return up to date results. They remain
+  // owned by this object, so they are only valid until the next change.
+  FuzzyDedupRes Update();
+
+ private:
+  // Mark node and all its ancestors as not evaluated.
+  void Invalidate(Node &node);
+  void ClassifyFile(Node &file, Cksum sum);
+  void ClassifyEmptyDir(Node &dir);
+
+  std::shared_ptr<Node> root_;
+  EqClassesPtr eq_classes_;
+  bool updatable_{};
+  // Only filled if updatable_.
+  std::unordered_map<Cksum, EqClass *> file_classes_;
+  std::unordered_map<const EqClass *, Cksum> class_cksums_;
+  EqClass *empty_dirs_{};
+};
+
 #endif  // SRC_FUZZY_DEDUP_H_
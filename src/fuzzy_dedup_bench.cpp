@@ -0,0 +1,178 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+// Compares PropagateEquivalence() with ApproxPropagateEquivalence() on a
+// synthetic hierarchy: time taken and how many of the pairs of directories
+// found equivalent by the former are found by the latter too.
+// Usage:
+// fuzzy_dedup_bench [num_dirs [tolerable_diff_pct [common_files_per_dir]]]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "conf.h"
+#include "fuzzy_dedup.h"
+
+namespace {
+
+constexpr size_t kFilesPerDir = 20;
+constexpr size_t kDirsPerGroup = 100;
+// Classes of files which many directories have, like LICENSE files or
+// bundled libraries.
+constexpr size_t kCommonClasses = 1000;
+constexpr double kCopyProbability = 0.5;
+constexpr double kMutateProbability = 0.05;
+
+using DirSpec = std::vector<Cksum>;
+
+std::vector<DirSpec> CreateSpec(size_t num_dirs, size_t common_per_dir) {
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> unit;
+  std::uniform_int_distribution<Cksum> common(0, kCommonClasses - 1);
+  Cksum next_class = kCommonClasses;
+  std::vector<DirSpec> res;
+  while (res.size() < num_dirs) {
+    DirSpec dir;
+    if (!res.empty() && unit(rng) < kCopyProbability) {
+      // A slightly modified copy of some other directory.
+      dir = res[std::uniform_int_distribution<size_t>(0, res.size() - 1)(rng)];
+      for (Cksum &sum : dir) {
+        if (unit(rng) < kMutateProbability) {
+          sum = next_class++;
+        }
+      }
+    } else {
+      for (size_t i = 0; i < common_per_dir; ++i) {
+        dir.push_back(common(rng));
+      }
+      while (dir.size() < kFilesPerDir) {
+        dir.push_back(next_class++);
+      }
+    }
+    res.push_back(std::move(dir));
+  }
+  return res;
+}
+
+std::pair<std::shared_ptr<Node>, EqClassesPtr> CreateTree(
+    const std::vector<DirSpec> &spec) {
+  auto root = std::make_shared<Node>(Node::DIR, "root");
+  detail::Sum2Node sum_2_node;
+  Node *group = nullptr;
+  for (size_t i = 0; i < spec.size(); ++i) {
+    if (i % kDirsPerGroup == 0) {
+      group = new Node(Node::DIR, "g" + std::to_string(i / kDirsPerGroup));
+      root->AddChild(group);
+    }
+    auto *dir = new Node(Node::DIR, "d" + std::to_string(i));
+    group->AddChild(dir);
+    for (size_t j = 0; j < spec[i].size(); ++j) {
+      auto *file = new Node(Node::FILE, "f" + std::to_string(j));
+      dir->AddChild(file);
+      sum_2_node.emplace_back(spec[i][j], file);
+    }
+  }
+  EqClassesPtr eq_classes = detail::ClassifyDuplicateFiles(*root, sum_2_node);
+  return std::make_pair(root, eq_classes);
+}
+
+template <typename F>
+double Measure(F &&f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+CNodes GetDirs(const Node &root) {
+  CNodes res;
+  root.Traverse([&res](const Node *n) {
+    if (n->GetType() == Node::DIR) {
+      res.push_back(n);
+    }
+  });
+  return res;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const std::string tolerable_diff_pct = argc > 2 ? argv[2] : "20";
+  const char *conf_argv[] = {"fuzzy_dedup_bench", "-t",
+                             tolerable_diff_pct.c_str(), "."};
+  ParseArgv(4, conf_argv);
+  const size_t num_dirs =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+  const size_t common_per_dir =
+      argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 3;
+  const std::vector<DirSpec> spec = CreateSpec(num_dirs, common_per_dir);
+
+  auto exact = CreateTree(spec);
+  const double exact_time = Measure([&exact] {
+    detail::PropagateEquivalence(*exact.first, exact.second);
+  });
+  auto approx = CreateTree(spec);
+  const double approx_time = Measure([&approx] {
+    detail::ApproxPropagateEquivalence(*approx.first, approx.second);
+  });
+
+  // Both trees are the same, so their directories are visited in the same
+  // order.
+  const CNodes exact_dirs = GetDirs(*exact.first);
+  const CNodes approx_dirs = GetDirs(*approx.first);
+  std::map<const EqClass *, size_t> exact_sizes;
+  std::map<const EqClass *, size_t> approx_sizes;
+  std::map<std::pair<const EqClass *, const EqClass *>, size_t> both_sizes;
+  for (size_t i = 0; i < exact_dirs.size(); ++i) {
+    const EqClass *e = &exact_dirs[i]->GetEqClass();
+    const EqClass *a = &approx_dirs[i]->GetEqClass();
+    ++exact_sizes[e];
+    ++approx_sizes[a];
+    ++both_sizes[std::make_pair(e, a)];
+  }
+  auto count_pairs = [](const auto &sizes) {
+    size_t res = 0;
+    for (const auto &class_and_size : sizes) {
+      res += class_and_size.second * (class_and_size.second - 1) / 2;
+    }
+    return res;
+  };
+  const size_t exact_pairs = count_pairs(exact_sizes);
+  const size_t approx_pairs = count_pairs(approx_sizes);
+  const size_t both_pairs = count_pairs(both_sizes);
+
+  std::cout << "directories: " << exact_dirs.size() << std::endl;
+  std::cout << "exact: " << exact_time << "s, " << exact_pairs
+            << " equivalent pairs" << std::endl;
+  std::cout << "approximate: " << approx_time << "s, " << approx_pairs
+            << " equivalent pairs" << std::endl;
+  std::cout << "speedup: " << exact_time / approx_time << std::endl;
+  std::cout << "recall: "
+            << (exact_pairs ? static_cast<double>(both_pairs) / exact_pairs : 1)
+            << std::endl;
+  return 0;
+}
@@ -19,11 +19,21 @@
 
 #include "fuzzy_dedup.h"
 
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <boost/filesystem/path.hpp>
 
 #include "gtest/gtest.h"
+#include "hash_cache.h"
+#include "test_common.h"
 
 using boost::filesystem::path;
 
@@ -65,9 +75,10 @@ class FuzzyDedupTest : public ::testing::Test {
                 off_t size) {
     path bpath(native);
     Node *parent = AddDir(bpath.parent_path().native());
-    Node *new_node = new Node(Node::FILE, bpath.filename().native(), size);
+    Node *new_node = new Node(Node::FILE, bpath.filename().native(),
+                              FileCountWeight::Of(size));
     parent->AddChild(new_node);
-    sum2node_.insert(std::make_pair(EqClass2Cksum(eq_class), new_node));
+    sum2node_.emplace_back(EqClass2Cksum(eq_class), new_node);
     bool res =
         nodes_.insert(std::make_pair(new_node->BuildPath().native(), new_node))
             .second;
@@ -76,7 +87,7 @@ class FuzzyDedupTest : public ::testing::Test {
     return new_node;
   }
 
-  void Execute() {
+  void Execute(bool approximate = false, int concurrency = 1) {
     EqClassesPtr eq_classes =
         detail::ClassifyDuplicateFiles(*root_node_, sum2node_);
     {
@@ -86,12 +97,38 @@ class FuzzyDedupTest : public ::testing::Test {
         eq_classes->push_back(std::move(empty_dirs_class));
       }
     }
-    detail::PropagateEquivalence(*root_node_, eq_classes);
+    if (approximate) {
+      detail::ApproxPropagateEquivalence(*root_node_, eq_classes, concurrency);
+    } else {
+      detail::PropagateEquivalence(*root_node_, eq_classes, concurrency);
+    }
     detail::SortEqClasses(eq_classes);
     detail::CalculateUniqueness(*root_node_);
     res_ = std::make_pair(root_node_, eq_classes);
   }
 
+  std::unique_ptr<IncrementalFuzzyDedup> ExecuteIncrementally() {
+    auto dedup =
+        std::make_unique<IncrementalFuzzyDedup>(root_node_, sum2node_, true);
+    res_ = dedup->Update();
+    return dedup;
+  }
+
+  void UpdateFile(IncrementalFuzzyDedup &dedup, const std::string &eq_class,
+                  const std::string &native, off_t size) {
+    path bpath(native);
+    Node *new_node =
+        dedup.UpdateFile(*FindNode(bpath.parent_path().native()),
+                         bpath.filename().native(),
+                         FileInfo(size, 0, EqClass2Cksum(eq_class)));
+    nodes_[native] = new_node;
+  }
+
+  void Remove(IncrementalFuzzyDedup &dedup, const std::string &native) {
+    dedup.Remove(*FindNode(native));
+    nodes_.erase(native);
+  }
+
   Node *FindNode(const std::string &p) {
     auto it = nodes_.find(p);
     assert(it != nodes_.end());
@@ -166,6 +203,60 @@ TEST_F(FuzzyDedupTest, SimpleDirs) {
   AssertNotDups({"/y", "/z"});
 }
 
+TEST_F(FuzzyDedupTest, ApproximateDirs) {
+  for (const char *dir : {"x", "y", "z/w"}) {
+    for (int i = 0; i < 9; ++i) {
+      AddFile(std::to_string(i), std::string(dir) + "/" + std::to_string(i),
+              1);
+    }
+  }
+  AddFile("a", "x/a", 1);
+  AddFile("a", "y/a", 1);
+  // Different by 4 out of 13.
+  AddFile("b", "z/w/b", 1);
+  AddFile("c", "z/w/c", 1);
+  AddFile("d", "z/w/d", 1);
+  AddFile("e", "u/e", 1);
+  Execute(true);
+  // Identical directories are always found.
+  AssertDups({"/x", "/y"});
+  AssertNotDups({"/x", "/z/w", "/u"});
+}
+
+TEST(ClassifyDuplicateFilesTest, ManyFiles) {
+  // Enough files to be sorted in buckets, some of which are sorted in
+  // parallel.
+  std::mt19937_64 rng(3);
+  std::vector<Cksum> sums;
+  for (int i = 0; i < 30000; ++i) {
+    sums.push_back(rng());
+  }
+  std::vector<std::unique_ptr<Node>> files;
+  detail::Sum2Node sum_2_node;
+  std::map<Cksum, size_t> expected;
+  for (int i = 0; i < 100000; ++i) {
+    const Cksum sum = sums[rng() % sums.size()];
+    files.push_back(std::make_unique<Node>(Node::FILE, "f"));
+    sum_2_node.emplace_back(sum, files.back().get());
+    ++expected[sum];
+  }
+  const detail::Sum2Node unsorted = sum_2_node;
+  EqClassesPtr eq_classes =
+      detail::ClassifyDuplicateFiles(*files.front(), sum_2_node, 3);
+  ASSERT_EQ(sum_2_node.size(), unsorted.size());
+  ASSERT_EQ(eq_classes->size(), expected.size());
+  std::map<const EqClass *, Cksum> class_sums;
+  for (const auto &[sum, node] : unsorted) {
+    const EqClass *eq_class = &node->GetEqClass();
+    auto it = class_sums.emplace(eq_class, sum).first;
+    ASSERT_EQ(it->second, sum);
+    ASSERT_EQ(eq_class->GetNumNodes(), expected[sum]);
+  }
+  for (size_t i = 1; i < sum_2_node.size(); ++i) {
+    ASSERT_LE(sum_2_node[i - 1].first, sum_2_node[i].first);
+  }
+}
+
 TEST_F(FuzzyDedupTest, ScatteredDir) {
   AddFile("1", "x/a", 1);
   AddFile("2", "y/a", 1);
@@ -210,3 +301,296 @@ TEST_F(FuzzyDedupTest, MostlyScatteredDir) {
   Execute();
   ASSERT_DOUBLE_EQ(FindNode("/v")->unique_fraction_, .25);
 }
+
+TEST_F(FuzzyDedupTest, NestedUniqueness) {
+  AddFile("1", "v/a", 1);
+  AddFile("1", "v/w/a", 1);
+  AddFile("2", "v/w/x/b", 1);
+  AddFile("2", "v/w/y/b", 1);
+  AddFile("3", "v/w/y/c", 1);
+  AddFile("3", "u/c", 1);
+
+  Execute();
+  // Both copies of "1" and "2" are inside, but "3" has one outside.
+  ASSERT_DOUBLE_EQ(FindNode("/v")->unique_fraction_, .8);
+  ASSERT_DOUBLE_EQ(FindNode("/v/w")->unique_fraction_, .5);
+  ASSERT_DOUBLE_EQ(FindNode("/v/w/y")->unique_fraction_, 0);
+  ASSERT_DOUBLE_EQ(FindNode("/")->unique_fraction_, 1);
+}
+
+TEST_F(FuzzyDedupTest, IncrementalUpdate) {
+  AddFile("eq1", "x/a", 1);
+  AddFile("eq1", "x/b", 1);
+  AddFile("eq2", "x/c", 1);
+  AddFile("eq1", "y/a", 1);
+  AddFile("eq1", "y/b", 1);
+  AddFile("eq2", "y/c", 1);
+  AddFile("eq3", "z/a", 1);
+  AddFile("eq3", "z/b", 1);
+  AddFile("eq3", "z/c", 1);
+  auto dedup = ExecuteIncrementally();
+  AssertDups({"/x", "/y"});
+  AssertNotDups({"/x", "/z"});
+
+  UpdateFile(*dedup, "eq4", "/y/c", 1);
+  res_ = dedup->Update();
+  AssertNotDups({"/x", "/y", "/z"});
+
+  UpdateFile(*dedup, "eq1", "/z/a", 1);
+  UpdateFile(*dedup, "eq1", "/z/b", 1);
+  UpdateFile(*dedup, "eq2", "/z/c", 1);
+  res_ = dedup->Update();
+  AssertDups({"/x", "/z"});
+  AssertNotDups({"/x", "/y"});
+  // eq1, eq2, eq4, {/x, /z}, {/y} and the root; eq3 and the old class of
+  // "/z" are gone.
+  ASSERT_EQ(res_.second->size(), 6U);
+}
+
+TEST_F(FuzzyDedupTest, IncrementalRemove) {
+  AddDir("e");
+  AddFile("eq1", "x/a", 1);
+  auto dedup = ExecuteIncrementally();
+  AssertNotDups({"/e", "/x"});
+
+  Remove(*dedup, "/x/a");
+  res_ = dedup->Update();
+  AssertDups({"/e", "/x"});
+  // The empty directories and the root.
+  ASSERT_EQ(res_.second->size(), 2U);
+}
+
+TEST_F(FuzzyDedupTest, ReusePriorResults) {
+  AddFile("eq1", "a/f1", 1);
+  AddFile("eq2", "a/f2", 1);
+  AddFile("eq1", "b/f1", 1);
+  AddFile("eq2", "b/f2", 1);
+  AddFile("eq1", "c/f1", 1);
+  AddFile("eq2", "c/f2", 1);
+  AddFile("eq3", "d/f1", 1);
+  AddFile("eq4", "d/f2", 1);
+  PriorResults prior;
+  prior.nodes_ = {
+      {"/", {Node::DIR, 4, 20}},
+      // Unlike now, "/a" and "/b" were not considered duplicates.
+      {"/a", {Node::DIR, 2, 10}},
+      {"/a/f1", {Node::FILE, 0, 1}},
+      {"/a/f2", {Node::FILE, 0, 2}},
+      {"/b", {Node::DIR, 2, 11}},
+      {"/b/f1", {Node::FILE, 0, 1}},
+      {"/b/f2", {Node::FILE, 0, 2}},
+      // "/c/f1" has changed.
+      {"/c", {Node::DIR, 2, 12}},
+      {"/c/f1", {Node::FILE, 0, 3}},
+      {"/c/f2", {Node::FILE, 0, 2}},
+      // A file was removed from "/d".
+      {"/d", {Node::DIR, 3, 10}},
+      {"/d/f1", {Node::FILE, 0, 4}},
+      {"/d/f2", {Node::FILE, 0, 5}},
+  };
+  auto dedup = std::make_unique<IncrementalFuzzyDedup>(root_node_, sum2node_);
+  dedup->Reuse(prior);
+  res_ = dedup->Update();
+  AssertNotDups({"/a", "/b", "/d"});
+  AssertDups({"/a", "/c"});
+}
+
+TEST_F(FuzzyDedupTest, ReuseMergedFileClasses) {
+  AddFile("eq1", "a/f1", 1);
+  AddFile("eq1", "a/f2", 1);
+  AddFile("eq2", "b/f1", 1);
+  PriorResults prior;
+  prior.nodes_ = {
+      {"/", {Node::DIR, 2, 20}},
+      {"/a", {Node::DIR, 2, 10}},
+      {"/a/f1", {Node::FILE, 0, 1}},
+      // "/a/f2" used to differ from "/a/f1", so one of them has changed, but
+      // it's not clear which one.
+      {"/a/f2", {Node::FILE, 0, 2}},
+      {"/b", {Node::DIR, 1, 10}},
+      {"/b/f1", {Node::FILE, 0, 3}},
+  };
+  auto dedup = std::make_unique<IncrementalFuzzyDedup>(root_node_, sum2node_);
+  dedup->Reuse(prior);
+  res_ = dedup->Update();
+  AssertDups({"/a/f1", "/a/f2"});
+  AssertNotDups({"/a", "/b"});
+}
+
+// Scan dirs with the given labels. Return the nodes of the resulting hierarchy
+// keyed by their paths.
+static std::unordered_map<std::string, const Node *> DedupManyRoots(
+    const std::vector<std::string> &dirs,
+    const std::vector<std::string> &labels, FuzzyDedupRes *res) {
+  HashCache::Initializer hash_cache_init("", "");
+  *res = FuzzyDedup(dirs, labels);
+  std::unordered_map<std::string, const Node *> nodes;
+  res->first->Traverse([&nodes](const Node *n) {
+    nodes.emplace(n->BuildPath().native(), n);
+  });
+  return nodes;
+}
+
+TEST(FuzzyDedupManyRootsTest, CrossRootDuplicates) {
+  TmpDir t1;
+  TmpDir t2;
+  t1.CreateFile("shared/f1", "a");
+  t1.CreateFile("shared/f2", "b");
+  t1.CreateFile("f3", "c");
+  t2.CreateFile("copy/f1", "a");
+  t2.CreateFile("copy/f2", "b");
+  t2.CreateFile("f4", "d");
+  FuzzyDedupRes res;
+  auto nodes = DedupManyRoots({t1.dir_, t2.dir_}, {"one", "two/x"}, &res);
+  const Node &root = *res.first;
+  ASSERT_EQ("", root.GetName());
+  ASSERT_EQ(2U, root.GetChildren().size());
+  ASSERT_EQ(1U, nodes.count("one"));
+  ASSERT_EQ(1U, nodes.count("two/x"));
+  ASSERT_EQ(&nodes.at("one/shared")->GetEqClass(),
+            &nodes.at("two/x/copy")->GetEqClass());
+  ASSERT_EQ(&nodes.at("one/shared/f1")->GetEqClass(),
+            &nodes.at("two/x/copy/f1")->GetEqClass());
+  ASSERT_NE(&nodes.at("one")->GetEqClass(), &nodes.at("two/x")->GetEqClass());
+}
+
+TEST(FuzzyDedupManyRootsTest, NamedAfterDirsWithoutLabels) {
+  TmpDir t1;
+  TmpDir t2;
+  t1.CreateFile("f1", "a");
+  t2.CreateFile("f1", "a");
+  FuzzyDedupRes res;
+  auto nodes = DedupManyRoots({t1.dir_, t2.dir_}, {}, &res);
+  ASSERT_EQ("", res.first->GetName());
+  ASSERT_EQ(&nodes.at(t1.dir_)->GetEqClass(), &nodes.at(t2.dir_)->GetEqClass());
+}
+
+// Build a pseudo-random hierarchy full of similar directories. Unless
+// shuffle_seed is 0, its nodes are created and its files are listed in an order
+// shuffled using it.
+static std::pair<std::shared_ptr<Node>, detail::Sum2Node> MakeRandomTree(
+    unsigned shuffle_seed = 0) {
+  constexpr int kNumGroups = 40;
+  constexpr int kNumDirs = 25;
+  constexpr int kNumFiles = 10;
+  std::mt19937 rng(7);
+  // Checksums of files, indexed by group, directory and file.
+  std::vector<Cksum> sums;
+  for (int i = 0; i < kNumGroups * kNumDirs; ++i) {
+    // A copy of one of a few templates with some files replaced, so that
+    // there are many candidates and ties between them.
+    const Cksum dir_template = rng() % 20;
+    for (int k = 0; k < kNumFiles; ++k) {
+      sums.push_back(rng() % 8 == 0 ? 1000 + rng() % 30
+                                    : dir_template * 10 + k);
+    }
+  }
+  std::mt19937 shuffle_rng(shuffle_seed);
+  auto order = [&shuffle_rng, shuffle_seed](int n) {
+    std::vector<int> res(n);
+    std::iota(res.begin(), res.end(), 0);
+    if (shuffle_seed != 0) {
+      std::shuffle(res.begin(), res.end(), shuffle_rng);
+    }
+    return res;
+  };
+
+  auto root = std::make_shared<Node>(Node::DIR, "/");
+  detail::Sum2Node sum_2_node;
+  for (int i : order(kNumGroups)) {
+    auto *group = new Node(Node::DIR, "g" + std::to_string(i));
+    root->AddChild(group);
+    for (int j : order(kNumDirs)) {
+      auto *dir = new Node(Node::DIR, "d" + std::to_string(j));
+      group->AddChild(dir);
+      for (int k : order(kNumFiles)) {
+        auto *file = new Node(Node::FILE, "f" + std::to_string(k));
+        dir->AddChild(file);
+        sum_2_node.emplace_back(sums[(i * kNumDirs + j) * kNumFiles + k],
+                                file);
+      }
+    }
+  }
+  if (shuffle_seed != 0) {
+    std::shuffle(sum_2_node.begin(), sum_2_node.end(), shuffle_rng);
+  }
+  return std::make_pair(root, std::move(sum_2_node));
+}
+
+// Classify the hierarchy built by MakeRandomTree(). Return the lowest path in
+// the equivalence class of every directory.
+static std::map<std::string, std::string> ClassifyRandomTree(int concurrency) {
+  auto [root, sum_2_node] = MakeRandomTree();
+  EqClassesPtr eq_classes = detail::ClassifyDuplicateFiles(*root, sum_2_node);
+  detail::PropagateEquivalence(*root, eq_classes, concurrency);
+
+  std::map<const EqClass *, std::string> lowest;
+  root->Traverse([&lowest](const Node *n) {
+    std::string &path = lowest[&n->GetEqClass()];
+    if (path.empty() || n->BuildPath().native() < path) {
+      path = n->BuildPath().native();
+    }
+  });
+  std::map<std::string, std::string> res;
+  root->Traverse([&lowest, &res](const Node *n) {
+    if (n->GetType() == Node::DIR) {
+      res[n->BuildPath().native()] = lowest[&n->GetEqClass()];
+    }
+  });
+  return res;
+}
+
+TEST(FuzzyDedupConcurrencyTest, SameAsSerial) {
+  const std::map<std::string, std::string> serial = ClassifyRandomTree(1);
+  size_t duplicates = 0;
+  for (const auto &path_and_lowest : serial) {
+    duplicates += path_and_lowest.first != path_and_lowest.second;
+  }
+  ASSERT_GT(duplicates, 500U);
+  ASSERT_EQ(ClassifyRandomTree(4), serial);
+  ASSERT_EQ(ClassifyRandomTree(3), serial);
+}
+
+// Classify the hierarchy built by MakeRandomTree(shuffle_seed) the way
+// --deterministic does. Return the paths of all nodes in the order of
+// traversal along with the numbers of their equivalence classes.
+static std::vector<std::pair<std::string, size_t>> ClassifyCanonically(
+    unsigned shuffle_seed, int concurrency, bool approximate = false) {
+  auto [root, sum_2_node] = MakeRandomTree(shuffle_seed);
+  detail::SortChildren(*root);
+  EqClassesPtr eq_classes = detail::ClassifyDuplicateFiles(*root, sum_2_node);
+  if (approximate) {
+    detail::ApproxPropagateEquivalence(*root, eq_classes, concurrency, true);
+  } else {
+    detail::PropagateEquivalence(*root, eq_classes, concurrency);
+  }
+  detail::SortEqClasses(eq_classes, root.get());
+
+  std::unordered_map<const EqClass *, size_t> class_ids;
+  for (const auto &eq_class : *eq_classes) {
+    class_ids.emplace(eq_class.get(), class_ids.size());
+  }
+  std::vector<std::pair<std::string, size_t>> res;
+  root->Traverse([&class_ids, &res](const Node *n) {
+    res.emplace_back(n->BuildPath().native(), class_ids.at(&n->GetEqClass()));
+  });
+  return res;
+}
+
+TEST(FuzzyDedupDeterminismTest, IndependentOfScanOrder) {
+  const std::vector<std::pair<std::string, size_t>> expected =
+      ClassifyCanonically(0, 1);
+  ASSERT_EQ(ClassifyCanonically(1, 1), expected);
+  ASSERT_EQ(ClassifyCanonically(2, 1), expected);
+  ASSERT_EQ(ClassifyCanonically(3, 4), expected);
+  ASSERT_EQ(ClassifyCanonically(4, 3), expected);
+}
+
+TEST(FuzzyDedupDeterminismTest, ApproximateIndependentOfScanOrder) {
+  const std::vector<std::pair<std::string, size_t>> expected =
+      ClassifyCanonically(0, 1, true);
+  ASSERT_EQ(ClassifyCanonically(1, 1, true), expected);
+  ASSERT_EQ(ClassifyCanonically(2, 1, true), expected);
+  ASSERT_EQ(ClassifyCanonically(3, 4, true), expected);
+  ASSERT_EQ(ClassifyCanonically(4, 3, true), expected);
+}
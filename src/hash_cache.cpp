@@ -25,8 +25,13 @@
 #include <unistd.h>
 #include <cerrno>
 
+#include <algorithm>
+#include <future>
 #include <memory>
+#include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 #include <openssl/sha.h>
 
@@ -46,26 +51,33 @@ class InodeCache {
  public:
   using Uuid = std::pair<dev_t, ino_t>;
   struct StatResult {
-    StatResult(Uuid id, off_t size, time_t mtime)
-        : id_(std::move(id)), size_(size), mtime_(mtime) {}
+    explicit StatResult(const struct stat &st)
+        : id_(st.st_dev, st.st_ino),
+          size_(st.st_size),
+          mtime_(st.st_mtime),
+          mtime_ns_(MtimeNs(st)) {}
 
     Uuid id_;
     off_t size_;
     time_t mtime_;
+    int64_t mtime_ns_;
   };
 
-  std::pair<bool, Cksum> Get(Uuid ino) {
+  // Files are modified in place and inodes get reused, so the size and mtime
+  // have to match too.
+  std::pair<bool, Cksum> Get(const StatResult &st) {
     std::lock_guard<std::mutex> lock(mutex_);
-    auto it = cache_map_.find(ino);
-    if (it != cache_map_.end()) {
-      return std::make_pair(true, it->second);
+    auto it = cache_map_.find(st.id_);
+    if (it != cache_map_.end() && it->second.size_ == st.size_ &&
+        it->second.mtime_ns_ == st.mtime_ns_) {
+      return std::make_pair(true, it->second.sum_);
     }
     return std::make_pair(false, 0);
   }
 
-  void Update(Uuid ino, Cksum sum) {
+  void Update(const StatResult &st, Cksum sum) {
     std::lock_guard<std::mutex> lock(mutex_);
-    cache_map_.insert(std::make_pair(ino, sum));
+    cache_map_.insert_or_assign(st.id_, Entry{st.size_, st.mtime_ns_, sum});
   }
 
   static StatResult GetInodeInfo(int fd, const std::string &path_for_errors) {
@@ -78,12 +90,16 @@ class InodeCache {
       throw FsException(errno,
                         "'" + path_for_errors + "' is not a regular file");
     }
-    return StatResult(std::make_pair(st.st_dev, st.st_ino), st.st_size,
-                      st.st_mtime);
+    return StatResult(st);
   }
 
  private:
-  using CacheMap = std::unordered_map<Uuid, Cksum, boost::hash<Uuid>>;
+  struct Entry {
+    off_t size_;
+    int64_t mtime_ns_;
+    Cksum sum_;
+  };
+  using CacheMap = std::unordered_map<Uuid, Entry, boost::hash<Uuid>>;
   CacheMap cache_map_;
   std::mutex mutex_;
 };
@@ -91,10 +107,10 @@ class InodeCache {
 // I'm asking for trouble, but I'm lazy.
 InodeCache ino_cache;
 
-Cksum ComputeCksum(int fd, InodeCache::Uuid uuid,
+Cksum ComputeCksum(int fd, const InodeCache::StatResult &st,
                    const std::string &path_for_errors) {
   {
-    std::pair<bool, Cksum> sum = ino_cache.Get(uuid);
+    std::pair<bool, Cksum> sum = ino_cache.Get(st);
     if (sum.first) {
       DLOG(path_for_errors << " shares an inode with something already "
                               "computed!");
@@ -127,81 +143,252 @@ Cksum ComputeCksum(int fd, InodeCache::Uuid uuid,
   SHA1_Final(sha_res.complete_, &sha);
 
   if (size) {
-    ino_cache.Update(uuid, sha_res.prefix_);
+    ino_cache.Update(st, sha_res.prefix_);
     return sha_res.prefix_;
   }
-  ino_cache.Update(uuid, 0);
+  ino_cache.Update(st, 0);
   return 0;
 }
 
 } /* anonymous namespace */
 
-std::unordered_map<std::string, FileInfo> ReadCacheFromDb(
-    const std::string &path) {
-  std::unordered_map<std::string, FileInfo> cache;
+size_t DbReaderThreads() {
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+namespace {
+
+// Don't bother spawning threads for fewer rows than that.
+constexpr int64_t kMinRowsPerReader = 1 << 16;
+
+std::vector<std::pair<std::string, FileInfo>> ReadCacheRange(
+    const std::string &path, int64_t begin_rowid, int64_t end_rowid) {
+  std::vector<std::pair<std::string, FileInfo>> res;
   DBConnection db(path, SQLITE_OPEN_READONLY);
   for (const auto &[path, sum, size, mtime] :
        db.Query<std::string, Cksum, off_t, time_t>(
-           "SELECT path, cksum, size, mtime FROM FileList")) {
+           "SELECT path, cksum, size, mtime FROM FileList "
+           "WHERE rowid >= ? AND rowid < ?",
+           begin_rowid, end_rowid)) {
     DLOG("Read \"" << path << "\": " << sum << " " << size << " " << mtime);
+    res.emplace_back(path, FileInfo(size, mtime, sum));
+  }
+  return res;
+}
 
-    FileInfo f_info(size, mtime, sum);
+}  // anonymous namespace
 
-    cache.insert(std::make_pair(path, f_info));
+std::unordered_map<std::string, FileInfo> ReadCacheFromDb(
+    const std::string &path, size_t num_threads) {
+  int64_t min_rowid, max_rowid;
+  {
+    DBConnection db(path, SQLITE_OPEN_READONLY);
+    std::tie(min_rowid, max_rowid) =
+        db.Query<int64_t, int64_t>(
+              "SELECT IFNULL(MIN(rowid), 0), IFNULL(MAX(rowid), -1) "
+              "FROM FileList")
+            .Read();
+  }
+  // Rowids may have gaps, but this is only about balancing the work.
+  const int64_t num_rows = max_rowid - min_rowid + 1;
+  const int64_t num_ranges = std::max<int64_t>(
+      1, std::min<int64_t>(num_threads, num_rows / kMinRowsPerReader));
+
+  std::vector<std::future<std::vector<std::pair<std::string, FileInfo>>>>
+      ranges;
+  for (int64_t i = 0; i < num_ranges; ++i) {
+    const int64_t begin = min_rowid + num_rows * i / num_ranges;
+    const int64_t end = min_rowid + num_rows * (i + 1) / num_ranges;
+    ranges.push_back(
+        std::async(std::launch::async, ReadCacheRange, path, begin, end));
+  }
+  std::vector<std::vector<std::pair<std::string, FileInfo>>> decoded;
+  size_t total = 0;
+  for (auto &range : ranges) {
+    decoded.push_back(range.get());
+    total += decoded.back().size();
+  }
+  std::unordered_map<std::string, FileInfo> cache;
+  cache.reserve(total);
+  for (auto &rows : decoded) {
+    for (auto &row : rows) {
+      cache.emplace(std::move(row.first), row.second);
+    }
+    rows.clear();
+    rows.shrink_to_fit();
   }
   return cache;
 }
 
+std::unordered_map<std::string, DirInfo> ReadDirCacheFromDb(
+    const std::string &path) {
+  std::unordered_map<std::string, DirInfo> dirs;
+  DBConnection db(path, SQLITE_OPEN_READONLY);
+  if (db.Query<int>("SELECT 1 FROM sqlite_master "
+                    "WHERE type = 'table' AND name = 'DirList'")
+          .Eof()) {
+    return dirs;
+  }
+  for (const auto &[path, ino, mtime_ns] :
+       db.Query<std::string, ino_t, int64_t>(
+           "SELECT path, inode, mtime_ns FROM DirList")) {
+    dirs.emplace(path, DirInfo(ino, mtime_ns, DirListing()));
+  }
+  for (const auto &[dir, name, is_dir] :
+       db.Query<std::string, std::string, int>(
+           "SELECT dir, name, is_dir FROM DirListEntry")) {
+    auto it = dirs.find(dir);
+    if (it != dirs.end()) {
+      DirListing &listing = it->second.listing_;
+      (is_dir ? listing.dirs_ : listing.files_).push_back(name);
+    }
+  }
+  return dirs;
+}
+
+int64_t MtimeNs(const struct stat &st) {
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+}
+
 HashCache *HashCache::instance_;
 
 HashCache::Initializer::Initializer(const std::string &read_cache_from,
-                                    const std::string &dump_cache_to) {
-  HashCache::Initialize(read_cache_from, dump_cache_to);
+                                    const std::string &dump_cache_to,
+                                    bool resume) {
+  HashCache::Initialize(read_cache_from, dump_cache_to, resume);
 }
 
 HashCache::Initializer::~Initializer() { HashCache::Finalize(); }
 
+static void CreateTablesIfMissing(DBConnection &db) {
+  db.Exec(
+      "CREATE TABLE IF NOT EXISTS FileList("
+      "path           TEXT    UNIQUE NOT NULL,"
+      "cksum          INTEGER NOT NULL,"
+      "size           INTEGER NOT NULL,"
+      "mtime          INTEGER NOT NULL);"
+      "CREATE TABLE IF NOT EXISTS DirList("
+      "path           TEXT    UNIQUE NOT NULL,"
+      "inode          INTEGER NOT NULL,"
+      "mtime_ns       INTEGER NOT NULL);"
+      "CREATE TABLE IF NOT EXISTS DirListEntry("
+      "dir            TEXT    NOT NULL,"
+      "name           TEXT    NOT NULL,"
+      "is_dir         INTEGER NOT NULL);"
+      "CREATE INDEX IF NOT EXISTS DirListEntryDir ON DirListEntry(dir);");
+}
+
+static void CreateOrEmptyTables(DBConnection &db) {
+  db.Exec(
+      "DROP TABLE IF EXISTS FileList;"
+      "DROP TABLE IF EXISTS DirList;"
+      "DROP TABLE IF EXISTS DirListEntry;");
+  CreateTablesIfMissing(db);
+}
+
 HashCache::HashCache(const std::string &read_cache_from,
-                     const std::string &dump_cache_to) {
+                     const std::string &dump_cache_to, bool resume) {
   if (!read_cache_from.empty()) {
-    auto cache = ReadCacheFromDb(read_cache_from);
-    std::lock_guard<std::mutex> lock(mutex_);
-    cache_.swap(cache);
+    cache_ = ReadCacheFromDb(read_cache_from);
+    dir_cache_ = ReadDirCacheFromDb(read_cache_from);
   }
   if (!dump_cache_to.empty()) {
     db_ = std::make_unique<DBConnection>(dump_cache_to);
+    CacheMap stored;
+    DirCacheMap stored_dirs;
+    if (resume) {
+      CreateTablesIfMissing(*db_);
+      db_table_ready_ = true;
+      stored = ReadCacheFromDb(dump_cache_to);
+      stored_dirs = ReadDirCacheFromDb(dump_cache_to);
+      LOG(INFO, "Resuming with " << stored.size() << " stored checksums");
+    }
+    for (const auto &entry : cache_) {
+      if (stored.find(entry.first) == stored.end()) {
+        unstored_.push_back(&entry);
+      }
+    }
+    for (auto &entry : stored) {
+      cache_.insert_or_assign(entry.first, entry.second);
+    }
+    for (const auto &entry : dir_cache_) {
+      if (stored_dirs.find(entry.first) == stored_dirs.end()) {
+        unstored_dirs_.push_back(&entry);
+      }
+    }
+    for (auto &entry : stored_dirs) {
+      dir_cache_.insert_or_assign(entry.first, std::move(entry.second));
+    }
   }
 }
 
-HashCache::~HashCache() { StoreCksums(); }
-
-static void CreateOrEmptyTable(DBConnection &db) {
-  db.Exec(
-      "DROP TABLE IF EXISTS FileList;"
-      "CREATE TABLE FileList("
-      "path           TEXT    UNIQUE NOT NULL,"
-      "cksum          INTEGER NOT NULL,"
-      "size           INTEGER NOT NULL,"
-      "mtime          INTEGER NOT NULL);");
-}
+HashCache::~HashCache() { Flush(); }
 
-void HashCache::StoreCksums() {
-  std::lock_guard<std::mutex> lock(mutex_);
+void HashCache::Flush(const std::function<void(DBConnection &)> &also_store) {
+  std::lock_guard<std::mutex> db_lock(db_mutex_);
   if (!db_) {
     return;
   }
-  DBConnection &db(*db_);
-  CreateOrEmptyTable(db);
-  DBTransaction trans(db);
-  auto out = db.Prepare<std::string, Cksum, off_t, time_t>(
-      "INSERT INTO FileList(path, cksum, size, mtime) VALUES(?, ?, ?, ?)");
-  std::transform(cache_.begin(), cache_.end(), out->begin(),
-                 [](const std::pair<std::string, FileInfo> &file) {
-                   return std::make_tuple(file.first, file.second.sum_,
-                                          file.second.size_,
-                                          file.second.mtime_);
-                 });
-  trans.Commit();
+  std::vector<const CacheMap::value_type *> batch;
+  std::vector<const DirCacheMap::value_type *> dir_batch;
+  std::vector<std::tuple<std::string, Cksum, off_t, time_t>> rows;
+  std::vector<std::pair<std::string, DirInfo>> dir_rows;
+  {
+    // Copy the rows so that hashing can proceed while we're writing.
+    std::lock_guard<std::mutex> lock(mutex_);
+    batch.swap(unstored_);
+    rows.reserve(batch.size());
+    for (const auto *entry : batch) {
+      rows.emplace_back(entry->first, entry->second.sum_, entry->second.size_,
+                        entry->second.mtime_);
+    }
+    dir_batch.swap(unstored_dirs_);
+    dir_rows.reserve(dir_batch.size());
+    for (const auto *entry : dir_batch) {
+      dir_rows.emplace_back(*entry);
+    }
+  }
+  try {
+    DBConnection &db(*db_);
+    if (!db_table_ready_) {
+      CreateOrEmptyTables(db);
+      db_table_ready_ = true;
+    }
+    DBTransaction trans(db);
+    auto out = db.Prepare<std::string, Cksum, off_t, time_t>(
+        "INSERT OR REPLACE INTO FileList(path, cksum, size, mtime) "
+        "VALUES(?, ?, ?, ?)");
+    std::copy(rows.begin(), rows.end(), out->begin());
+    auto dir_out = db.Prepare<std::string, ino_t, int64_t>(
+        "INSERT OR REPLACE INTO DirList(path, inode, mtime_ns) "
+        "VALUES(?, ?, ?)");
+    auto entries_del =
+        db.Prepare<std::string>("DELETE FROM DirListEntry WHERE dir = ?");
+    auto entries_out = db.Prepare<std::string, std::string, int>(
+        "INSERT INTO DirListEntry(dir, name, is_dir) VALUES(?, ?, ?)");
+    for (const auto &[dir, dir_info] : dir_rows) {
+      dir_out->Write(dir, dir_info.ino_, dir_info.mtime_ns_);
+      entries_del->Write(dir);
+      for (const auto &name : dir_info.listing_.dirs_) {
+        entries_out->Write(dir, name, 1);
+      }
+      for (const auto &name : dir_info.listing_.files_) {
+        entries_out->Write(dir, name, 0);
+      }
+    }
+    if (also_store) {
+      also_store(db);
+    }
+    trans.Commit();
+  } catch (...) {
+    // Don't lose the checksums - they will be stored in the next attempt.
+    std::lock_guard<std::mutex> lock(mutex_);
+    unstored_.insert(unstored_.end(), batch.begin(), batch.end());
+    unstored_dirs_.insert(unstored_dirs_.end(), dir_batch.begin(),
+                          dir_batch.end());
+    throw;
+  }
 }
 
 namespace {
@@ -227,40 +414,80 @@ class AutoFdCloser {
 
 FileInfo HashCache::operator()(const boost::filesystem::path &p) {
   const std::string &native = p.native();
-  int fd = open(native.c_str(), O_RDONLY);
-  if (fd == -1) {
-    throw FsException(errno, "open '" + native + "'");
-  }
-  AutoFdCloser closer(fd);
-
-  InodeCache::StatResult stat_res = InodeCache::GetInodeInfo(fd, native);
   {
+    // Check the cache before opening the file - stat is cheaper, especially
+    // on network filesystems.
+    struct stat st;
+    if (stat(native.c_str(), &st) != 0) {
+      throw FsException(errno, "stat on '" + native + "'");
+    }
     std::lock_guard<std::mutex> lock(mutex_);
-    auto it = cache_.find(p.native());
-    if (it != cache_.end()) {
+    auto it = cache_.find(native);
+    if (it != cache_.end() && S_ISREG(st.st_mode)) {
       const FileInfo &cached = it->second;
-      if (cached.size_ == stat_res.size_ && cached.mtime_ == stat_res.mtime_) {
+      if (cached.size_ == st.st_size && cached.mtime_ == st.st_mtime) {
         return it->second;
       }
     }
   }
-  Cksum cksum = ComputeCksum(fd, stat_res.id_, native);
+  int fd = open(native.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw FsException(errno, "open '" + native + "'");
+  }
+  AutoFdCloser closer(fd);
+
+  InodeCache::StatResult stat_res = InodeCache::GetInodeInfo(fd, native);
+  Cksum cksum = ComputeCksum(fd, stat_res, native);
   FileInfo res(stat_res.size_, stat_res.mtime_, cksum);
 
   std::lock_guard<std::mutex> lock(mutex_);
   // If some other thread inserted a checksum for the same file in the
   // meantime, it's not a big deal.
-  cache_[p.native()] = res;
+  auto it = cache_.insert_or_assign(p.native(), res).first;
+  if (db_) {
+    unstored_.push_back(&*it);
+  }
   if (cache_.size() % 1000 == 0) {
     LOG(INFO, "Cache size: " << cache_.size());
   }
   return res;
 }
 
+std::optional<FileInfo> HashCache::Lookup(const boost::filesystem::path &p) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = cache_.find(p.native());
+  if (it == cache_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+std::optional<DirListing> HashCache::LookupDir(
+    const boost::filesystem::path &dir, ino_t ino, int64_t mtime_ns) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = dir_cache_.find(dir.native());
+  if (it == dir_cache_.end() || it->second.ino_ != ino ||
+      it->second.mtime_ns_ != mtime_ns) {
+    return std::nullopt;
+  }
+  return it->second.listing_;
+}
+
+void HashCache::StoreDir(const boost::filesystem::path &dir,
+                         DirInfo dir_info) {
+  if (!db_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it =
+      dir_cache_.insert_or_assign(dir.native(), std::move(dir_info)).first;
+  unstored_dirs_.push_back(&*it);
+}
+
 void HashCache::Initialize(const std::string &read_cache_from,
-                           const std::string &dump_cache_to) {
+                           const std::string &dump_cache_to, bool resume) {
   assert(!instance_);
-  HashCache::instance_ = new HashCache(read_cache_from, dump_cache_to);
+  HashCache::instance_ = new HashCache(read_cache_from, dump_cache_to, resume);
 }
 
 void HashCache::Finalize() {
@@ -20,11 +20,18 @@
 #ifndef SRC_HASH_CACHE_H_
 #define SRC_HASH_CACHE_H_
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include <cstdint>
 
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <unordered_map>
 
@@ -44,35 +51,87 @@ struct FileInfo {
   Cksum sum_;
 };
 
+// Modification time with nanosecond precision.
+int64_t MtimeNs(const struct stat &st);
+
+// Names of subdirectories and regular files in a directory.
+struct DirListing {
+  std::vector<std::string> dirs_;
+  std::vector<std::string> files_;
+};
+
+// A directory listing along with the directory's inode and mtime at the time
+// of listing it.
+struct DirInfo {
+  DirInfo() = default;
+  DirInfo(ino_t ino, int64_t mtime_ns, DirListing listing)
+      : ino_(ino), mtime_ns_(mtime_ns), listing_(std::move(listing)) {}
+
+  ino_t ino_{};
+  int64_t mtime_ns_{};
+  DirListing listing_;
+};
+
+// Number of threads used for decoding large databases.
+size_t DbReaderThreads();
+
+// The table is split into rowid ranges, which are decoded by num_threads
+// threads, each with its own connection.
 std::unordered_map<std::string, FileInfo> ReadCacheFromDb(
+    const std::string &path, size_t num_threads = DbReaderThreads());
+// Caches created by older versions have no directory listings, in which case
+// an empty map is returned.
+std::unordered_map<std::string, DirInfo> ReadDirCacheFromDb(
     const std::string &path);
 
 class HashCache {
  public:
   class Initializer {
    public:
+    // If resume is set, checksums already stored in dump_cache_to are read
+    // too and that file is appended to rather than overwritten.
     Initializer(const std::string &read_cache_from,
-                const std::string &dump_cache_to);
+                const std::string &dump_cache_to, bool resume = false);
     ~Initializer();
   };
   static HashCache &Get();
   FileInfo operator()(const boost::filesystem::path &p);
+  // Cached information on p, if any. The filesystem is not consulted, so it
+  // might be stale.
+  std::optional<FileInfo> Lookup(const boost::filesystem::path &p);
+  // Cached listing of dir, provided that its inode and mtime haven't changed.
+  std::optional<DirListing> LookupDir(const boost::filesystem::path &dir,
+                                      ino_t ino, int64_t mtime_ns);
+  // Only has any effect if the cache is going to be dumped.
+  void StoreDir(const boost::filesystem::path &dir, DirInfo dir_info);
+  // Store checksums and directory listings which haven't been stored yet in
+  // dump_cache_to, if it was specified. also_store, if set, is called within
+  // the same transaction so that whatever it writes is consistent with the
+  // stored checksums.
+  void Flush(const std::function<void(DBConnection &)> &also_store = {});
 
  private:
   HashCache(const std::string &read_cache_from,
-            const std::string &dump_cache_to);
+            const std::string &dump_cache_to, bool resume);
   ~HashCache();
-  void StoreCksums();
   static void Initialize(const std::string &read_cache_from,
-                         const std::string &dump_cache_to);
+                         const std::string &dump_cache_to, bool resume);
   static void Finalize();
 
   static HashCache *instance_;
 
   using CacheMap = std::unordered_map<std::string, FileInfo>;
   CacheMap cache_;
+  // Entries of cache_ not stored in db_ yet; unordered_map doesn't invalidate
+  // pointers to its elements on rehashing.
+  std::vector<const CacheMap::value_type *> unstored_;
+  using DirCacheMap = std::unordered_map<std::string, DirInfo>;
+  DirCacheMap dir_cache_;
+  std::vector<const DirCacheMap::value_type *> unstored_dirs_;
+  std::mutex mutex_;  // protects all of the above
   std::unique_ptr<DBConnection> db_;
-  std::mutex mutex_;
+  bool db_table_ready_{};
+  std::mutex db_mutex_;  // protects db_ and db_table_ready_
 };
 
 #endif  // SRC_HASH_CACHE_H_
@@ -0,0 +1,170 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "min_hash.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <string>
+
+namespace {
+
+// splitmix64 finalizer; good enough to make hashes of pointers look random.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Uniformly distributed on (0, 1).
+double ToUnit(uint64_t hash) {
+  return (static_cast<double>(hash >> 11) + 0.5) / (UINT64_C(1) << 53);
+}
+
+}  // anonymous namespace
+
+MinHasher::MinHasher(double max_distance) {
+  const double similarity = 1 - max_distance;
+  // The longer the bands, the fewer false candidates, so pick the longest
+  // ones which still give the requested recall.
+  rows_ = 1;
+  for (size_t rows = 2; rows <= kMaxSignatureSize; ++rows) {
+    const double bands = kMaxSignatureSize / rows;
+    if (1 - std::pow(1 - std::pow(similarity, rows), bands) < kMinRecall) {
+      break;
+    }
+    rows_ = rows;
+  }
+  bands_ = kMaxSignatureSize / rows_;
+  for (size_t i = 0; i < rows_ * bands_; ++i) {
+    seeds_.push_back(Mix(i));
+  }
+}
+
+MinHasher::Signature MinHasher::Sign(const Classes &classes) const {
+  const size_t size = rows_ * bands_;
+  Signature res;
+  std::vector<double> min_values(size, std::numeric_limits<double>::max());
+  for (const auto &[id, weight] : classes) {
+    if (weight == 0) {
+      continue;
+    }
+    if (res.empty()) {
+      res.resize(size);
+    }
+    const uint64_t hash = Mix(id);
+    const double inv_weight = 1. / weight;
+    for (size_t i = 0; i < size; ++i) {
+      // hash is random already, so a multiplication mixes it well enough.
+      const double u = ToUnit((hash ^ seeds_[i]) * 0x9e3779b97f4a7c15ULL);
+      // -log(u) >= 1 - u, so most classes lose without computing the log.
+      if ((1 - u) * inv_weight >= min_values[i]) {
+        continue;
+      }
+      const double value = -std::log(u) * inv_weight;
+      if (value < min_values[i]) {
+        min_values[i] = value;
+        res[i] = id;
+      }
+    }
+  }
+  return res;
+}
+
+uint64_t MinHasher::BandKey(const Signature &signature, size_t band) const {
+  // Rows in different bands mustn't make a match. Rows may be addresses, so
+  // mixing the band into them directly would let nearby ones collide.
+  uint64_t key = Mix(band);
+  for (size_t i = band * rows_; i < (band + 1) * rows_; ++i) {
+    key = Mix(key ^ signature[i]);
+  }
+  return key;
+}
+
+uint64_t MinHasher::PathId(const std::string &smallest_path) {
+  return Mix(std::hash<std::string>()(smallest_path));
+}
+
+MinHashIndex::MinHashIndex(double max_distance, bool stable_ids)
+    : hasher_(max_distance), stable_ids_(stable_ids) {}
+
+void MinHashIndex::Identify(const Node &node) {
+  if (!stable_ids_) {
+    return;
+  }
+  for (const EqClass *eq_class : node.GetChildClasses()) {
+    if (class_ids_.count(eq_class)) {
+      continue;
+    }
+    // Which nodes a class has when it's first seen depends only on the
+    // evaluation so far and not on the order of nodes in it.
+    std::string smallest;
+    for (size_t i = 0; i < eq_class->nodes_.size(); ++i) {
+      std::string path = eq_class->nodes_[i]->BuildPath().native();
+      if (i == 0 || path < smallest) {
+        smallest.swap(path);
+      }
+    }
+    class_ids_.emplace(eq_class, MinHasher::PathId(smallest));
+  }
+}
+
+MinHashIndex::Signature MinHashIndex::Sign(const Node &node) const {
+  assert(node.IsReadyToEvaluate());
+  MinHasher::Classes classes;
+  classes.reserve(node.GetChildClasses().size());
+  for (const EqClass *eq_class : node.GetChildClasses()) {
+    classes.emplace_back(stable_ids_ ? class_ids_.at(eq_class)
+                                     : reinterpret_cast<uintptr_t>(eq_class),
+                         // Like in NodeDistance().
+                         static_cast<uint64_t>(eq_class->GetWeight()));
+  }
+  return hasher_.Sign(classes);
+}
+
+void MinHashIndex::Add(Node &node, const Signature &signature) {
+  assert(node.IsReadyToEvaluate());
+  if (signature.empty()) {
+    return;
+  }
+  for (size_t band = 0; band < GetNumBands(); ++band) {
+    buckets_.emplace(hasher_.BandKey(signature, band), &node);
+  }
+}
+
+Nodes MinHashIndex::GetCandidates(const Signature &signature) const {
+  Nodes res;
+  if (signature.empty()) {
+    return res;
+  }
+  for (size_t band = 0; band < GetNumBands(); ++band) {
+    const auto range = buckets_.equal_range(hasher_.BandKey(signature, band));
+    for (auto it = range.first; it != range.second; ++it) {
+      res.push_back(it->second);
+    }
+  }
+  // Similar directories usually share more than one band.
+  std::sort(res.begin(), res.end());
+  res.erase(std::unique(res.begin(), res.end()), res.end());
+  return res;
+}
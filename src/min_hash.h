@@ -0,0 +1,112 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_MIN_HASH_H_
+#define SRC_MIN_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "file_tree.h"
+
+// Weighted MinHash signatures of directories' children's equivalence classes:
+// for each hash function i the class minimizing -log(U_i(class)) / weight is
+// picked, U_i being uniform on (0, 1). Two directories pick the same class
+// with probability of exactly 1 - NodeDistance(). Signatures are split into
+// bands, so that directories whose signatures agree on a whole band can be
+// looked up by its key.
+class MinHasher {
+ public:
+  using Signature = std::vector<uint64_t>;
+  // Ids of classes along with their weights.
+  using Classes = std::vector<std::pair<uint64_t, uint64_t>>;
+
+  // Maximum number of hash functions in a signature.
+  static constexpr size_t kMaxSignatureSize = 64;
+  // Directories at max_distance from each other agree on a band with at least
+  // this probability. Closer ones do with a higher one.
+  static constexpr double kMinRecall = 0.99;
+
+  explicit MinHasher(double max_distance);
+
+  // Signature of a directory whose children are in classes. It is empty if
+  // none of them has a positive weight.
+  Signature Sign(const Classes &classes) const;
+  uint64_t BandKey(const Signature &signature, size_t band) const;
+  // Id of a class told apart by the smallest path among its nodes rather than
+  // by its address.
+  static uint64_t PathId(const std::string &smallest_path);
+
+  size_t GetNumBands() const { return bands_; }
+  size_t GetNumRows() const { return rows_; }
+
+ private:
+  size_t rows_;
+  size_t bands_;
+  // Seeds of the hash functions.
+  std::vector<uint64_t> seeds_;
+};
+
+// Locality sensitive hashing (LSH) index of directories, which proposes
+// directories likely to be within a given NodeDistance() of a directory
+// without looking at every directory sharing a child with it. Directories
+// whose MinHasher signatures agree on a whole band are candidates.
+class MinHashIndex {
+ public:
+  using Signature = MinHasher::Signature;
+
+  static constexpr size_t kMaxSignatureSize = MinHasher::kMaxSignatureSize;
+
+  // If stable_ids is set, classes are told apart by their contents rather than
+  // by their addresses, so that the candidates don't depend on the memory
+  // layout; see Identify().
+  explicit MinHashIndex(double max_distance, bool stable_ids = false);
+  MinHashIndex(const MinHashIndex &) = delete;
+  MinHashIndex &operator=(const MinHashIndex &) = delete;
+
+  // With stable ids, has to be called for node before Sign(), one call at a
+  // time. The children's classes which aren't identified yet get an id derived
+  // from the smallest path among their current nodes.
+  void Identify(const Node &node);
+  // Signature of node, which has to be ready to evaluate. It is empty if none
+  // of node's children has a positive weight.
+  Signature Sign(const Node &node) const;
+  // Add a directory ready to evaluate with its signature.
+  void Add(Node &node, const Signature &signature);
+  // Directories added so far whose signatures agree with signature on at
+  // least one band.
+  Nodes GetCandidates(const Signature &signature) const;
+
+  size_t GetNumBands() const { return hasher_.GetNumBands(); }
+  size_t GetNumRows() const { return hasher_.GetNumRows(); }
+
+ private:
+  const MinHasher hasher_;
+  const bool stable_ids_;
+  // Ids of classes, if stable_ids_ is set.
+  std::unordered_map<const EqClass *, uint64_t> class_ids_;
+  // Nodes by the keys of their signatures' bands.
+  std::unordered_multimap<uint64_t, Node *> buckets_;
+};
+
+#endif  // SRC_MIN_HASH_H_
@@ -0,0 +1,121 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "min_hash.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+class MinHashTest : public ::testing::Test {
+ protected:
+  EqClass *NewClass() {
+    classes_.push_back(std::make_unique<EqClass>());
+    return classes_.back().get();
+  }
+
+  // A directory with a file in each of classes [first, last) of classes_.
+  Node *AddDir(size_t first, size_t last) {
+    while (classes_.size() < last) {
+      NewClass();
+    }
+    dirs_.push_back(std::make_unique<Node>(Node::DIR, "d"));
+    Node *dir = dirs_.back().get();
+    for (size_t i = first; i < last; ++i) {
+      auto *file = new Node(Node::FILE, "f" + std::to_string(i));
+      dir->AddChild(file);
+      classes_[i]->AddNode(*file);
+    }
+    return dir;
+  }
+
+  // Assign dir to a class of its own.
+  void Evaluate(Node &dir) { NewClass()->AddNode(dir); }
+
+  std::vector<std::unique_ptr<Node>> dirs_;
+  std::vector<std::unique_ptr<EqClass>> classes_;
+};
+
+TEST_F(MinHashTest, Bands) {
+  MinHashIndex index(0.2);
+  ASSERT_EQ(index.GetNumRows(), 5U);
+  ASSERT_EQ(index.GetNumBands(), 12U);
+  // Only identical directories are of interest.
+  MinHashIndex exact(0);
+  ASSERT_EQ(exact.GetNumRows(), MinHashIndex::kMaxSignatureSize);
+  ASSERT_EQ(exact.GetNumBands(), 1U);
+}
+
+TEST_F(MinHashTest, IdenticalDirs) {
+  MinHashIndex index(0.2);
+  Node *d1 = AddDir(0, 10);
+  Node *d2 = AddDir(0, 10);
+  const MinHashIndex::Signature signature = index.Sign(*d1);
+  ASSERT_EQ(signature.size(), 60U);
+  ASSERT_EQ(index.Sign(*d2), signature);
+  ASSERT_EQ(index.GetCandidates(signature), Nodes());
+  Evaluate(*d1);
+  index.Add(*d1, signature);
+  ASSERT_EQ(index.GetCandidates(index.Sign(*d2)), Nodes{d1});
+}
+
+TEST_F(MinHashTest, DisjointDirs) {
+  MinHashIndex index(0.9);
+  Node *d1 = AddDir(0, 10);
+  Node *d2 = AddDir(10, 20);
+  Evaluate(*d1);
+  index.Add(*d1, index.Sign(*d1));
+  ASSERT_EQ(index.GetCandidates(index.Sign(*d2)), Nodes());
+}
+
+TEST_F(MinHashTest, Similarity) {
+  // Pairs of directories sharing a third of their classes' weight, i.e. at a
+  // distance of 2/3.
+  MinHashIndex index(0.2);
+  size_t equal = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < 20; ++i) {
+    const size_t first = classes_.size();
+    const MinHashIndex::Signature s1 = index.Sign(*AddDir(first, first + 20));
+    const MinHashIndex::Signature s2 =
+        index.Sign(*AddDir(first + 10, first + 30));
+    ASSERT_EQ(s1.size(), s2.size());
+    for (size_t j = 0; j < s1.size(); ++j) {
+      equal += s1[j] == s2[j];
+    }
+    total += s1.size();
+  }
+  ASSERT_NEAR(static_cast<double>(equal) / total, 1. / 3, 0.1);
+}
+
+TEST_F(MinHashTest, Weightless) {
+  MinHashIndex index(0.2);
+  // Empty directories weigh nothing.
+  Node dir(Node::DIR, "d");
+  auto *empty = new Node(Node::DIR, "e");
+  dir.AddChild(empty);
+  NewClass()->AddNode(*empty);
+  const MinHashIndex::Signature signature = index.Sign(dir);
+  ASSERT_TRUE(signature.empty());
+  Evaluate(dir);
+  index.Add(dir, signature);
+  ASSERT_EQ(index.GetCandidates(signature), Nodes());
+}
@@ -0,0 +1,173 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "scan_checkpoint.h"
+
+#include <iterator>
+
+#include "conf.h"
+#include "db_lib_impl.h"
+#include "hash_cache.h"
+#include "log.h"
+
+std::unique_ptr<ScanCheckpoint> ScanCheckpoint::FromConf(
+    const boost::filesystem::path &root) {
+  if (Conf().dump_cache_to_.empty() || Conf().checkpoint_interval_ <= 0) {
+    return nullptr;
+  }
+  return std::make_unique<ScanCheckpoint>(
+      Conf().dump_cache_to_, root, Conf().resume_,
+      std::chrono::seconds(Conf().checkpoint_interval_));
+}
+
+ScanCheckpoint::ScanCheckpoint(const std::string &db_path,
+                               boost::filesystem::path root, bool resume,
+                               std::chrono::seconds interval)
+    : root_(root.native()), interval_(interval) {
+  DBConnection db(db_path);
+  db.Exec(
+      "CREATE TABLE IF NOT EXISTS ScannedDir("
+      "root           TEXT    NOT NULL,"
+      "path           TEXT    NOT NULL,"
+      "UNIQUE(root, path));"
+      "CREATE TABLE IF NOT EXISTS ScannedDirEntry("
+      "root           TEXT    NOT NULL,"
+      "dir            TEXT    NOT NULL,"
+      "name           TEXT    NOT NULL,"
+      "is_dir         INTEGER NOT NULL);"
+      "CREATE INDEX IF NOT EXISTS ScannedDirEntryRoot "
+      "ON ScannedDirEntry(root);");
+  if (resume) {
+    for (const auto &[path] : db.Query<std::string>(
+             "SELECT path FROM ScannedDir WHERE root = ?", root_)) {
+      completed_[path];
+    }
+    for (const auto &[dir, name, is_dir] :
+         db.Query<std::string, std::string, int>(
+             "SELECT dir, name, is_dir FROM ScannedDirEntry WHERE root = ?",
+             root_)) {
+      auto it = completed_.find(dir);
+      if (it == completed_.end()) {
+        continue;
+      }
+      (is_dir ? it->second.dirs_ : it->second.files_).push_back(name);
+    }
+    LOG(INFO, "Resuming scan of \"" << root_ << "\" with " << completed_.size()
+                                    << " directories already scanned");
+  } else {
+    DBTransaction trans(db);
+    db.Prepare<std::string>("DELETE FROM ScannedDirEntry WHERE root = ?")
+        ->Write(root_);
+    db.Prepare<std::string>("DELETE FROM ScannedDir WHERE root = ?")
+        ->Write(root_);
+    trans.Commit();
+  }
+  if (interval_.count() > 0) {
+    thread_ = std::thread(&ScanCheckpoint::StoreLoop, this);
+  }
+}
+
+ScanCheckpoint::~ScanCheckpoint() { StopThread(); }
+
+const DirListing *ScanCheckpoint::Completed(
+    const boost::filesystem::path &dir) const {
+  auto it = completed_.find(dir.native());
+  return (it == completed_.end()) ? nullptr : &it->second;
+}
+
+void ScanCheckpoint::DirCompleted(const boost::filesystem::path &dir,
+                                  DirListing listing) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  not_stored_.emplace_back(dir.native(), std::move(listing));
+}
+
+void ScanCheckpoint::Store() {
+  std::vector<std::pair<std::string, DirListing>> to_store;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    to_store.swap(not_stored_);
+  }
+  try {
+    // Checksums of files in the completed directories are already in the
+    // cache, so they are flushed together with the directories.
+    HashCache::Get().Flush([&](DBConnection &db) {
+      auto dirs = db.Prepare<std::string, std::string>(
+          "INSERT OR REPLACE INTO ScannedDir(root, path) VALUES(?, ?)");
+      auto entries = db.Prepare<std::string, std::string, std::string, int>(
+          "INSERT INTO ScannedDirEntry(root, dir, name, is_dir) "
+          "VALUES(?, ?, ?, ?)");
+      for (const auto &[dir, listing] : to_store) {
+        dirs->Write(root_, dir);
+        for (const auto &name : listing.dirs_) {
+          entries->Write(root_, dir, name, 1);
+        }
+        for (const auto &name : listing.files_) {
+          entries->Write(root_, dir, name, 0);
+        }
+      }
+    });
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    not_stored_.insert(not_stored_.end(),
+                       std::make_move_iterator(to_store.begin()),
+                       std::make_move_iterator(to_store.end()));
+    throw;
+  }
+  DLOG("Stored checkpoint of \"" << root_ << "\" with " << to_store.size()
+                                 << " newly scanned directories");
+}
+
+void ScanCheckpoint::Finish() {
+  StopThread();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    not_stored_.clear();
+  }
+  HashCache::Get().Flush([this](DBConnection &db) {
+    db.Prepare<std::string>("DELETE FROM ScannedDirEntry WHERE root = ?")
+        ->Write(root_);
+    db.Prepare<std::string>("DELETE FROM ScannedDir WHERE root = ?")
+        ->Write(root_);
+  });
+}
+
+void ScanCheckpoint::StoreLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!cv_.wait_for(lock, interval_, [this] { return stopping_; })) {
+    lock.unlock();
+    try {
+      Store();
+    } catch (const std::exception &e) {
+      // The scan itself is still fine, let's retry next time.
+      LOG(ERROR, "Failed to store scan checkpoint: " << e.what());
+    }
+    lock.lock();
+  }
+}
+
+void ScanCheckpoint::StopThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    cv_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_SCAN_CHECKPOINT_H_
+#define SRC_SCAN_CHECKPOINT_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include "hash_cache.h"  // for DirListing
+
+// Progress of a ScanDirectory() run, periodically stored in the database to
+// which the checksum cache is dumped, so that an interrupted scan can be
+// resumed without listing completed directories again. Checksums of their
+// files are taken from the cache, which is stored in the same transaction.
+//
+// The traversal frontier is not stored explicitly - it consists of
+// subdirectories of completed directories which are not completed themselves.
+class ScanCheckpoint {
+ public:
+  // Returns nullptr unless the global configuration asks for checkpoints.
+  static std::unique_ptr<ScanCheckpoint> FromConf(
+      const boost::filesystem::path &root);
+
+  // HashCache has to be initialized with db_path as dump_cache_to. If resume
+  // is not set, any previous checkpoint of root is discarded. If interval is
+  // 0, the checkpoint is only stored by explicit Store() calls.
+  ScanCheckpoint(const std::string &db_path, boost::filesystem::path root,
+                 bool resume, std::chrono::seconds interval);
+  ~ScanCheckpoint();
+
+  // Listing of dir if it was completed before the scan was resumed. A
+  // directory is completed once it's been listed and all of its files have
+  // been hashed; only entries handed over to the ScanProcessor are recorded.
+  const DirListing *Completed(const boost::filesystem::path &dir) const;
+  // Thread-safe.
+  void DirCompleted(const boost::filesystem::path &dir, DirListing listing);
+  void Store();
+  // Discards the checkpoint; to be called once the scan is complete.
+  void Finish();
+
+ private:
+  void StoreLoop();
+  void StopThread();
+
+  const std::string root_;
+  std::unordered_map<std::string, DirListing> completed_;  // read-only
+  const std::chrono::seconds interval_;
+  std::mutex mutex_;  // protects everything below
+  std::vector<std::pair<std::string, DirListing>> not_stored_;
+  bool stopping_{};
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+#endif  // SRC_SCAN_CHECKPOINT_H_
@@ -0,0 +1,148 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "scan_checkpoint.h"
+
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#include "scanner_int.h"
+
+#include "gtest/gtest.h"
+#include "test_common.h"
+
+using boost::filesystem::path;
+
+namespace {
+
+// Records paths of all directories and files it's been given.
+class PathsProcessor : public ScanProcessor<path> {
+ public:
+  void Files(const path &parent, const FileRecords &files) override {
+    for (const FileRecord &file : files) {
+      paths_.insert((parent / file.name_).native());
+    }
+  }
+  path RootDir(const path &p) override {
+    paths_.insert(p.native());
+    return p;
+  }
+  path Dir(const path &p, const path &parent) override {
+    paths_.insert((parent / p).native());
+    return parent / p;
+  }
+
+  std::set<std::string> paths_;
+};
+
+}  // anonymous namespace
+
+TEST(ScanCheckpoint, HashCacheResume) {
+  TmpDir t, db_dir;
+  t.CreateFile("a", "a");
+  t.CreateFile("b", "b");
+  const std::string db = db_dir.dir_ + "/cache.sqlite3";
+  {
+    HashCache::Initializer hash_cache_init("", db);
+    HashCache::Get()(t.dir_ + "/a");
+    HashCache::Get().Flush();
+    HashCache::Get()(t.dir_ + "/b");
+  }
+  {
+    HashCache::Initializer hash_cache_init("", db, true);
+    ASSERT_TRUE(HashCache::Get().Lookup(t.dir_ + "/a").has_value());
+    ASSERT_TRUE(HashCache::Get().Lookup(t.dir_ + "/b").has_value());
+  }
+  {
+    // Without resuming the previous contents are discarded.
+    HashCache::Initializer hash_cache_init("", db);
+    HashCache::Get()(t.dir_ + "/a");
+  }
+  HashCache::Initializer hash_cache_init("", db, true);
+  ASSERT_TRUE(HashCache::Get().Lookup(t.dir_ + "/a").has_value());
+  ASSERT_FALSE(HashCache::Get().Lookup(t.dir_ + "/b").has_value());
+}
+
+TEST(ScanCheckpoint, ResumeSkipsCompletedDirs) {
+  TmpDir t, db_dir;
+  t.CreateFile("a/x", "x");
+  t.CreateFile("b/y", "y");
+  const std::string db = db_dir.dir_ + "/cache.sqlite3";
+  const path root(t.dir_);
+  {
+    // Pretend that the scan got interrupted after completing "a".
+    HashCache::Initializer hash_cache_init("", db);
+    ScanCheckpoint checkpoint(db, root, false, std::chrono::seconds(0));
+    HashCache::Get()(root / "a/x");
+    checkpoint.DirCompleted(root / "a", DirListing{{}, {"x"}});
+    checkpoint.Store();
+  }
+  // Completed directories are not listed again, so this should go unnoticed.
+  t.CreateFile("a/z", "z");
+  {
+    HashCache::Initializer hash_cache_init("", db, true);
+    ScanCheckpoint checkpoint(db, root, true, std::chrono::seconds(0));
+    ASSERT_NE(checkpoint.Completed(root / "a"), nullptr);
+    ASSERT_EQ(checkpoint.Completed(root / "b"), nullptr);
+    PathsProcessor p;
+    ScanDirectory(root, p, ScanFilter(), &checkpoint);
+    const std::set<std::string> expected{
+        root.native(), (root / "a").native(), (root / "a/x").native(),
+        (root / "b").native(), (root / "b/y").native()};
+    ASSERT_EQ(p.paths_, expected);
+  }
+  // The checkpoint is discarded once the scan is complete.
+  HashCache::Initializer hash_cache_init("", db, true);
+  ScanCheckpoint checkpoint(db, root, true, std::chrono::seconds(0));
+  ASSERT_EQ(checkpoint.Completed(root / "a"), nullptr);
+}
+
+TEST(ScanCheckpoint, ReplayErrorSkipsDir) {
+  // Fails to create directory "a".
+  class FailingProcessor : public PathsProcessor {
+   public:
+    path Dir(const path &p, const path &parent) override {
+      if (p == "a") {
+        throw std::runtime_error("no space for \"a\"");
+      }
+      return PathsProcessor::Dir(p, parent);
+    }
+  };
+  TmpDir t, db_dir;
+  t.CreateFile("a/x", "x");
+  t.CreateFile("b/y", "y");
+  const std::string db = db_dir.dir_ + "/cache.sqlite3";
+  const path root(t.dir_);
+  {
+    HashCache::Initializer hash_cache_init("", db);
+    ScanCheckpoint checkpoint(db, root, false, std::chrono::seconds(0));
+    HashCache::Get()(root / "a/x");
+    checkpoint.DirCompleted(root / "a", DirListing{{}, {"x"}});
+    checkpoint.Store();
+  }
+  HashCache::Initializer hash_cache_init("", db, true);
+  ScanCheckpoint checkpoint(db, root, true, std::chrono::seconds(0));
+  FailingProcessor p;
+  // "a" is replayed from the checkpoint, which fails, so it is skipped.
+  ScanDirectory(root, p, ScanFilter(), &checkpoint);
+  const std::set<std::string> expected{root.native(), (root / "b").native(),
+                                       (root / "b/y").native()};
+  ASSERT_EQ(p.paths_, expected);
+}
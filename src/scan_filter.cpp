@@ -0,0 +1,97 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "scan_filter.h"
+
+#include <fnmatch.h>
+
+#include <utility>
+
+#include "conf.h"
+
+namespace {
+
+bool GlobMatches(const std::string &pattern,
+                 const boost::filesystem::path &path) {
+  const std::string subject = (pattern.find('/') == std::string::npos)
+                                  ? path.filename().native()
+                                  : path.native();
+  return fnmatch(pattern.c_str(), subject.c_str(), 0) == 0;
+}
+
+bool AnyGlobMatches(const std::vector<std::string> &patterns,
+                    const boost::filesystem::path &path) {
+  for (const auto &pattern : patterns) {
+    if (GlobMatches(pattern, path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // anonymous namespace
+
+ScanFilter::ScanFilter(std::vector<std::string> exclude,
+                       const std::vector<std::string> &exclude_regex,
+                       std::vector<std::string> include, off_t min_size,
+                       off_t max_size, bool one_file_system)
+    : exclude_(std::move(exclude)),
+      include_(std::move(include)),
+      min_size_(min_size),
+      max_size_(max_size),
+      one_file_system_(one_file_system) {
+  for (const auto &re : exclude_regex) {
+    // Throws std::regex_error on malformed expressions, which is what we want
+    // - better fail early than scan for hours without the filter.
+    exclude_regex_.emplace_back(re, std::regex::extended | std::regex::nosubs);
+  }
+}
+
+ScanFilter ScanFilter::FromConf() {
+  return ScanFilter(Conf().exclude_, Conf().exclude_regex_, Conf().include_,
+                    Conf().min_size_, Conf().max_size_,
+                    Conf().one_file_system_);
+}
+
+bool ScanFilter::Excluded(const boost::filesystem::path &path) const {
+  if (AnyGlobMatches(exclude_, path)) {
+    return true;
+  }
+  for (const auto &re : exclude_regex_) {
+    if (std::regex_search(path.native(), re)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ScanFilter::AcceptsDir(const boost::filesystem::path &path) const {
+  return !Excluded(path);
+}
+
+bool ScanFilter::AcceptsFile(const boost::filesystem::path &path) const {
+  if (Excluded(path)) {
+    return false;
+  }
+  return include_.empty() || AnyGlobMatches(include_, path);
+}
+
+bool ScanFilter::AcceptsSize(off_t size) const {
+  return size >= min_size_ && (max_size_ == 0 || size <= max_size_);
+}
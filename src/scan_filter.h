@@ -0,0 +1,73 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_SCAN_FILTER_H_
+#define SRC_SCAN_FILTER_H_
+
+#include <sys/types.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+// Decides which entries should be skipped while scanning. Skipped directories
+// are not descended into and skipped files are not hashed at all.
+//
+// Glob patterns are matched with fnmatch(3). A pattern containing a '/' is
+// matched against the whole path, otherwise only against the file name.
+// Regular expressions are searched for in the whole path.
+class ScanFilter {
+ public:
+  // Accepts everything.
+  ScanFilter() = default;
+  ScanFilter(std::vector<std::string> exclude,
+             const std::vector<std::string> &exclude_regex,
+             std::vector<std::string> include, off_t min_size, off_t max_size,
+             bool one_file_system);
+
+  static ScanFilter FromConf();
+
+  // Both directories and files matching any of the exclude patterns are
+  // skipped.
+  bool AcceptsDir(const boost::filesystem::path &path) const;
+  // If include patterns are specified, only files matching at least one of
+  // them are considered. This only examines the path; check the size using
+  // AcceptsSize().
+  bool AcceptsFile(const boost::filesystem::path &path) const;
+  bool AcceptsSize(off_t size) const;
+  // Whether AcceptsSize() can reject anything, i.e. whether it's worth
+  // obtaining the file size before deciding whether to hash a file.
+  bool FiltersBySize() const { return min_size_ > 0 || max_size_ > 0; }
+  // Whether the scan should not cross filesystem boundaries.
+  bool OneFileSystem() const { return one_file_system_; }
+
+ private:
+  bool Excluded(const boost::filesystem::path &path) const;
+
+  std::vector<std::string> exclude_;
+  std::vector<std::regex> exclude_regex_;
+  std::vector<std::string> include_;
+  off_t min_size_{};
+  off_t max_size_{};  // 0 means no limit
+  bool one_file_system_{};
+};
+
+#endif  // SRC_SCAN_FILTER_H_
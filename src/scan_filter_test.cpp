@@ -0,0 +1,84 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "scan_filter.h"
+
+#include <regex>
+
+#include "gtest/gtest.h"
+
+TEST(ScanFilter, AcceptsEverythingByDefault) {
+  ScanFilter f;
+  ASSERT_TRUE(f.AcceptsDir("/a/.git"));
+  ASSERT_TRUE(f.AcceptsFile("/a/b"));
+  ASSERT_TRUE(f.AcceptsSize(0));
+  ASSERT_FALSE(f.FiltersBySize());
+  ASSERT_FALSE(f.OneFileSystem());
+}
+
+TEST(ScanFilter, GlobMatchesFileName) {
+  ScanFilter f({".git", "*.o"}, {}, {}, 0, 0, false);
+  ASSERT_FALSE(f.AcceptsDir("/a/.git"));
+  ASSERT_TRUE(f.AcceptsDir("/a/.git2"));
+  ASSERT_TRUE(f.AcceptsDir("/.git/a"));
+  ASSERT_FALSE(f.AcceptsFile("/a/b.o"));
+  ASSERT_TRUE(f.AcceptsFile("/a.o/b"));
+}
+
+TEST(ScanFilter, GlobWithSlashMatchesWholePath) {
+  ScanFilter f({"*/build/*"}, {}, {}, 0, 0, false);
+  ASSERT_FALSE(f.AcceptsDir("/a/build/x"));
+  ASSERT_FALSE(f.AcceptsFile("/a/build/x/y"));
+  ASSERT_TRUE(f.AcceptsDir("/a/build"));
+}
+
+TEST(ScanFilter, Regex) {
+  ScanFilter f({}, {"node_modules$", "\\.tmp$"}, {}, 0, 0, false);
+  ASSERT_FALSE(f.AcceptsDir("/a/node_modules"));
+  ASSERT_TRUE(f.AcceptsDir("/a/node_modules2"));
+  ASSERT_FALSE(f.AcceptsFile("/a/b.tmp"));
+  ASSERT_TRUE(f.AcceptsFile("/a/b.tmp2"));
+}
+
+TEST(ScanFilter, BadRegex) {
+  ASSERT_THROW(ScanFilter({}, {"("}, {}, 0, 0, false), std::regex_error);
+}
+
+TEST(ScanFilter, IncludeOnlyAffectsFiles) {
+  ScanFilter f({"*.bak"}, {}, {"*.jpg", "*.bak"}, 0, 0, false);
+  ASSERT_TRUE(f.AcceptsDir("/a/b"));
+  ASSERT_TRUE(f.AcceptsFile("/a/b.jpg"));
+  ASSERT_FALSE(f.AcceptsFile("/a/b.png"));
+  // Exclusion wins.
+  ASSERT_FALSE(f.AcceptsFile("/a/b.bak"));
+}
+
+TEST(ScanFilter, Size) {
+  ScanFilter min({}, {}, {}, 4096, 0, false);
+  ASSERT_TRUE(min.FiltersBySize());
+  ASSERT_FALSE(min.AcceptsSize(4095));
+  ASSERT_TRUE(min.AcceptsSize(4096));
+  ASSERT_TRUE(min.AcceptsSize(1L << 40));
+
+  ScanFilter max({}, {}, {}, 0, 10, false);
+  ASSERT_TRUE(max.FiltersBySize());
+  ASSERT_TRUE(max.AcceptsSize(1));
+  ASSERT_TRUE(max.AcceptsSize(10));
+  ASSERT_FALSE(max.AcceptsSize(11));
+}
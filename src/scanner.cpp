@@ -19,17 +19,187 @@
 
 #include "scanner_int.h"
 
+#include <sys/stat.h>
+#include <cerrno>
+
+#include <algorithm>
+#include <chrono>
 #include <iterator>
 
+#include "db_lib_impl.h"
+#include "exceptions.h"
+
 namespace detail {
 
 using boost::filesystem::path;
 
-path CommonPathPrefix(const path &p1, const path &p2) {
-  path res;
-  for (path::const_iterator p1i = p1.begin(), p2i = p2.begin();
-       p1i != p1.end() && p2i != p2.end() && *p1i == *p2i; ++p1i, ++p2i) {
-    res = res.empty() ? *p1i : (res / *p1i);
+namespace {
+
+constexpr int64_t kDirMtimeSlackNs = 1000000000;
+
+}  // namespace
+
+bool IsPathPrefix(const std::string &dir, const std::string &p) {
+  if (dir.empty()) {
+    return true;
+  }
+  if (p.compare(0, dir.size(), dir) != 0) {
+    return false;
+  }
+  return p.size() == dir.size() || dir.back() == '/' || p[dir.size()] == '/';
+}
+
+std::string ParentDir(const std::string &p) {
+  const size_t pos = p.rfind('/');
+  if (pos == std::string::npos || p == "/") {
+    return std::string();
+  }
+  return pos == 0 ? std::string("/") : p.substr(0, pos);
+}
+
+struct stat Stat(const path &p) {
+  struct stat st;
+  if (stat(p.native().c_str(), &st) != 0) {
+    throw FsException(errno, "stat on '" + p.native() + "'");
+  }
+  return st;
+}
+
+dev_t DeviceOf(const path &p) { return Stat(p).st_dev; }
+
+off_t SizeHint(const path &p) {
+  const std::optional<FileInfo> cached = HashCache::Get().Lookup(p);
+  if (cached) {
+    return cached->size_;
+  }
+  struct stat st;
+  return stat(p.native().c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+DirListing ListDir(const path &dir, const struct stat &st) {
+  const int64_t mtime_ns = MtimeNs(st);
+  std::optional<DirListing> cached =
+      HashCache::Get().LookupDir(dir, st.st_ino, mtime_ns);
+  if (cached) {
+    DLOG("Reusing listing of " << dir.native());
+    return std::move(*cached);
+  }
+
+  const int64_t now_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  DirListing listing;
+  using boost::filesystem::directory_iterator;
+  for (directory_iterator it(dir); it != directory_iterator(); ++it) {
+    try {
+      if (is_symlink(it->path())) {
+        continue;
+      }
+      if (is_directory(it->status())) {
+        listing.dirs_.push_back(it->path().filename().native());
+      } else if (is_regular_file(it->status())) {
+        listing.files_.push_back(it->path().filename().native());
+      }
+    } catch (const std::exception &e) {
+      LOG(ERROR, "skipping \"" << it->path().native()
+                               << "\" because analyzing it yielded "
+                               << e.what());
+    }
+  }
+  // Filesystem timestamps are coarse, so a directory modified within the same
+  // tick as it was listed could keep its mtime. Don't trust such listings.
+  if (mtime_ns < now_ns - kDirMtimeSlackNs) {
+    HashCache::Get().StoreDir(dir, DirInfo(st.st_ino, mtime_ns, listing));
+  }
+  return listing;
+}
+
+bool AcceptsDbEntry(const ScanFilter &filter, const std::string &native,
+                    const FileInfo &f_info, const std::string &root) {
+  if (!filter.AcceptsFile(path(native)) || !filter.AcceptsSize(f_info.size_)) {
+    return false;
+  }
+  // root is a prefix of all the ancestors, so the ones below it are longer.
+  for (std::string dir = ParentDir(native); dir.size() > root.size();
+       dir = ParentDir(dir)) {
+    if (!filter.AcceptsDir(path(dir))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string DbRoot(DBConnection &db) {
+  const auto [first, last] =
+      db.Query<std::string, std::string>(
+            "SELECT IFNULL(MIN(path), ''), IFNULL(MAX(path), '') "
+            "FROM FileList")
+          .Read();
+  std::string root = ParentDir(first);
+  ShrinkToCommonDir(root, ParentDir(last));
+  return root;
+}
+
+std::optional<std::string> FirstAcceptedDbPath(DBConnection &db,
+                                               const ScanFilter &filter,
+                                               const std::string &root,
+                                               bool reverse) {
+  for (const auto &[path, size] : db.Query<std::string, off_t>(
+           std::string("SELECT path, size FROM FileList ORDER BY path ") +
+           (reverse ? "DESC" : "ASC"))) {
+    if (AcceptsDbEntry(filter, path, FileInfo(size, 0, 0), root)) {
+      return path;
+    }
+  }
+  return std::nullopt;
+}
+
+std::vector<std::string> SampleDbPathBoundaries(DBConnection &db,
+                                                size_t max_rows) {
+  const auto [min_rowid, max_rowid] =
+      db.Query<int64_t, int64_t>(
+            "SELECT IFNULL(MIN(rowid), 0), IFNULL(MAX(rowid), -1) "
+            "FROM FileList")
+          .Read();
+  // Rowids may have gaps, but this is only about balancing the work.
+  const int64_t num_rows = max_rowid - min_rowid + 1;
+  const int64_t num_ranges = (num_rows + max_rows - 1) / max_rows;
+  std::vector<std::string> boundaries;
+  for (int64_t i = 1; i < num_ranges; ++i) {
+    const int64_t rowid = min_rowid + num_rows * i / num_ranges;
+    for (const auto &[path] : db.Query<std::string>(
+             "SELECT path FROM FileList WHERE rowid >= ? ORDER BY rowid "
+             "LIMIT 1",
+             rowid)) {
+      boundaries.push_back(path);
+    }
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+  boundaries.erase(std::unique(boundaries.begin(), boundaries.end()),
+                   boundaries.end());
+  return boundaries;
+}
+
+std::vector<std::pair<std::string, FileInfo>> ReadDbPathRange(
+    const path &db_path, const ScanFilter &filter, const std::string &root,
+    const std::string &begin, const std::optional<std::string> &end) {
+  std::vector<std::pair<std::string, FileInfo>> res;
+  DBConnection db(db_path.native(), SQLITE_OPEN_READONLY);
+  auto rows =
+      end ? db.Query<std::string, Cksum, off_t, time_t>(
+                "SELECT path, cksum, size, mtime FROM FileList "
+                "WHERE path >= ? AND path < ? ORDER BY path",
+                begin, *end)
+          : db.Query<std::string, Cksum, off_t, time_t>(
+                "SELECT path, cksum, size, mtime FROM FileList "
+                "WHERE path >= ? ORDER BY path",
+                begin);
+  for (const auto &[path, sum, size, mtime] : rows) {
+    const FileInfo f_info(size, mtime, sum);
+    if (AcceptsDbEntry(filter, path, f_info, root)) {
+      res.emplace_back(path, f_info);
+    }
   }
   return res;
 }
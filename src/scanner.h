@@ -22,16 +22,35 @@
 
 #include <cstdint>
 
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <boost/filesystem/path.hpp>
 
 #include "hash_cache.h"  // for cksum
+#include "scan_filter.h"
+
+class ScanCheckpoint;
+
+// A regular file handed over to a ScanProcessor.
+struct FileRecord {
+  FileRecord(std::string name, const FileInfo &f_info)
+      : name_(std::move(name)), f_info_(f_info) {}
+
+  std::string name_;  // only the file name, without the directory part
+  FileInfo f_info_;
+};
+
+using FileRecords = std::vector<FileRecord>;
 
 // DIR_HANDLE can be whatever provided that it has proper value semantics.
 template <class DIR_HANDLE>
 class ScanProcessor {
  public:
-  virtual void File(const boost::filesystem::path &path,
-                    const DIR_HANDLE &parent, const FileInfo &f_info) = 0;
+  // All files in "files" reside directly in "parent". Files of a single
+  // directory may be split into more than one batch.
+  virtual void Files(const DIR_HANDLE &parent, const FileRecords &files) = 0;
   virtual DIR_HANDLE RootDir(const boost::filesystem::path &path) = 0;
   virtual DIR_HANDLE Dir(const boost::filesystem::path &path,
                          const DIR_HANDLE &parent) = 0;
@@ -40,17 +59,57 @@ class ScanProcessor {
 
 // Will scan directory root and call appropriate methods of ScanProcessor. They
 // will be called from multiple threads, but one at a time (serialized).
+// Entries rejected by filter are neither descended into nor hashed.
+template <class DIR_HANDLE>
+void ScanDirectory(const boost::filesystem::path &root,
+                   ScanProcessor<DIR_HANDLE> &processor,
+                   const ScanFilter &filter);
+
+// Same as above, recording progress in checkpoint, if set. If checkpoint holds
+// directories scanned before the scan was resumed, they are not listed again.
+// The other overloads create the checkpoint according to the global
+// configuration.
+template <class DIR_HANDLE>
+void ScanDirectory(const boost::filesystem::path &root,
+                   ScanProcessor<DIR_HANDLE> &processor,
+                   const ScanFilter &filter, ScanCheckpoint *checkpoint);
+
+// Same as above, filtering according to the global configuration.
 template <class DIR_HANDLE>
 void ScanDirectory(const boost::filesystem::path &root,
                    ScanProcessor<DIR_HANDLE> &processor);
 
+template <class DIR_HANDLE>
+struct ScanRoot {
+  boost::filesystem::path path_;
+  ScanProcessor<DIR_HANDLE> *processor_;
+  ScanCheckpoint *checkpoint_;  // may be null
+};
+
+// Same as ScanDirectory(), but scans all roots at once, sharing the threads
+// which list directories and hash files, so that one tree's large files don't
+// hold up the others. Each root reports to its own processor; calls to all of
+// them are serialized together.
+template <class DIR_HANDLE>
+void ScanDirectories(const std::vector<ScanRoot<DIR_HANDLE>> &roots,
+                     const ScanFilter &filter);
+
 template <class DIR_HANDLE>
 void ScanDb(const boost::filesystem::path &db_path,
-            ScanProcessor<DIR_HANDLE> &processor);
+            ScanProcessor<DIR_HANDLE> &processor, const ScanFilter &filter);
 
 // Will call one of the 2 above.
 template <class DIR_HANDLE>
 void ScanDirectoryOrDb(const std::string &path,
                        ScanProcessor<DIR_HANDLE> &processor);
 
+// Same as above for many paths, each reporting to the respective processor.
+// Directories are scanned together by ScanDirectories(), while every database
+// is read by its own thread, so processors of databases may be called
+// concurrently with other processors.
+template <class DIR_HANDLE>
+void ScanDirectoriesOrDbs(
+    const std::vector<std::string> &paths,
+    const std::vector<ScanProcessor<DIR_HANDLE> *> &processors);
+
 #endif  // SRC_SCANNER_H_
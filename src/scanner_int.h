@@ -22,88 +22,442 @@
 
 #include "scanner.h"
 
-#include <map>
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
-#include <stack>
 #include <thread>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include <boost/filesystem/convenience.hpp>
 
+#include "concurrency_tuner.h"
 #include "conf.h"
+#include "db_lib_impl.h"
 #include "hash_cache.h"
 #include "log.h"
+#include "scan_checkpoint.h"
 #include "synch_thread_pool.h"
 
 namespace detail {
 
-boost::filesystem::path CommonPathPrefix(const boost::filesystem::path &p1,
-                                         const boost::filesystem::path &p2);
+// Whether dir is p or one of its ancestors. Operates on strings only, so
+// "a/./b" is not considered to be under "a/b".
+bool IsPathPrefix(const std::string &dir, const std::string &p);
+
+// The directory part of p; "/" for files in root and an empty string for
+// paths without any directory part.
+std::string ParentDir(const std::string &p);
+
+// stat(2) wrapper. Throws FsException on failure.
+struct stat Stat(const boost::filesystem::path &path);
+
+// Device on which path resides. Throws FsException on failure.
+dev_t DeviceOf(const boost::filesystem::path &path);
+
+// Subdirectories and regular files in dir, whose stat(2) result is st. Symlinks
+// are skipped. If the directory's inode and mtime match what HashCache has
+// stored, the stored listing is returned without reading the directory.
+// Throws if the directory can't be read.
+DirListing ListDir(const boost::filesystem::path &dir, const struct stat &st);
+
+// Whether a file read from a database should be taken into account. Unlike
+// in case of ScanDirectory(), the file's ancestors are checked too, but only
+// those below root, which is the directory containing all of the database's
+// files; like the scanned directory, it and its ancestors are never filtered.
+bool AcceptsDbEntry(const ScanFilter &filter, const std::string &native,
+                    const FileInfo &f_info, const std::string &root);
+
+// Files of a single directory, which are collected while they are being hashed
+// so that they can be handed over to the ScanProcessor in one go.
+template <class DIR_HANDLE>
+class FileBatch {
+ public:
+  // If checkpoint is set, it is notified once the directory is complete.
+  FileBatch(DIR_HANDLE handle, boost::filesystem::path dir,
+            ScanCheckpoint *checkpoint)
+      : handle_(std::move(handle)),
+        dir_(std::move(dir)),
+        checkpoint_(checkpoint) {}
+
+  // Record a subdirectory for the checkpoint.
+  void AddDir(const std::string &name) {
+    if (checkpoint_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      listing_.dirs_.push_back(name);
+    }
+  }
+  // Every file submitted for hashing has to be matched by exactly one Done()
+  // call. The batch is flushed once the last file is done and the directory
+  // listing is Closed().
+  void Expect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++outstanding_;
+  }
+  void Done(std::optional<FileRecord> &&file, std::mutex &processor_mutex,
+            ScanProcessor<DIR_HANDLE> &processor) {
+    FileRecords to_flush;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (file) {
+        files_.push_back(std::move(*file));
+      }
+      assert(outstanding_ > 0);
+      if (--outstanding_ != 0) {
+        return;
+      }
+      to_flush.swap(files_);
+    }
+    if (!to_flush.empty()) {
+      std::lock_guard<std::mutex> lock(processor_mutex);
+      processor.Files(handle_, to_flush);
+    }
+    if (checkpoint_) {
+      for (const FileRecord &f : to_flush) {
+        listing_.files_.push_back(f.name_);
+      }
+      checkpoint_->DirCompleted(dir_, std::move(listing_));
+    }
+  }
+  void Close(std::mutex &processor_mutex,
+             ScanProcessor<DIR_HANDLE> &processor) {
+    Done(std::nullopt, processor_mutex, processor);
+  }
+
+ private:
+  const DIR_HANDLE handle_;
+  const boost::filesystem::path dir_;
+  ScanCheckpoint *const checkpoint_;
+  std::mutex mutex_;
+  FileRecords files_;
+  DirListing listing_;
+  // The directory listing itself counts as one outstanding item.
+  size_t outstanding_{1};
+};
+
+// The longest directory containing all files in FileList.
+std::string DbRoot(DBConnection &db);
+
+// The path of the first (or last if reverse is set) file in FileList, which is
+// accepted by filter. root is as in AcceptsDbEntry().
+std::optional<std::string> FirstAcceptedDbPath(DBConnection &db,
+                                               const ScanFilter &filter,
+                                               const std::string &root,
+                                               bool reverse);
+
+// Splits FileList into ranges of paths holding roughly max_rows rows each,
+// based on a sample of rows. Returns the boundaries between the ranges, sorted.
+std::vector<std::string> SampleDbPathBoundaries(DBConnection &db,
+                                                size_t max_rows);
+
+// Files from FileList accepted by filter, whose paths are in [begin, end),
+// sorted by path. Lack of end means no upper bound. root is as in
+// AcceptsDbEntry().
+std::vector<std::pair<std::string, FileInfo>> ReadDbPathRange(
+    const boost::filesystem::path &db_path, const ScanFilter &filter,
+    const std::string &root, const std::string &begin,
+    const std::optional<std::string> &end);
+
+// Size of p for the purpose of scheduling - taken from HashCache if it's
+// there or from stat(2) otherwise; 0 if neither works.
+off_t SizeHint(const boost::filesystem::path &p);
+
+// A thread-safe queue of items, which pops the one with the largest size
+// first.
+template <class T>
+class LargestFirstQueue {
+ public:
+  void Push(off_t size, T item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    heap_.emplace_back(size, std::move(item));
+    std::push_heap(heap_.begin(), heap_.end(), Cmp);
+  }
+  // The queue must not be empty.
+  T Pop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(!heap_.empty());
+    std::pop_heap(heap_.begin(), heap_.end(), Cmp);
+    T res = std::move(heap_.back().second);
+    heap_.pop_back();
+    return res;
+  }
+
+ private:
+  static bool Cmp(const std::pair<off_t, T> &a, const std::pair<off_t, T> &b) {
+    return a.first < b.first;
+  }
+
+  std::mutex mutex_;
+  std::vector<std::pair<off_t, T>> heap_;
+};
+
+// Builds the tree out of files sorted by their paths. Sorting makes every
+// directory's subtree a contiguous range, so only the stack of directories
+// leading to the current file has to be kept - a directory is handed over to
+// the ScanProcessor as soon as the first file outside of it shows up.
+template <class DIR_HANDLE>
+class SortedFilesTreeBuilder {
+ public:
+  // root has to be a prefix of all files' directories.
+  SortedFilesTreeBuilder(const std::string &root,
+                         ScanProcessor<DIR_HANDLE> &processor)
+      : processor_(processor) {
+    stack_.push_back(DirState{root, processor_.RootDir(root), FileRecords()});
+  }
+
+  void AddFile(const std::string &native, const FileInfo &f_info) {
+    const std::string parent = ParentDir(native);
+    if (parent != stack_.back().path_) {
+      while (!IsPathPrefix(stack_.back().path_, parent)) {
+        assert(stack_.size() > 1);
+        Pop();
+      }
+      size_t start = stack_.back().path_.size();
+      while (start < parent.size()) {
+        if (parent[start] == '/') {
+          ++start;
+          continue;
+        }
+        size_t end = parent.find('/', start);
+        if (end == std::string::npos) {
+          end = parent.size();
+        }
+        DIR_HANDLE handle = processor_.Dir(parent.substr(start, end - start),
+                                           stack_.back().handle_);
+        stack_.push_back(
+            DirState{parent.substr(0, end), std::move(handle), FileRecords()});
+        start = end;
+      }
+    }
+    // parent may be "/" or empty, so it can't tell where the name starts.
+    stack_.back().files_.emplace_back(native.substr(native.rfind('/') + 1),
+                                      f_info);
+  }
+
+  void Finish() {
+    while (!stack_.empty()) {
+      Pop();
+    }
+  }
+
+ private:
+  struct DirState {
+    std::string path_;
+    DIR_HANDLE handle_;
+    FileRecords files_;
+  };
+
+  void Pop() {
+    const DirState &top = stack_.back();
+    if (!top.files_.empty()) {
+      processor_.Files(top.handle_, top.files_);
+    }
+    stack_.pop_back();
+  }
+
+  ScanProcessor<DIR_HANDLE> &processor_;
+  std::vector<DirState> stack_;
+};
+
+// Shrinks prefix to the longest directory being prefix of both itself and
+// dir.
+inline void ShrinkToCommonDir(std::string &prefix, const std::string &dir) {
+  while (!IsPathPrefix(prefix, dir)) {
+    prefix = ParentDir(prefix);
+  }
+}
 
 }  // namespace detail
 
+// Number of files the scan can discover ahead of hashing them.
+constexpr size_t kMaxQueuedHashes = 1 << 16;
+
+// Number of rows of a db: input read by a single thread.
+constexpr size_t kDbRowsPerRange = 1 << 16;
+
 template <class DIR_HANDLE>
-void ScanDirectory(const boost::filesystem::path &root,
-                   ScanProcessor<DIR_HANDLE> &processor) {
+void ScanDirectories(const std::vector<ScanRoot<DIR_HANDLE>> &roots,
+                     const ScanFilter &filter) {
   using boost::filesystem::path;
+  using Batch = detail::FileBatch<DIR_HANDLE>;
 
-  // The path to directory and handle to its parent. In case of root directory,
-  // empty option is held.
-  std::stack<std::pair<path, std::optional<DIR_HANDLE>>> dirs_to_process;
-  dirs_to_process.push(std::make_pair(root, std::optional<DIR_HANDLE>()));
+  // What every directory's task needs to know about its root.
+  struct RootContext {
+    ScanProcessor<DIR_HANDLE> *processor_;
+    ScanCheckpoint *checkpoint_;
+    dev_t dev_;
+  };
+  std::vector<RootContext> contexts;
+  std::vector<path> scanned;
+  for (const ScanRoot<DIR_HANDLE> &root : roots) {
+    dev_t root_dev = 0;
+    if (filter.OneFileSystem()) {
+      try {
+        root_dev = detail::DeviceOf(root.path_);
+      } catch (const std::exception &e) {
+        LOG(ERROR, "skipping \"" << root.path_.native()
+                                 << "\" because descending into it yielded "
+                                 << e.what());
+        continue;
+      }
+    }
+    contexts.push_back(
+        RootContext{root.processor_, root.checkpoint_, root_dev});
+    scanned.push_back(root.path_);
+  }
+  if (contexts.empty()) {
+    return;
+  }
 
-  SyncThreadPool pool(Conf().concurrency_);
-  std::mutex mutex;
+  // Hashing a huge file found at the end of the scan would make everything
+  // wait for it, so directory traversal runs ahead of hashing and the largest
+  // of the discovered files are hashed first. Every submitted task hashes
+  // whichever file is the largest at the time it runs, no matter which root
+  // it is in.
+  SyncThreadPool pool(Conf().concurrency_, kMaxQueuedHashes);
+  std::unique_ptr<ConcurrencyTuner> tuner;
+  if (Conf().auto_concurrency_) {
+    tuner = std::make_unique<ConcurrencyTuner>(pool, kInitialAutoConcurrency,
+                                               Conf().concurrency_);
+  }
+  detail::LargestFirstQueue<
+      std::tuple<path, std::shared_ptr<Batch>, ScanProcessor<DIR_HANDLE> *>>
+      hash_queue;
+  std::mutex mutex;  // serializes calls to all processors
 
-  while (!dirs_to_process.empty()) {
-    const path dir = dirs_to_process.top().first;
-    const auto maybe_parent_handle = dirs_to_process.top().second;
+  auto create_handle = [&mutex](
+                           const RootContext &root, const path &dir,
+                           const std::optional<DIR_HANDLE> &parent_handle) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return parent_handle.has_value()
+               ? root.processor_->Dir(dir.filename(), parent_handle.value())
+               : root.processor_->RootDir(dir);
+  };
+  auto hash_file = [&pool, &hash_queue, &mutex, &tuner](
+                       const RootContext &root, const path &new_path,
+                       const std::shared_ptr<Batch> &batch) {
+    batch->Expect();
+    hash_queue.Push(detail::SizeHint(new_path),
+                    std::make_tuple(new_path, batch, root.processor_));
+    pool.Submit([&hash_queue, &mutex, tuner = tuner.get()]() {
+      const auto [new_path, batch, processor] = hash_queue.Pop();
+      std::optional<FileRecord> file;
+      try {
+        const FileInfo f_info = HashCache::Get()(new_path);
+        if (tuner) {
+          tuner->FileProcessed(f_info.size_);
+        }
+        if (f_info.sum_) {
+          file.emplace(new_path.filename().native(), f_info);
+        }
+      } catch (const std::exception &e) {
+        LOG(ERROR, "skipping \"" << new_path.native()
+                                 << "\" because analyzing it yielded "
+                                 << e.what());
+      }
+      batch->Done(std::move(file), mutex, *processor);
+    });
+  };
 
-    dirs_to_process.pop();
+  // Directories are read by a pool of their own, so that many of them can be
+  // in flight at once - with network filesystems it's the latency of every
+  // single readdir and stat which limits the scan, not the throughput. A
+  // directory's task submits tasks for its subdirectories once it has
+  // created its handle, so parents are always created before children.
+  SyncThreadPool list_pool(Conf().list_concurrency_);
+  SyncCounter dirs_pending;
+  std::function<void(const RootContext &, const path &,
+                     const std::optional<DIR_HANDLE> &)>
+      process_dir;
+  auto submit_dir = [&list_pool, &dirs_pending, &process_dir](
+                        const RootContext &root, const path &new_path,
+                        const std::optional<DIR_HANDLE> &handle) {
+    list_pool.Submit(
+        [&process_dir, &root, new_path, handle]() {
+          process_dir(root, new_path, handle);
+        },
+        &dirs_pending);
+  };
 
-    using boost::filesystem::directory_iterator;
+  // The handle to the parent is empty in case of root directory.
+  process_dir = [&](const RootContext &root, const path &dir,
+                    const std::optional<DIR_HANDLE> &maybe_parent_handle) {
+    ScanCheckpoint *const checkpoint = root.checkpoint_;
+    const DirListing *completed =
+        checkpoint ? checkpoint->Completed(dir) : nullptr;
+    std::shared_ptr<Batch> batch;
     try {
-      // Create the iterator before the loop so that we get an exception here if
-      // we have no access to the directory.
-      directory_iterator it(dir);
-      // Add this directory only after we made sure we can browse it.
-      DIR_HANDLE handle;
-      {
-        std::lock_guard<std::mutex> lock(mutex);
-        handle =
-            maybe_parent_handle.has_value()
-                ? processor.Dir(dir.filename(), maybe_parent_handle.value())
-                : processor.RootDir(dir);
-      }
-      for (; it != directory_iterator(); ++it) {
-        try {
-          if (is_symlink(it->path())) {
-            continue;
+      if (completed) {
+        // Scanned before the scan was resumed - replay it without touching
+        // the filesystem, unless some checksum is missing from the cache.
+        const DIR_HANDLE handle = create_handle(root, dir, maybe_parent_handle);
+        batch = std::make_shared<Batch>(handle, dir, nullptr);
+        for (const auto &name : completed->dirs_) {
+          const path new_path = dir / name;
+          if (filter.AcceptsDir(new_path)) {
+            submit_dir(root, new_path, handle);
+          }
+        }
+        for (const auto &name : completed->files_) {
+          const path new_path = dir / name;
+          try {
+            if (!filter.AcceptsFile(new_path)) {
+              continue;
+            }
+            const std::optional<FileInfo> f_info =
+                HashCache::Get().Lookup(new_path);
+            if (!f_info) {
+              hash_file(root, new_path, batch);
+            } else if (f_info->sum_ && filter.AcceptsSize(f_info->size_)) {
+              batch->Expect();
+              batch->Done(FileRecord(name, *f_info), mutex, *root.processor_);
+            }
+          } catch (const std::exception &e) {
+            LOG(ERROR, "skipping \"" << new_path.native()
+                                     << "\" because analyzing it yielded "
+                                     << e.what());
           }
-          const path new_path = it->path();
-          if (is_directory(it->status())) {
-            std::lock_guard<std::mutex> lock(mutex);
-            dirs_to_process.push(std::make_pair(new_path, handle));
+        }
+      } else {
+        const struct stat st = detail::Stat(dir);
+        if (filter.OneFileSystem() && st.st_dev != root.dev_) {
+          return;
+        }
+        // Throws if we have no access to the directory.
+        const DirListing listing = detail::ListDir(dir, st);
+        // Add this directory only after we made sure we can browse it.
+        const DIR_HANDLE handle = create_handle(root, dir, maybe_parent_handle);
+        batch = std::make_shared<Batch>(handle, dir, checkpoint);
+        for (const auto &name : listing.dirs_) {
+          const path new_path = dir / name;
+          if (filter.AcceptsDir(new_path)) {
+            submit_dir(root, new_path, handle);
+            batch->AddDir(name);
           }
-          if (boost::filesystem::is_regular(new_path)) {
-            pool.Submit([new_path, handle, &mutex, &processor]() mutable {
-              try {
-                const FileInfo f_info = HashCache::Get()(new_path);
-                if (f_info.sum_) {
-                  std::lock_guard<std::mutex> lock(mutex);
-                  processor.File(new_path.filename(), handle, f_info);
-                }
-              } catch (const std::exception &e) {
-                LOG(ERROR, "skipping \"" << new_path.native()
-                                         << "\" because analyzing it yielded "
-                                         << e.what());
-              }
-            });
+        }
+        for (const auto &name : listing.files_) {
+          const path new_path = dir / name;
+          try {
+            if (!filter.AcceptsFile(new_path) ||
+                (filter.FiltersBySize() &&
+                 !filter.AcceptsSize(boost::filesystem::file_size(new_path)))) {
+              continue;
+            }
+            hash_file(root, new_path, batch);
+          } catch (const std::exception &e) {
+            LOG(ERROR, "skipping \"" << new_path.native()
+                                     << "\" because analyzing it yielded "
+                                     << e.what());
           }
-        } catch (const std::exception &e) {
-          LOG(ERROR, "skipping \"" << it->path().native()
-                                   << "\" because analyzing it yielded "
-                                   << e.what());
         }
       }
     } catch (const std::exception &e) {
@@ -111,64 +465,146 @@ void ScanDirectory(const boost::filesystem::path &root,
                                << "\" because descending into it yielded "
                                << e.what());
     }
+    if (batch) {
+      batch->Close(mutex, *root.processor_);
+    }
+  };
+
+  for (size_t i = 0; i < contexts.size(); ++i) {
+    submit_dir(contexts[i], scanned[i], std::nullopt);
+  }
+  dirs_pending.WaitForZero();
+  list_pool.Stop();
+  pool.Stop();
+  if (tuner) {
+    LOG(INFO, "Scanning concurrency settled at " << tuner->Level());
+  }
+  for (const auto &context : contexts) {
+    if (context.checkpoint_) {
+      context.checkpoint_->Finish();
+    }
   }
 }
 
 template <class DIR_HANDLE>
-void ScanDb(std::unordered_map<std::string, FileInfo> db,
-            ScanProcessor<DIR_HANDLE> &processor) {
-  using boost::filesystem::path;
+void ScanDirectory(const boost::filesystem::path &root,
+                   ScanProcessor<DIR_HANDLE> &processor,
+                   const ScanFilter &filter, ScanCheckpoint *checkpoint) {
+  ScanDirectories<DIR_HANDLE>({{root, &processor, checkpoint}}, filter);
+}
+
+template <class DIR_HANDLE>
+void ScanDirectory(const boost::filesystem::path &root,
+                   ScanProcessor<DIR_HANDLE> &processor,
+                   const ScanFilter &filter) {
+  std::unique_ptr<ScanCheckpoint> checkpoint = ScanCheckpoint::FromConf(root);
+  ScanDirectory(root, processor, filter, checkpoint.get());
+}
+
+template <class DIR_HANDLE>
+void ScanDirectory(const boost::filesystem::path &root,
+                   ScanProcessor<DIR_HANDLE> &processor) {
+  ScanDirectory(root, processor, ScanFilter::FromConf());
+}
 
+template <class DIR_HANDLE>
+void ScanDb(std::unordered_map<std::string, FileInfo> db,
+            ScanProcessor<DIR_HANDLE> &processor, const ScanFilter &filter) {
   if (db.empty()) {
     return;
   }
+  const auto [min_it, max_it] = std::minmax_element(
+      db.begin(), db.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::string root = detail::ParentDir(min_it->first);
+  detail::ShrinkToCommonDir(root, detail::ParentDir(max_it->first));
 
-  path common_prefix = path(db.begin()->first).parent_path();
-  for (const auto &path_and_fi : db) {
-    common_prefix = detail::CommonPathPrefix(
-        common_prefix, path(path_and_fi.first).parent_path());
-  }
-  const size_t prefix_len =
-      std::distance(common_prefix.begin(), common_prefix.end());
-
-  std::map<path, DIR_HANDLE> created_dirs;
-  created_dirs[common_prefix] = processor.RootDir(common_prefix);
-  for (const auto &path_and_fi : db) {
-    LOG(INFO, path_and_fi.first);
-    const path analyzed(path_and_fi.first);
-    const path dir(analyzed.parent_path());
-
-    path::const_iterator it = dir.begin();
-    for (size_t i = 0; i < prefix_len; ++i) {
-      ++it;
+  std::vector<std::pair<std::string, FileInfo>> files;
+  files.reserve(db.size());
+  for (auto &path_and_fi : db) {
+    if (detail::AcceptsDbEntry(filter, path_and_fi.first, path_and_fi.second,
+                               root)) {
+      files.emplace_back(path_and_fi.first, path_and_fi.second);
     }
+  }
+  if (files.empty()) {
+    return;
+  }
+  std::sort(files.begin(), files.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
 
-    path parent = common_prefix;
-    DIR_HANDLE parent_handle = created_dirs[common_prefix];
-
-    for (; it != dir.end(); ++it) {
-      const path to_insert = parent / *it;
-      auto created_dir_it = created_dirs.find(to_insert);
-      if (created_dir_it == created_dirs.end()) {
-        created_dir_it = created_dirs
-                             .insert(std::make_pair(
-                                 to_insert, processor.Dir(*it, parent_handle)))
-                             .first;
-      }
-      parent = to_insert;
-      parent_handle = created_dir_it->second;
-    }
-    processor.File(analyzed.filename(), parent_handle, path_and_fi.second);
+  std::string common_prefix = detail::ParentDir(files.front().first);
+  detail::ShrinkToCommonDir(common_prefix,
+                            detail::ParentDir(files.back().first));
+  detail::SortedFilesTreeBuilder<DIR_HANDLE> builder(common_prefix, processor);
+  for (const auto &path_and_fi : files) {
+    builder.AddFile(path_and_fi.first, path_and_fi.second);
   }
+  builder.Finish();
 }
 
 template <class DIR_HANDLE>
-void ScanDb(const boost::filesystem::path &db_path,
+void ScanDb(std::unordered_map<std::string, FileInfo> db,
             ScanProcessor<DIR_HANDLE> &processor) {
-  using boost::filesystem::path;
+  ScanDb(std::move(db), processor, ScanFilter::FromConf());
+}
+
+template <class DIR_HANDLE>
+void ScanDb(const boost::filesystem::path &db_path,
+            ScanProcessor<DIR_HANDLE> &processor, const ScanFilter &filter) {
+  // Rows are streamed in path order, so that the tree can be built without
+  // holding more than the current chain of directories in memory. With path
+  // order the root is the common prefix of the first and the last accepted
+  // file, which are cheap to find.
+  DBConnection db(db_path.native(), SQLITE_OPEN_READONLY);
+  const std::string root = detail::DbRoot(db);
+  const std::optional<std::string> first =
+      detail::FirstAcceptedDbPath(db, filter, root, false);
+  if (!first) {
+    return;
+  }
+  std::string common_prefix = detail::ParentDir(*first);
+  detail::ShrinkToCommonDir(
+      common_prefix,
+      detail::ParentDir(*detail::FirstAcceptedDbPath(db, filter, root, true)));
+
+  // Decoding and filtering is CPU-bound, so ranges of paths are read by
+  // separate threads. The tree is still built in order, so only a few ranges
+  // are read ahead.
+  const std::vector<std::string> boundaries =
+      detail::SampleDbPathBoundaries(db, kDbRowsPerRange);
+  const size_t lookahead = DbReaderThreads();
+  using Range = std::vector<std::pair<std::string, FileInfo>>;
+  std::deque<std::future<Range>> pending;
+  size_t next_range = 0;
+  auto read_next_range = [&]() {
+    const std::string begin =
+        next_range == 0 ? std::string() : boundaries[next_range - 1];
+    const std::optional<std::string> end =
+        next_range < boundaries.size()
+            ? std::make_optional(boundaries[next_range])
+            : std::nullopt;
+    pending.push_back(std::async(std::launch::async, detail::ReadDbPathRange,
+                                 db_path, std::cref(filter), std::cref(root),
+                                 begin, end));
+    ++next_range;
+  };
+  while (next_range <= boundaries.size() && pending.size() < lookahead) {
+    read_next_range();
+  }
 
-  auto db = ReadCacheFromDb(db_path.native());
-  ScanDb(db, processor);
+  detail::SortedFilesTreeBuilder<DIR_HANDLE> builder(common_prefix, processor);
+  while (!pending.empty()) {
+    const Range range = pending.front().get();
+    pending.pop_front();
+    if (next_range <= boundaries.size()) {
+      read_next_range();
+    }
+    for (const auto &path_and_fi : range) {
+      builder.AddFile(path_and_fi.first, path_and_fi.second);
+    }
+  }
+  builder.Finish();
 }
 
 // Will call one of the 2 above.
@@ -176,10 +612,59 @@ template <class DIR_HANDLE>
 void ScanDirectoryOrDb(const std::string &path,
                        ScanProcessor<DIR_HANDLE> &processor) {
   const std::string db_prefix = "db:";
+  const ScanFilter filter = ScanFilter::FromConf();
   if (!Conf().ignore_db_prefix_ && path.find(db_prefix) == 0) {
-    ScanDb(boost::filesystem::path(path.substr(db_prefix.length())), processor);
+    ScanDb(boost::filesystem::path(path.substr(db_prefix.length())), processor,
+           filter);
   } else {
-    ScanDirectory(path, processor);
+    ScanDirectory(path, processor, filter);
+  }
+}
+
+template <class DIR_HANDLE>
+void ScanDirectoriesOrDbs(
+    const std::vector<std::string> &paths,
+    const std::vector<ScanProcessor<DIR_HANDLE> *> &processors) {
+  assert(paths.size() == processors.size());
+  const std::string db_prefix = "db:";
+  const ScanFilter filter = ScanFilter::FromConf();
+  std::vector<std::future<void>> dbs;
+  std::vector<std::unique_ptr<ScanCheckpoint>> checkpoints;
+  std::vector<ScanRoot<DIR_HANDLE>> roots;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!Conf().ignore_db_prefix_ && paths[i].find(db_prefix) == 0) {
+      const boost::filesystem::path db_path(
+          paths[i].substr(db_prefix.length()));
+      ScanProcessor<DIR_HANDLE> &processor = *processors[i];
+      dbs.push_back(
+          std::async(std::launch::async, [&filter, db_path, &processor]() {
+            ScanDb(db_path, processor, filter);
+          }));
+    } else {
+      checkpoints.push_back(ScanCheckpoint::FromConf(paths[i]));
+      roots.push_back(ScanRoot<DIR_HANDLE>{paths[i], processors[i],
+                                           checkpoints.back().get()});
+    }
+  }
+  std::exception_ptr error;
+  try {
+    ScanDirectories(roots, filter);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // Even if scanning directories failed, the threads reading databases still
+  // refer to the filter and processors, so they have to be joined first.
+  for (auto &db : dbs) {
+    try {
+      db.get();
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
   }
 }
 
@@ -17,8 +17,14 @@
  * License along with dupa. If not, see http://www.gnu.org/licenses/.
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "scanner_int.h"
 
@@ -124,9 +130,11 @@ std::ostream &operator<<(std::ostream &stream, const NodePtr &t) {
 
 class TestProcessor : public ScanProcessor<NodePtr> {
  public:
-  void File(const boost::filesystem::path &path, const NodePtr &parent,
-            const FileInfo & /*f_info*/) override {
-    parent->entries_.insert(NodePtr(new ::File(path.native())));
+  void Files(const NodePtr &parent, const FileRecords &files) override {
+    ++batches_;
+    for (const FileRecord &file : files) {
+      parent->entries_.insert(NodePtr(new ::File(file.name_)));
+    }
   }
 
   NodePtr RootDir(const boost::filesystem::path &path) override {
@@ -142,6 +150,7 @@ class TestProcessor : public ScanProcessor<NodePtr> {
   }
 
   NodePtr root_;
+  size_t batches_{};
 };
 
 TEST(DbImport, OneFile) {
@@ -155,6 +164,30 @@ TEST(DbImport, OneFile) {
   ASSERT_EQ(p.root_, D("/ala/ma", {F("kota")}));
 }
 
+TEST(DbImport, FileInFilesystemRoot) {
+  const FileInfo fi(1, 2, 3);
+  TestProcessor p;
+  ScanDb(
+      {
+          {"/kota", fi},
+          {"/ala/kota", fi},
+      },
+      p);
+  ASSERT_EQ(p.root_, D("/", {D("ala", {F("kota")}), F("kota")}));
+}
+
+TEST(DbImport, BareFileName) {
+  const FileInfo fi(1, 2, 3);
+  TestProcessor p;
+  ScanDb(
+      {
+          {"kota", fi},
+          {"ala/kota", fi},
+      },
+      p);
+  ASSERT_EQ(p.root_, D("", {D("ala", {F("kota")}), F("kota")}));
+}
+
 TEST(DbImport, RootPrefix) {
   const FileInfo fi(1, 2, 3);
   TestProcessor p;
@@ -223,9 +256,124 @@ TEST(DbImport, ComplexTest) {
                                    D("malego", {F("kota")})}));
 }
 
+TEST(DbImport, FilesBatchedPerDir) {
+  const FileInfo fi(1, 2, 3);
+  TestProcessor p;
+  ScanDb(
+      {
+          {"/ala/ma/duzego/kota", fi},
+          {"/ala/ma/malego/kota", fi},
+          {"/ala/ma/duzego/psa", fi},
+          {"/ala/ma/malego/psa", fi},
+      },
+      p);
+  ASSERT_EQ(p.batches_, 2U);
+}
+
+TEST(DbImport, Filtered) {
+  const FileInfo small(1, 2, 3);
+  const FileInfo big(100, 2, 3);
+  TestProcessor p;
+  ScanDb(
+      {
+          {"/ala/ma/kota", big},
+          {"/ala/ma/psa", small},
+          {"/ala/ma/.git/kota", big},
+          {"/ala/.git/ma/kota", big},
+      },
+      p, ScanFilter({".git"}, {}, {}, 10, 0, false));
+  ASSERT_EQ(p.root_, D("/ala/ma", {F("kota")}));
+}
+
+TEST(DbImport, AncestorsOfRootNotFiltered) {
+  const FileInfo fi(1, 2, 3);
+  TestProcessor p;
+  // Just like a scanned directory, the directory containing all files and its
+  // ancestors are not subject to filtering.
+  ScanDb(
+      {
+          {"/x/build/a/kota", fi},
+          {"/x/build/b/kota", fi},
+          {"/x/build/b/build/kota", fi},
+      },
+      p, ScanFilter({"build"}, {}, {}, 0, 0, false));
+  ASSERT_EQ(p.root_,
+            D("/x/build", {D("a", {F("kota")}), D("b", {F("kota")})}));
+}
+
+TEST(DbImport, FromDbFile) {
+  TmpDir db_dir;
+  const std::string db_path = db_dir.dir_ + "/cache.sqlite3";
+  {
+    DBConnection db(db_path);
+    db.Exec(
+        "CREATE TABLE FileList(path TEXT UNIQUE NOT NULL, cksum INTEGER NOT "
+        "NULL, size INTEGER NOT NULL, mtime INTEGER NOT NULL)");
+    auto out = db.Prepare<std::string, Cksum, off_t, time_t>(
+        "INSERT INTO FileList(path, cksum, size, mtime) VALUES(?, ?, ?, ?)");
+    // Files of a directory are interleaved with its subdirectories' ones.
+    out->Write("/ala/ma/kota/b", 1, 1, 1);
+    out->Write("/ala/ma/kota.txt", 2, 1, 1);
+    out->Write("/ala/ma/kota/a", 3, 1, 1);
+    out->Write("/ala/ma/a", 4, 1, 1);
+    out->Write("/ala/ma/psa/a", 5, 1, 1);
+  }
+  TestProcessor p;
+  ScanDb(boost::filesystem::path(db_path), p, ScanFilter());
+  ASSERT_EQ(p.root_, D("/ala/ma", {F("a"), D("kota", {F("a"), F("b")}),
+                                   F("kota.txt"), D("psa", {F("a")})}));
+  ASSERT_EQ(p.batches_, 3U);
+}
+
+TEST(DbImport, LargeDbFileReadInRanges) {
+  TmpDir db_dir;
+  const std::string db_path = db_dir.dir_ + "/cache.sqlite3";
+  const size_t num_dirs = 100;
+  const size_t num_files = 2000 * num_dirs;
+  static_assert(2000 * num_dirs > 2 * kDbRowsPerRange, "too few ranges");
+  {
+    DBConnection db(db_path);
+    db.Exec(
+        "CREATE TABLE FileList(path TEXT UNIQUE NOT NULL, cksum INTEGER NOT "
+        "NULL, size INTEGER NOT NULL, mtime INTEGER NOT NULL)");
+    DBTransaction trans(db);
+    auto out = db.Prepare<std::string, Cksum, off_t, time_t>(
+        "INSERT INTO FileList(path, cksum, size, mtime) VALUES(?, ?, ?, ?)");
+    // Rowid order differs from path order.
+    for (size_t i = 0; i < num_files; ++i) {
+      out->Write("/r/" + std::to_string(i % num_dirs) + "/" + std::to_string(i),
+                 i + 1, 1, 1);
+    }
+    trans.Commit();
+  }
+  TestProcessor p;
+  ScanDb(boost::filesystem::path(db_path), p, ScanFilter());
+  // Every directory is created and flushed exactly once, despite its files
+  // being read by different threads.
+  ASSERT_EQ(p.batches_, num_dirs);
+  ASSERT_EQ(p.root_->Size(), num_dirs);
+  for (size_t i = 0; i < num_dirs; ++i) {
+    ASSERT_EQ(p.root_->Nth(i)->Size(), num_files / num_dirs);
+  }
+  ASSERT_EQ(ReadCacheFromDb(db_path, 4).size(), num_files);
+}
+
+TEST(LargestFirstQueue, PopsLargestFirst) {
+  detail::LargestFirstQueue<std::string> q;
+  q.Push(10, "medium");
+  q.Push(1, "small");
+  q.Push(100, "large");
+  ASSERT_EQ(q.Pop(), "large");
+  q.Push(5, "smaller");
+  ASSERT_EQ(q.Pop(), "medium");
+  ASSERT_EQ(q.Pop(), "smaller");
+  ASSERT_EQ(q.Pop(), "small");
+}
+
 TEST(FileSystem, EmptyDir) {
   TmpDir t;
   TestProcessor p;
+  HashCache::Initializer hash_cache_init("", "");
   ScanDirectory(t.dir_, p);
   ASSERT_EQ(p.root_, D(t.dir_, {}));
 }
@@ -277,6 +425,124 @@ TEST(FileSystem, ComplexStructure) {
                        F("file1")}));
 }
 
+TEST(FileSystem, FilesBatchedPerDir) {
+  TmpDir t;
+  t.CreateFile("dir1/file1", "a");
+  t.CreateFile("dir1/file2", "b");
+  t.CreateFile("dir1/file3", "c");
+  t.CreateFile("file1", "d");
+  t.CreateFile("file2", "e");
+  TestProcessor p;
+  HashCache::Initializer hash_cache_init("", "");
+  ScanDirectory(t.dir_, p);
+  ASSERT_EQ(p.root_,
+            D(t.dir_, {D("dir1", {F("file1"), F("file2"), F("file3")}),
+                       F("file1"), F("file2")}));
+  ASSERT_EQ(p.batches_, 2U);
+}
+
+TEST(FileSystem, Filtered) {
+  TmpDir t;
+  t.CreateFile("dir1/file1", "a");
+  t.CreateFile("dir1/.git/file1", "b");
+  t.CreateFile("dir1/.git/sub/file1", "b");
+  t.CreateFile("file1", "aaaaa");
+  t.CreateFile("file2.o", "aaaaa");
+  TestProcessor p;
+  HashCache::Initializer hash_cache_init("", "");
+  ScanDirectory(t.dir_, p, ScanFilter({".git", "*.o"}, {}, {}, 2, 0, false));
+  ASSERT_EQ(p.root_, D(t.dir_, {D("dir1", {}), F("file1")}));
+}
+
+TEST(FileSystem, OneFileSystem) {
+  TmpDir t;
+  t.CreateFile("dir1/file1", "a");
+  TestProcessor p;
+  HashCache::Initializer hash_cache_init("", "");
+  // All of it is on a single filesystem, so nothing should change.
+  ScanDirectory(t.dir_, p, ScanFilter({}, {}, {}, 0, 0, true));
+  ASSERT_EQ(p.root_, D(t.dir_, {D("dir1", {F("file1")})}));
+}
+
+TEST(FileSystem, ManyRoots) {
+  TmpDir t1;
+  TmpDir t2;
+  t1.CreateFile("dir1/file1", "a");
+  t1.CreateFile("file2", "b");
+  t2.CreateFile("dir1/file1", "a");
+  t2.CreateFile("dir2/file3", "c");
+  TestProcessor p1;
+  TestProcessor p2;
+  TestProcessor p3;
+  HashCache::Initializer hash_cache_init("", "");
+  ScanDirectories<NodePtr>({{t1.dir_, &p1, nullptr},
+                            {t2.dir_ + "/nonexistent", &p2, nullptr},
+                            {t2.dir_, &p3, nullptr}},
+                           ScanFilter({}, {}, {}, 0, 0, true));
+  ASSERT_EQ(p1.root_, D(t1.dir_, {D("dir1", {F("file1")}), F("file2")}));
+  ASSERT_FALSE(p2.root_);
+  ASSERT_EQ(p3.root_,
+            D(t2.dir_, {D("dir1", {F("file1")}), D("dir2", {F("file3")})}));
+}
+
+// Numbers directories in the order of creating them and checks that every
+// directory's parent has been created before it.
+class OrderCheckingProcessor : public ScanProcessor<size_t> {
+ public:
+  void Files(const size_t &parent, const FileRecords &files) override {
+    for (const FileRecord &file : files) {
+      files_.push_back(dirs_.at(parent) + "/" + file.name_);
+    }
+  }
+
+  size_t RootDir(const boost::filesystem::path &path) override {
+    dirs_.push_back(path.native());
+    return dirs_.size() - 1;
+  }
+
+  size_t Dir(const boost::filesystem::path &path,
+             const size_t &parent) override {
+    EXPECT_LT(parent, dirs_.size());
+    dirs_.push_back(dirs_.at(parent) + "/" + path.native());
+    return dirs_.size() - 1;
+  }
+
+  std::vector<std::string> dirs_;
+  std::vector<std::string> files_;
+};
+
+TEST(FileSystem, ConcurrentListingDeepAndWide) {
+  constexpr int kDepth = 40;
+  constexpr int kWidth = 10;
+  TmpDir t;
+  std::vector<std::string> expected_dirs{t.dir_};
+  std::vector<std::string> expected_files;
+  std::string chain;
+  for (int level = 0; level < kDepth; ++level) {
+    for (int i = 0; i < kWidth; ++i) {
+      const std::string leaf = chain + "leaf" + std::to_string(i);
+      t.CreateFile(leaf + "/file", std::to_string(level * kWidth + i));
+      expected_dirs.push_back(t.dir_ + "/" + leaf);
+      expected_files.push_back(t.dir_ + "/" + leaf + "/file");
+    }
+    chain += "d/";
+    t.CreateSubdir(chain);
+    expected_dirs.push_back(t.dir_ + "/" + chain.substr(0, chain.size() - 1));
+  }
+  OrderCheckingProcessor p;
+  HashCache::Initializer hash_cache_init("", "");
+  ScanDirectory(t.dir_, p, ScanFilter({}, {}, {}, 0, 0, false), nullptr);
+  // Every directory is listed by the pool of Conf().list_concurrency_ threads,
+  // and its children are created by whichever thread lists them.
+  ASSERT_GT(Conf().list_concurrency_, 1);
+  std::sort(p.dirs_.begin(), p.dirs_.end());
+  std::sort(p.files_.begin(), p.files_.end());
+  std::sort(expected_dirs.begin(), expected_dirs.end());
+  std::sort(expected_files.begin(), expected_files.end());
+  ASSERT_EQ(expected_dirs, p.dirs_);
+  ASSERT_EQ(expected_files, p.files_);
+}
+
 TEST(FileSystem, NonExistentDir) {
   TmpDir t;
   TestProcessor p;
@@ -350,3 +616,35 @@ TEST(FileSystem, DirWithNoExecPermDoesntAffectOthers) {
   ScanDirectory(t.dir_, p);
   ASSERT_EQ(p.root_, D(t.dir_, {F("a"), D("asd", {}), F("qwe")}));
 }
+
+TEST(FileSystem, UnchangedDirListingReused) {
+  TmpDir t, db_dir;
+  const std::string db = db_dir.dir_ + "/cache.sqlite3";
+  // Listings of recently modified directories are not trusted.
+  const struct timespec old_mtime[2] = {{0, UTIME_OMIT}, {1000000000, 42}};
+  t.CreateFile("a", "a");
+  ASSERT_EQ(utimensat(AT_FDCWD, t.dir_.c_str(), old_mtime, 0), 0);
+  {
+    TestProcessor p;
+    HashCache::Initializer hash_cache_init("", db);
+    ScanDirectory(t.dir_, p);
+    ASSERT_EQ(p.root_, D(t.dir_, {F("a")}));
+  }
+  // The listing is not read again if the directory's mtime is the same.
+  t.CreateFile("b", "b");
+  ASSERT_EQ(utimensat(AT_FDCWD, t.dir_.c_str(), old_mtime, 0), 0);
+  {
+    TestProcessor p;
+    HashCache::Initializer hash_cache_init(db, "");
+    ScanDirectory(t.dir_, p);
+    ASSERT_EQ(p.root_, D(t.dir_, {F("a")}));
+  }
+  const struct timespec new_mtime[2] = {{0, UTIME_OMIT}, {1000000000, 43}};
+  ASSERT_EQ(utimensat(AT_FDCWD, t.dir_.c_str(), new_mtime, 0), 0);
+  {
+    TestProcessor p;
+    HashCache::Initializer hash_cache_init(db, "");
+    ScanDirectory(t.dir_, p);
+    ASSERT_EQ(p.root_, D(t.dir_, {F("a"), F("b")}));
+  }
+}
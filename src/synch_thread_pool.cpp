@@ -19,64 +19,139 @@
 
 #include "synch_thread_pool.h"
 
-#include <memory>
+#include <algorithm>
 
-SyncThreadPool::SyncThreadPool(int concurrency)
-    : closing_(false), outstanding_(0) {
+namespace {
+
+// The pool and index of the worker running on the current thread, if any.
+thread_local const SyncThreadPool *current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+}  // anonymous namespace
+
+SyncThreadPool::SyncThreadPool(int concurrency, size_t max_queued)
+    : max_queued_(max_queued ? max_queued : concurrency + 1),
+      active_(concurrency) {
   assert(concurrency > 0);
   for (int i = 0; i < concurrency; ++i) {
-    threads_.emplace_back(std::make_unique<std::thread>(
-        std::bind(&SyncThreadPool::ThreadLoop, this)));
+    workers_.emplace_back(std::make_unique<Worker>());
+  }
+  for (int i = 0; i < concurrency; ++i) {
+    threads_.emplace_back(&SyncThreadPool::ThreadLoop, this, i);
   }
 }
 
 void SyncThreadPool::Stop() {
   {
     std::unique_lock<std::mutex> lock(mutex_);
-    user_cv_.wait(lock, [this] { return outstanding_ == 0; });
+    ++blocked_users_;
+    user_cv_.wait(lock, [this] { return queued_ == 0; });
+    --blocked_users_;
     closing_ = true;
     cv_.notify_all();
+    parked_cv_.notify_all();
   }
   for (auto &thread : threads_) {
-    thread->join();
+    thread.join();
   }
   threads_.clear();
 }
 
-void SyncThreadPool::Submit(const std::function<void()> &fun) {
-  std::unique_lock<std::mutex> lock(mutex_);
-  assert(!closing_);
-  user_cv_.wait(lock, [this] { return outstanding_ <= threads_.size(); });
-  assert(!closing_);
-  q_.push(fun);
-  ++outstanding_;
-  cv_.notify_one();
+void SyncThreadPool::Submit(Task task, SyncCounter *group) {
+  const bool from_worker = current_pool == this;
+  if (!from_worker && queued_ >= max_queued_) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++blocked_users_;
+    user_cv_.wait(lock, [this] { return queued_ < max_queued_; });
+    --blocked_users_;
+  }
+  if (group) {
+    group->Increment();
+  }
+  Worker &worker = *workers_[from_worker ? current_worker
+                                         : next_worker_++ % workers_.size()];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex_);
+    worker.tasks_.push_back(QueuedTask{std::move(task), group});
+  }
+  ++queued_;
+  if (idle_workers_ > 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+  }
+}
+
+void SyncThreadPool::SetActiveWorkers(size_t n) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  active_ = std::max<size_t>(1, std::min(n, workers_.size()));
+  cv_.notify_all();
+  parked_cv_.notify_all();
 }
 
 SyncThreadPool::~SyncThreadPool() {
-  Stop();
+  if (!threads_.empty()) {
+    Stop();
+  }
   assert(closing_);
   assert(threads_.empty());
 }
 
-void SyncThreadPool::ThreadLoop() {
+bool SyncThreadPool::TryPop(size_t idx, QueuedTask &res) {
+  {
+    Worker &own = *workers_[idx];
+    std::lock_guard<std::mutex> lock(own.mutex_);
+    if (!own.tasks_.empty()) {
+      res = std::move(own.tasks_.back());
+      own.tasks_.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker &victim = *workers_[(idx + i) % workers_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex_);
+    if (!victim.tasks_.empty()) {
+      res = std::move(victim.tasks_.front());
+      victim.tasks_.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void SyncThreadPool::ThreadLoop(size_t idx) {
+  current_pool = this;
+  current_worker = idx;
   while (true) {
-    std::function<void()> task;
-    {
+    if (idx >= active_) {
       std::unique_lock<std::mutex> lock(mutex_);
+      parked_cv_.wait(lock, [this, idx] { return idx < active_ || closing_; });
       if (closing_) {
         return;
       }
-      cv_.wait(lock, [this] { return !q_.empty() || closing_; });
+      continue;
+    }
+    QueuedTask task{Task(), nullptr};
+    if (!TryPop(idx, task)) {
+      std::unique_lock<std::mutex> lock(mutex_);
       if (closing_) {
         return;
       }
-      task = q_.front();
-      q_.pop();
-      --outstanding_;
-      user_cv_.notify_one();
+      ++idle_workers_;
+      cv_.wait(lock, [this, idx] {
+        return queued_ > 0 || closing_ || idx >= active_;
+      });
+      --idle_workers_;
+      continue;
+    }
+    --queued_;
+    if (blocked_users_ > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      user_cv_.notify_all();
+    }
+    task.task_();
+    if (task.group_) {
+      task.group_->Decrement();
     }
-    task();
   }
 }
 
@@ -90,7 +165,7 @@ void SyncCounter::Increment() {
 void SyncCounter::Decrement() {
   std::lock_guard<std::mutex> lock(m_);
   assert(cntr_ > 0);
-  if (cntr_-- == 0) {
+  if (--cntr_ == 0) {
     cv_.notify_all();
   }
 }
@@ -20,15 +20,20 @@
 #ifndef SRC_SYNCH_THREAD_POOL_H_
 #define SRC_SYNCH_THREAD_POOL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <deque>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-#include <boost/filesystem/path.hpp>
-
 class SyncCounter {
  public:
   explicit SyncCounter(size_t initial = 0);
@@ -42,27 +47,151 @@ class SyncCounter {
   volatile size_t cntr_;
 };
 
+// A move-only callable taking no arguments. Unlike std::function, it never
+// allocates - the callable is stored inline, so it has to fit in kMaxSize.
+class Task {
+ public:
+  static constexpr size_t kMaxSize = 128;
+
+  Task() = default;
+  template <typename F, typename = std::enable_if_t<
+                            !std::is_same_v<std::decay_t<F>, Task>>>
+  Task(F &&f) {  // NOLINT(runtime/explicit)
+    using Fn = std::decay_t<F>;
+    static_assert(sizeof(Fn) <= kMaxSize, "callable too big for a Task");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                  "callable over-aligned for a Task");
+    new (&storage_) Fn(std::forward<F>(f));
+    ops_ = &kOps<Fn>;
+  }
+  Task(Task &&o) noexcept { *this = std::move(o); }
+  Task &operator=(Task &&o) noexcept {
+    if (this != &o) {
+      Reset();
+      if (o.ops_) {
+        o.ops_->move_(&storage_, &o.storage_);
+        ops_ = o.ops_;
+        o.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() { Reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+  void operator()() {
+    assert(ops_);
+    ops_->call_(&storage_);
+  }
+
+ private:
+  struct Ops {
+    void (*call_)(void *);
+    // Move-constructs the callable at dst and destroys the one at src.
+    void (*move_)(void *dst, void *src);
+    void (*destroy_)(void *);
+  };
+
+  template <typename Fn>
+  static constexpr Ops kOps = {
+      [](void *f) { (*static_cast<Fn *>(f))(); },
+      [](void *dst, void *src) {
+        new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+        static_cast<Fn *>(src)->~Fn();
+      },
+      [](void *f) { static_cast<Fn *>(f)->~Fn(); },
+  };
+
+  void Reset() {
+    if (ops_) {
+      ops_->destroy_(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  std::aligned_storage_t<kMaxSize, alignof(std::max_align_t)> storage_;
+  const Ops *ops_ = nullptr;
+};
+
+// A work-stealing thread pool. Every worker has its own deque of tasks; it
+// runs tasks from the back of it and, if it's empty, steals from the front of
+// other workers' deques. Tasks submitted from within a worker land in its own
+// deque, which keeps related work on a single thread.
 class SyncThreadPool {
  public:
-  explicit SyncThreadPool(int concurrency);
+  // Submit() will block if max_queued tasks are already waiting to be run;
+  // 0 means concurrency + 1.
+  explicit SyncThreadPool(int concurrency, size_t max_queued = 0);
 
   // All Submit() calls should finish before this can be called; This needs to
   // be called before destroying this object.
   void Stop();
-  // Will block if concurrency + 1 items are already scheduled.
-  void Submit(const std::function<void()> &fun);
+  // If group is set, it's incremented now and decremented once the task is
+  // done, so that SyncCounter::WaitForZero() can be used to wait for a group
+  // of tasks. Submitting from within a task never blocks.
+  void Submit(Task task, SyncCounter *group = nullptr);
+  // Only the first n workers (at least 1, at most concurrency) will run tasks.
+  // All of them do initially.
+  void SetActiveWorkers(size_t n);
+  size_t ActiveWorkers() const { return active_; }
   ~SyncThreadPool();
 
  private:
-  void ThreadLoop();
+  struct QueuedTask {
+    Task task_;
+    SyncCounter *group_;
+  };
+  struct Worker {
+    std::mutex mutex_;
+    std::deque<QueuedTask> tasks_;
+  };
+
+  void ThreadLoop(size_t idx);
+  bool TryPop(size_t idx, QueuedTask &res);
 
-  volatile bool closing_;
-  volatile size_t outstanding_;
+  const size_t max_queued_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_worker_{0};
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> active_;
+  // Number of threads blocked on cv_ and user_cv_ respectively, so that
+  // mutex_ is only taken if there is anyone to wake up.
+  std::atomic<size_t> idle_workers_{0};
+  std::atomic<size_t> blocked_users_{0};
+  bool closing_{false};
   std::mutex mutex_;
   std::condition_variable cv_;
   std::condition_variable user_cv_;
-  std::queue<std::function<void()>> q_;
-  std::vector<std::unique_ptr<std::thread>> threads_;
+  // Inactive workers wait here, so that cv_ never wakes them up instead of an
+  // active one.
+  std::condition_variable parked_cv_;
 };
 
+// Call f(i) for every i in [0, n) using pool, if set, and wait for all of
+// them. Every task handles per_task consecutive i's.
+template <typename F>
+void ParallelFor(SyncThreadPool *pool, size_t n, const F &f, size_t per_task) {
+  if (!pool || n <= per_task) {
+    for (size_t i = 0; i < n; ++i) {
+      f(i);
+    }
+    return;
+  }
+  SyncCounter pending;
+  for (size_t begin = 0; begin < n; begin += per_task) {
+    const size_t end = std::min(n, begin + per_task);
+    pool->Submit(
+        [&f, begin, end] {
+          for (size_t i = begin; i < end; ++i) {
+            f(i);
+          }
+        },
+        &pending);
+  }
+  pending.WaitForZero();
+}
+
 #endif  // SRC_SYNCH_THREAD_POOL_H_
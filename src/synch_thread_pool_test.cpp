@@ -0,0 +1,82 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "synch_thread_pool.h"
+
+#include <atomic>
+#include <memory>
+
+#include "gtest/gtest.h"
+
+TEST(SyncThreadPool, RunsAllTasks) {
+  std::atomic<int> sum{0};
+  SyncThreadPool pool(4);
+  for (int i = 1; i <= 1000; ++i) {
+    pool.Submit([&sum, i] { sum += i; });
+  }
+  pool.Stop();
+  ASSERT_EQ(sum, 500500);
+}
+
+TEST(SyncThreadPool, MoveOnlyTasks) {
+  std::atomic<int> sum{0};
+  SyncThreadPool pool(2);
+  for (int i = 0; i < 10; ++i) {
+    auto val = std::make_unique<int>(i);
+    pool.Submit([&sum, val = std::move(val)] { sum += *val; });
+  }
+  pool.Stop();
+  ASSERT_EQ(sum, 45);
+}
+
+TEST(SyncThreadPool, WaitForGroup) {
+  std::atomic<int> first{0}, second{0};
+  SyncThreadPool pool(3, 100);
+  SyncCounter first_group, second_group;
+  for (int i = 0; i < 50; ++i) {
+    pool.Submit([&first] { ++first; }, &first_group);
+  }
+  first_group.WaitForZero();
+  ASSERT_EQ(first, 50);
+  for (int i = 0; i < 50; ++i) {
+    pool.Submit([&second] { ++second; }, &second_group);
+  }
+  second_group.WaitForZero();
+  ASSERT_EQ(second, 50);
+  pool.Stop();
+}
+
+TEST(SyncThreadPool, SubmitFromTask) {
+  // Tasks submitting tasks don't block even if the queue is full.
+  std::atomic<int> leaves{0};
+  SyncThreadPool pool(2, 1);
+  SyncCounter group;
+  for (int i = 0; i < 10; ++i) {
+    pool.Submit(
+        [&pool, &leaves, &group] {
+          for (int j = 0; j < 10; ++j) {
+            pool.Submit([&leaves] { ++leaves; }, &group);
+          }
+        },
+        &group);
+  }
+  group.WaitForZero();
+  ASSERT_EQ(leaves, 100);
+  pool.Stop();
+}
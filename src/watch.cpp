@@ -0,0 +1,338 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "watch.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "exceptions.h"
+#include "hash_cache.h"
+#include "log.h"
+#include "scan_filter.h"
+
+namespace {
+
+using boost::filesystem::path;
+
+constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |
+                                IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+// Changes are applied once no events arrive for this long...
+constexpr int kSettleMs = 1000;
+// ...or once that many of them are pending.
+constexpr size_t kMaxPending = 100000;
+
+class Watcher {
+ public:
+  Watcher(const std::string &dir,
+          const std::function<void(FuzzyDedupRes &)> &report);
+  ~Watcher();
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+
+  void Run();
+
+ private:
+  // An entry "name" in directory watched by wd.
+  using Change = std::pair<int, std::string>;
+
+  // Watch all directories in dir's subtree. Their entries are scheduled for
+  // being synced so that changes made before the watches were added are not
+  // missed.
+  void WatchSubtree(Node &dir);
+  void UnwatchSubtree(Node &dir);
+  void ReadEvents();
+  void ApplyChanges();
+  // Bring the entry of parent named name in sync with the filesystem. In the
+  // first pass only removals are handled, so that watches of removed
+  // directories are gone before any directories are added.
+  void Sync(Node &parent, const std::string &name, bool first_pass);
+
+  std::unique_ptr<IncrementalFuzzyDedup> dedup_;
+  const std::function<void(FuzzyDedupRes &)> &report_;
+  const ScanFilter filter_;
+  dev_t root_dev_{};
+  int inotify_fd_{-1};
+  int signal_fd_{-1};
+  std::unordered_map<int, Node *> wd_to_dir_;
+  std::unordered_map<const Node *, int> dir_to_wd_;
+  std::vector<Change> pending_;
+};
+
+Watcher::Watcher(const std::string &dir,
+                 const std::function<void(FuzzyDedupRes &)> &report)
+    : report_(report), filter_(ScanFilter::FromConf()) {
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    throw FsException(errno, "inotify_init1");
+  }
+  dedup_ = std::make_unique<IncrementalFuzzyDedup>(dir, true);
+  Node *root = dedup_->GetRoot();
+  if (!root) {
+    throw FsException(ENOENT, "scanning '" + dir + "'");
+  }
+  if (filter_.OneFileSystem()) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) {
+      throw FsException(errno, "stat on '" + dir + "'");
+    }
+    root_dev_ = st.st_dev;
+  }
+  WatchSubtree(*root);
+
+  // Signals are only blocked now so that the initial scan can be interrupted.
+  // Threads started later inherit the mask.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+  signal_fd_ = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (signal_fd_ < 0) {
+    throw FsException(errno, "signalfd");
+  }
+}
+
+Watcher::~Watcher() {
+  if (signal_fd_ >= 0) {
+    close(signal_fd_);
+  }
+  close(inotify_fd_);
+}
+
+void Watcher::Run() {
+  while (!pending_.empty()) {
+    ApplyChanges();
+  }
+  {
+    FuzzyDedupRes res = dedup_->Update();
+    report_(res);
+  }
+  LOG(INFO, "Watching for changes; send SIGUSR1 to get a report");
+  while (true) {
+    pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {signal_fd_, POLLIN, 0}};
+    const int res = poll(fds, 2, pending_.empty() ? -1 : kSettleMs);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw FsException(errno, "poll");
+    }
+    if (res == 0 || pending_.size() >= kMaxPending) {
+      ApplyChanges();
+    }
+    if (fds[0].revents & POLLIN) {
+      ReadEvents();
+    }
+    if (fds[1].revents & POLLIN) {
+      signalfd_siginfo info;
+      if (read(signal_fd_, &info, sizeof(info)) != sizeof(info)) {
+        throw FsException(errno, "read signalfd");
+      }
+      if (info.ssi_signo != SIGUSR1) {
+        LOG(INFO, "Stopped watching");
+        return;
+      }
+      while (!pending_.empty()) {
+        ApplyChanges();
+      }
+      FuzzyDedupRes dedup_res = dedup_->Update();
+      report_(dedup_res);
+    }
+  }
+}
+
+void Watcher::WatchSubtree(Node &dir) {
+  dir.TraversePreOrder([this](Node *node) {
+    if (node->GetType() != Node::DIR) {
+      return;
+    }
+    const path dir_path = node->BuildPath();
+    const int wd =
+        inotify_add_watch(inotify_fd_, dir_path.native().c_str(), kWatchMask);
+    if (wd < 0) {
+      // Most likely fs.inotify.max_user_watches is too low.
+      LOG(ERROR, "not watching \"" << dir_path.native() << "\" because "
+                                   << FsException(errno, "watching").what());
+      return;
+    }
+    wd_to_dir_[wd] = node;
+    dir_to_wd_[node] = wd;
+    for (const Node *child : node->GetChildren()) {
+      pending_.emplace_back(wd, child->GetName());
+    }
+    try {
+      for (boost::filesystem::directory_iterator it(dir_path);
+           it != boost::filesystem::directory_iterator(); ++it) {
+        pending_.emplace_back(wd, it->path().filename().native());
+      }
+    } catch (const std::exception &e) {
+      LOG(ERROR, "not syncing \"" << dir_path.native() << "\" because "
+                                  << e.what());
+    }
+  });
+}
+
+void Watcher::UnwatchSubtree(Node &dir) {
+  dir.Traverse([this](Node *node) {
+    auto it = dir_to_wd_.find(node);
+    if (it == dir_to_wd_.end()) {
+      return;
+    }
+    inotify_rm_watch(inotify_fd_, it->second);
+    wd_to_dir_.erase(it->second);
+    dir_to_wd_.erase(it);
+  });
+}
+
+void Watcher::ReadEvents() {
+  alignas(inotify_event) char buf[64 * 1024];
+  while (true) {
+    const ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      throw FsException(errno, "read inotify events");
+    }
+    for (const char *p = buf; p < buf + len;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(p);
+      p += sizeof(inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG(WARNING, "Some changes were lost, resyncing everything");
+        for (const auto &wd_and_dir : wd_to_dir_) {
+          Node *dir = wd_and_dir.second;
+          for (const Node *child : dir->GetChildren()) {
+            pending_.emplace_back(wd_and_dir.first, child->GetName());
+          }
+          pending_.emplace_back(wd_and_dir.first, std::string());
+        }
+      } else if (event->mask & IN_IGNORED) {
+        // The directory is gone or was unwatched by us.
+        auto it = wd_to_dir_.find(event->wd);
+        if (it != wd_to_dir_.end()) {
+          dir_to_wd_.erase(it->second);
+          wd_to_dir_.erase(it);
+        }
+      } else if (event->len > 0) {
+        pending_.emplace_back(event->wd, event->name);
+      }
+    }
+  }
+}
+
+void Watcher::ApplyChanges() {
+  std::vector<Change> changes;
+  changes.swap(pending_);
+  std::sort(changes.begin(), changes.end());
+  changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+  DLOG("Applying " << changes.size() << " changes");
+  for (bool first_pass : {true, false}) {
+    for (const auto &[wd, name] : changes) {
+      auto it = wd_to_dir_.find(wd);
+      if (it == wd_to_dir_.end()) {
+        continue;  // the directory is gone
+      }
+      if (name.empty()) {
+        // Resync the whole directory listing.
+        if (!first_pass) {
+          try {
+            for (boost::filesystem::directory_iterator entry(
+                     it->second->BuildPath());
+                 entry != boost::filesystem::directory_iterator(); ++entry) {
+              pending_.emplace_back(wd, entry->path().filename().native());
+            }
+          } catch (const std::exception &e) {
+            LOG(ERROR, "not syncing \"" << it->second->BuildPath().native()
+                                        << "\" because " << e.what());
+          }
+        }
+        continue;
+      }
+      Sync(*it->second, name, first_pass);
+    }
+  }
+}
+
+void Watcher::Sync(Node &parent, const std::string &name, bool first_pass) {
+  const path entry_path = parent.BuildPath() / name;
+  Node *existing = parent.FindChild(name);
+
+  struct stat st;
+  const bool exists = lstat(entry_path.native().c_str(), &st) == 0;
+  const bool is_dir = exists && S_ISDIR(st.st_mode) &&
+                      filter_.AcceptsDir(entry_path) &&
+                      (!filter_.OneFileSystem() || st.st_dev == root_dev_);
+  const bool is_file = exists && S_ISREG(st.st_mode) &&
+                       filter_.AcceptsFile(entry_path) &&
+                       filter_.AcceptsSize(st.st_size);
+
+  if (existing && !(existing->GetType() == Node::DIR ? is_dir : is_file)) {
+    DLOG("Removing \"" << entry_path.native() << "\"");
+    UnwatchSubtree(*existing);
+    dedup_->Remove(*existing);
+    existing = nullptr;
+  }
+  if (first_pass) {
+    return;
+  }
+  if (is_dir && !existing) {
+    DLOG("Adding \"" << entry_path.native() << "\"");
+    Node *added = dedup_->AddDir(parent, entry_path);
+    if (added) {
+      WatchSubtree(*added);
+    }
+  } else if (is_file) {
+    try {
+      const FileInfo f_info = HashCache::Get()(entry_path);
+      if (f_info.sum_) {
+        dedup_->UpdateFile(parent, name, f_info);
+      } else if (existing) {
+        dedup_->Remove(*existing);
+      }
+    } catch (const std::exception &e) {
+      LOG(ERROR, "skipping \"" << entry_path.native()
+                               << "\" because analyzing it yielded "
+                               << e.what());
+    }
+  }
+}
+
+}  // anonymous namespace
+
+void WatchAndDedup(const std::string &dir,
+                   const std::function<void(FuzzyDedupRes &)> &report) {
+  Watcher watcher(dir, report);
+  watcher.Run();
+}
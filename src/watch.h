@@ -0,0 +1,36 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef SRC_WATCH_H_
+#define SRC_WATCH_H_
+
+#include <functional>
+#include <string>
+
+#include "fuzzy_dedup.h"
+
+// Analyze dir like FuzzyDedup() and keep the results up to date by watching it
+// for changes using inotify(7). Changed files are rehashed (through the
+// HashCache) and only their ancestors are re-evaluated. report is called with
+// the results once the initial scan is done and then every time SIGUSR1 is
+// received. Returns on SIGINT or SIGTERM.
+void WatchAndDedup(const std::string &dir,
+                   const std::function<void(FuzzyDedupRes &)> &report);
+
+#endif  // SRC_WATCH_H_
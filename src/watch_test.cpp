@@ -0,0 +1,117 @@
+/*
+ * (C) Copyright 2018 Marek Dopiera
+ *
+ * This file is part of dupa.
+ *
+ * dupa is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dupa is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with dupa. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include "watch.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem/operations.hpp>
+
+#include "gtest/gtest.h"
+#include "hash_cache.h"
+#include "test_common.h"
+
+class WatchTest : public ::testing::Test {
+ protected:
+  using Step = std::function<void(FuzzyDedupRes &)>;
+
+  void SetUp() override { pthread_sigmask(SIG_SETMASK, nullptr, &old_mask_); }
+  void TearDown() override {
+    pthread_sigmask(SIG_SETMASK, &old_mask_, nullptr);
+  }
+
+  // Watch tmp_. Every report is handed to the next of steps. Changes made by a
+  // step are reported to the following one, which is requested by SIGUSR1.
+  // Watching stops after the last step.
+  void Watch(const std::vector<Step> &steps) {
+    HashCache::Initializer hash_cache_init("", "");
+    size_t step = 0;
+    WatchAndDedup(tmp_.dir_, [&](FuzzyDedupRes &res) {
+      ASSERT_LT(step, steps.size());
+      nodes_.clear();
+      res.first->Traverse([this](const Node *n) {
+        nodes_.emplace(n->BuildPath().native(), n);
+      });
+      steps[step++](res);
+      // WatchAndDedup() blocks these signals, so they wait for its signalfd.
+      kill(getpid(), step < steps.size() ? SIGUSR1 : SIGTERM);
+    });
+    ASSERT_EQ(steps.size(), step);
+  }
+
+  const Node *Find(const std::string &rel_path) {
+    auto it = nodes_.find(tmp_.dir_ + "/" + rel_path);
+    return it == nodes_.end() ? nullptr : it->second;
+  }
+
+  bool Dups(const std::string &p1, const std::string &p2) {
+    return &Find(p1)->GetEqClass() == &Find(p2)->GetEqClass();
+  }
+
+  TmpDir tmp_;
+  sigset_t old_mask_;
+  std::unordered_map<std::string, const Node *> nodes_;
+};
+
+TEST_F(WatchTest, ModifiedFile) {
+  tmp_.CreateFile("a/f", "xx");
+  tmp_.CreateFile("b/f", "y");
+  Watch({[this](FuzzyDedupRes &) {
+           ASSERT_FALSE(Dups("a", "b"));
+           tmp_.CreateFile("b/f", "xx");
+         },
+         [this](FuzzyDedupRes &) { ASSERT_TRUE(Dups("a", "b")); }});
+}
+
+TEST_F(WatchTest, AddedDir) {
+  tmp_.CreateFile("a/f1", "x");
+  tmp_.CreateFile("a/f2", "y");
+  Watch({[this](FuzzyDedupRes &) {
+           ASSERT_EQ(nullptr, Find("b"));
+           tmp_.CreateFile("b/c/f1", "x");
+           tmp_.CreateFile("b/c/f2", "y");
+         },
+         [this](FuzzyDedupRes &) {
+           ASSERT_NE(nullptr, Find("b/c/f2"));
+           ASSERT_TRUE(Dups("a", "b/c"));
+         }});
+}
+
+TEST_F(WatchTest, RemovedDir) {
+  tmp_.CreateFile("a/f", "x");
+  tmp_.CreateFile("b/f", "x");
+  tmp_.CreateFile("c/f", "y");
+  Watch({[this](FuzzyDedupRes &) {
+           ASSERT_TRUE(Dups("a", "b"));
+           boost::filesystem::remove_all(tmp_.dir_ + "/b");
+         },
+         [this](FuzzyDedupRes &res) {
+           ASSERT_EQ(nullptr, Find("b"));
+           ASSERT_EQ(2U, res.first->GetChildren().size());
+           ASSERT_FALSE(Dups("a", "c"));
+           // The class "b" shared with "a" only has one node left.
+           ASSERT_TRUE(Find("a")->GetEqClass().IsSingle());
+         }});
+}